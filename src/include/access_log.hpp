@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "access_record.hpp"
+#include "plugin.hpp"
+#include "spsc_ring.hpp"
+
+// Structured access log. IO threads fill an AccessRecord per request and push it into
+// their own ring buffer; a background thread collects the records and appends them to
+// the current file in batches. Files roll over by size and age and are named
+// access-YYYYmmdd-HHMMSS.bin. Convert them with src/tools/accesslog2json.cpp.
+class AccessLog {
+   public:
+    ~AccessLog() {
+        stop();
+    }
+
+    bool enabled() const {
+        return running_.load(std::memory_order_relaxed);
+    }
+
+    void start(const std::string& dir, long max_file_bytes, long rotate_seconds, std::size_t buffer_size) {
+        if (running_.load()) return;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            _LOGGER_.error("Access log disabled, cannot create " + dir + ": " + ec.message());
+            return;
+        }
+        dir_ = dir;
+        max_file_bytes_ = max_file_bytes;
+        rotate_after_ = std::chrono::seconds(rotate_seconds);
+        rings_.set_capacity(buffer_size);
+        if (!open_file()) return;
+        running_.store(true);
+        writer_ = std::thread([this] { write_loop(); });
+    }
+
+    // Flushes the queued records and closes the file.
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake_.notify_one();
+        if (writer_.joinable()) writer_.join();
+    }
+
+    void record(const AccessRecord& record) {
+        if (!enabled()) return;
+        rings_.push(AccessRecord(record));
+    }
+
+    static void setMethod(AccessRecord& record, std::string_view method) {
+        std::size_t n = std::min(method.size(), sizeof(record.method));
+        std::memcpy(record.method, method.data(), n);
+    }
+    static void setRoute(AccessRecord& record, std::string_view route) {
+        std::size_t n = std::min(route.size(), sizeof(record.route));
+        std::memcpy(record.route, route.data(), n);
+        record.route_length = static_cast<std::uint8_t>(n);
+    }
+
+   private:
+    bool open_file() {
+        char stamp[32];
+        std::time_t now = std::time(nullptr);
+        std::tm tm{};
+#ifdef _WIN32
+        localtime_s(&tm, &now);
+#else
+        localtime_r(&now, &tm);
+#endif
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        std::string path = dir_ + "/access-" + stamp + ".bin";
+        for (int i = 1; std::filesystem::exists(path); i++) {
+            path = dir_ + "/access-" + stamp + "-" + std::to_string(i) + ".bin";
+        }
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            _LOGGER_.error("Could not open access log " + path);
+            return false;
+        }
+        AccessLogHeader header;
+        header.record_size = sizeof(AccessRecord);
+        std::fwrite(&header, sizeof(header), 1, file_);
+        file_bytes_ = sizeof(header);
+        opened_at_ = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void rotate_if_needed() {
+        bool too_big = max_file_bytes_ > 0 && file_bytes_ >= max_file_bytes_;
+        bool too_old = rotate_after_.count() > 0 && std::chrono::steady_clock::now() - opened_at_ >= rotate_after_;
+        // An empty file is not rotated for age alone.
+        if (!too_big && !(too_old && file_bytes_ > static_cast<long>(sizeof(AccessLogHeader)))) return;
+        // The next file is opened by the next batch, so idle periods leave no empty files.
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+
+    void write_loop() {
+        std::uint64_t dropped = 0;
+        while (true) {
+            bool stopping = !running_.load();
+            batch_.clear();
+            rings_.drain(
+                [&](const auto&, const AccessRecord& record) { batch_.push_back(record); },
+                [&](const auto&, std::uint64_t count) { dropped += count; });
+            if (dropped > 0) {
+                _LOGGER_.warning("Access log buffer full, dropped " + std::to_string(dropped) + " records.");
+                dropped = 0;
+            }
+            if (!batch_.empty() && (file_ || open_file())) {
+                std::fwrite(batch_.data(), sizeof(AccessRecord), batch_.size(), file_);
+                std::fflush(file_);
+                file_bytes_ += static_cast<long>(batch_.size() * sizeof(AccessRecord));
+            }
+            if (file_) rotate_if_needed();
+            if (!batch_.empty()) continue;
+            if (stopping) break;
+            // Records are written in batches a few times per second rather than one by one.
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait_for(lock, std::chrono::milliseconds(200));
+        }
+        if (file_) {
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    std::atomic<bool> running_{false};
+    per_thread_rings<AccessRecord> rings_{8192};
+    std::thread writer_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+
+    // Writer thread only.
+    std::string dir_;
+    std::FILE* file_ = nullptr;
+    long file_bytes_ = 0;
+    long max_file_bytes_ = 0;
+    std::chrono::seconds rotate_after_{0};
+    std::chrono::steady_clock::time_point opened_at_;
+    std::vector<AccessRecord> batch_;
+};
+
+AccessLog _ACCESS_LOG_;
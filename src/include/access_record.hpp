@@ -0,0 +1,31 @@
+#ifndef ACCESS_RECORD_HPP
+#define ACCESS_RECORD_HPP
+
+#include <cstdint>
+
+// On-disk format of the binary access log. A file starts with an AccessLogHeader
+// followed by back-to-back AccessRecords, all in the writer's native byte order.
+// Kept free of other includes so tools can read the files without the server headers.
+
+struct AccessLogHeader {
+    char magic[8] = {'C', 'R', 'A', 'C', 'C', 'L', 'O', 'G'};
+    std::uint32_t version = 1;
+    std::uint32_t record_size = 0;
+};
+static_assert(sizeof(AccessLogHeader) == 16, "AccessLogHeader layout changed");
+
+struct AccessRecord {
+    std::uint64_t time_us = 0;      // Unix time the request was parsed, in microseconds
+    std::uint64_t bytes = 0;        // Response body bytes
+    std::uint64_t handler_ns = 0;   // Time spent inside the handler
+    std::uint64_t total_ns = 0;     // From the request being parsed to its response being written
+    std::uint8_t address[16] = {};  // Remote address as IPv6, IPv4 mapped to ::ffff:a.b.c.d
+    std::uint16_t port = 0;         // Remote port
+    std::uint16_t status = 0;
+    char method[8] = {};            // NUL padded, truncated
+    std::uint8_t route_length = 0;
+    char route[83] = {};            // Matched route pattern, or the path for the default handler; truncated
+};
+static_assert(sizeof(AccessRecord) == 144, "AccessRecord layout changed, bump AccessLogHeader::version");
+
+#endif
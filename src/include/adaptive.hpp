@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "metrics.hpp"
+#include "plugin.hpp"
+
+// Adaptive heavy/light execution. Handler times of routes left on Execution::Auto are
+// collected per route in short windows; when a window closes its p95 decides where the
+// route runs next: above heavy_ns it moves to the worker pool, below light_ns it moves
+// back to the IO threads. The gap between the two thresholds keeps a route from
+// flapping. Handler time excludes queueing, so a route can recover while on the pool.
+class AdaptiveExecution {
+   public:
+    void configure(bool enabled, std::uint64_t heavy_ns, std::uint64_t light_ns, std::uint32_t window) {
+        heavy_ns_.store(heavy_ns, std::memory_order_relaxed);
+        light_ns_.store(light_ns < heavy_ns ? light_ns : heavy_ns, std::memory_order_relaxed);
+        window_.store(window > min_samples ? window : min_samples, std::memory_order_relaxed);
+        enabled_.store(enabled, std::memory_order_relaxed);
+        if (enabled) return;
+        for (auto& route : routes_) route.heavy.store(false, std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Where an Auto request of this route runs right now.
+    bool heavy(std::uint32_t route_id) const {
+        return route_id < Metrics::max_routes && routes_[route_id].heavy.load(std::memory_order_relaxed);
+    }
+
+    void record(std::uint32_t route_id, std::uint64_t handler_ns) {
+        if (!enabled() || route_id >= Metrics::max_routes) return;
+        RouteWindow& w = routes_[route_id];
+        w.buckets[LatencyHistogram::index(handler_ns)].fetch_add(1, std::memory_order_relaxed);
+        std::uint32_t count = w.count.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        std::int64_t now = now_ns();
+        std::int64_t opened = w.opened_ns.load(std::memory_order_relaxed);
+        if (opened == 0) {
+            w.opened_ns.compare_exchange_strong(opened, now, std::memory_order_relaxed);
+            return;
+        }
+        // A window closes when full, or after a second for routes with little traffic.
+        bool full = count >= window_.load(std::memory_order_relaxed);
+        bool stale = count >= min_samples && now - opened >= 1000000000;
+        if (!full && !stale) return;
+        // Whoever resets the count evaluates the window.
+        if (!w.count.compare_exchange_strong(count, 0, std::memory_order_relaxed)) return;
+        w.opened_ns.store(now, std::memory_order_relaxed);
+        evaluate(route_id, w);
+    }
+
+   private:
+    // Fewer samples than this say little about a p95.
+    static constexpr std::uint32_t min_samples = 20;
+
+    struct alignas(64) RouteWindow {
+        std::atomic<bool> heavy{false};
+        std::atomic<std::uint32_t> count{0};
+        std::atomic<std::int64_t> opened_ns{0};
+        std::array<std::atomic<std::uint32_t>, LatencyHistogram::bucket_count> buckets{};
+    };
+
+    void evaluate(std::uint32_t route_id, RouteWindow& w) {
+        std::array<std::uint32_t, LatencyHistogram::bucket_count> buckets;
+        std::uint64_t total = 0;
+        for (int i = 0; i < LatencyHistogram::bucket_count; i++) {
+            buckets[i] = w.buckets[i].exchange(0, std::memory_order_relaxed);
+            total += buckets[i];
+        }
+        if (total < min_samples) return;
+        std::uint64_t rank = total * 95 / 100;
+        std::uint64_t seen = 0;
+        std::uint64_t p95 = LatencyHistogram::upper_bound(LatencyHistogram::bucket_count - 2);
+        for (int i = 0; i < LatencyHistogram::bucket_count - 1; i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                p95 = LatencyHistogram::upper_bound(i);
+                break;
+            }
+        }
+
+        bool heavy = w.heavy.load(std::memory_order_relaxed);
+        if (!heavy && p95 > heavy_ns_.load(std::memory_order_relaxed)) {
+            w.heavy.store(true, std::memory_order_relaxed);
+            _LOGGER_.log("Route " + _METRICS_.routeName(route_id) + " moved to the worker pool (p95 " + std::to_string(p95 / 1000) + " us)");
+        } else if (heavy && p95 < light_ns_.load(std::memory_order_relaxed)) {
+            w.heavy.store(false, std::memory_order_relaxed);
+            _LOGGER_.log("Route " + _METRICS_.routeName(route_id) + " moved back to the IO threads (p95 " + std::to_string(p95 / 1000) + " us)");
+        }
+    }
+
+    static std::int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<std::uint64_t> heavy_ns_{0};
+    std::atomic<std::uint64_t> light_ns_{0};
+    std::atomic<std::uint32_t> window_{200};
+    std::array<RouteWindow, Metrics::max_routes> routes_;
+};
+
+AdaptiveExecution _ADAPTIVE_;
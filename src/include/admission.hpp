@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "metrics.hpp"
+#include "request.hpp"
+
+// Admission control. Limits (0 = unlimited) on open sessions, requests being handled
+// and queued heavy work, globally and per route. Everything is plain atomics checked
+// before any handler runs; a rejected request gets one pre-serialized 503 with
+// Retry-After and its connection is closed, so shedding load costs almost nothing.
+class Admission {
+   public:
+    struct Limits {
+        long sessions = 0;
+        long inflight = 0;
+        long heavy_queue = 0;
+        // Route label (as in IPlugin::routes()) -> heavy requests queued or running.
+        std::unordered_map<std::string, long> routes;
+        // Stop accepting at the session limit instead of answering with 503.
+        bool pause_accept = false;
+        int retry_after = 1;
+    };
+
+    void configure(Limits limits) {
+        Response res(503, "Service Unavailable");
+        res.setHeader("Retry-After", std::to_string(limits.retry_after));
+        res.setBody("Service Unavailable");
+        std::atomic_store(&rejection_, std::shared_ptr<const SerializedResponse>(SerializedResponse::from(res)));
+        res.setConnection("close");
+        std::atomic_store(&rejection_closing_, std::shared_ptr<const SerializedResponse>(SerializedResponse::from(res)));
+
+        max_sessions_.store(limits.sessions, std::memory_order_relaxed);
+        max_inflight_.store(limits.inflight, std::memory_order_relaxed);
+        max_heavy_queue_.store(limits.heavy_queue, std::memory_order_relaxed);
+        pause_accept_.store(limits.pause_accept, std::memory_order_relaxed);
+        route_limit_names_ = std::move(limits.routes);
+    }
+
+    // Looks up the per-route limit of a route; call while building the router.
+    void bindRoute(const std::string& route, std::uint32_t route_id) {
+        if (route_id >= Metrics::max_routes) return;
+        auto it = route_limit_names_.find(route);
+        route_limits_[route_id].store(it == route_limit_names_.end() ? 0 : it->second, std::memory_order_relaxed);
+    }
+
+    // Sessions
+    bool pauseAccept() const {
+        return pause_accept_.load(std::memory_order_relaxed);
+    }
+    bool sessionsFull() const {
+        long max = max_sessions_.load(std::memory_order_relaxed);
+        return max > 0 && sessions_.load(std::memory_order_relaxed) >= max;
+    }
+    void sessionOpened() { sessions_.fetch_add(1, std::memory_order_relaxed); }
+    void sessionClosed() { sessions_.fetch_sub(1, std::memory_order_relaxed); }
+
+    // Requests. admit() reserves a slot that release() gives back once the handler is done.
+    bool admit(bool heavy, std::uint32_t route_id, std::size_t heavy_queue_depth) {
+        long max = max_inflight_.load(std::memory_order_relaxed);
+        if (max > 0 && inflight_.load(std::memory_order_relaxed) >= max) return reject(Metrics::RejectInflight);
+        if (heavy) {
+            long max_queue = max_heavy_queue_.load(std::memory_order_relaxed);
+            if (max_queue > 0 && static_cast<long>(heavy_queue_depth) >= max_queue) return reject(Metrics::RejectHeavyQueue);
+            if (route_id < Metrics::max_routes) {
+                long route_max = route_limits_[route_id].load(std::memory_order_relaxed);
+                long queued = route_heavy_[route_id].fetch_add(1, std::memory_order_relaxed);
+                if (route_max > 0 && queued >= route_max) {
+                    route_heavy_[route_id].fetch_sub(1, std::memory_order_relaxed);
+                    return reject(Metrics::RejectRouteQueue);
+                }
+            }
+        }
+        inflight_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    void release(bool heavy, std::uint32_t route_id) {
+        inflight_.fetch_sub(1, std::memory_order_relaxed);
+        if (heavy && route_id < Metrics::max_routes) route_heavy_[route_id].fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // The 503 sent to shed a request; `closing` includes Connection: close for raw writes.
+    std::shared_ptr<const SerializedResponse> rejection(bool closing = false) const {
+        return std::atomic_load(closing ? &rejection_closing_ : &rejection_);
+    }
+    bool reject(Metrics::Rejection reason) {
+        _METRICS_.rejected(reason);
+        return false;
+    }
+
+   private:
+    std::atomic<long> max_sessions_{0};
+    std::atomic<long> max_inflight_{0};
+    std::atomic<long> max_heavy_queue_{0};
+    std::atomic<bool> pause_accept_{false};
+    std::atomic<long> sessions_{0};
+    std::atomic<long> inflight_{0};
+    std::array<std::atomic<long>, Metrics::max_routes> route_limits_{};
+    std::array<std::atomic<long>, Metrics::max_routes> route_heavy_{};
+    std::unordered_map<std::string, long> route_limit_names_;
+    std::shared_ptr<const SerializedResponse> rejection_;
+    std::shared_ptr<const SerializedResponse> rejection_closing_;
+};
+
+Admission _ADMISSION_;
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "plugin.hpp"
+
+#ifdef CROUTER_ASYNC
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "worker_pool.hpp"
+
+// Outbound TCP connection handed to async plugins. The socket lives in shared state
+// so a pending read or write stays valid even if the plugin drops the object; the
+// request's SessionAsyncIO holds it weakly, to close it on cancellation.
+class SessionAsyncSocket : public IAsyncSocket {
+   public:
+    explicit SessionAsyncSocket(std::shared_ptr<boost::asio::ip::tcp::socket> socket) : state_(std::make_shared<State>(std::move(socket))) {}
+    ~SessionAsyncSocket() override {
+        close();
+    }
+
+    void startRead(std::size_t max_bytes, std::function<void(std::string)> done) override {
+        auto state = state_;
+        state->read_buffer.resize(max_bytes > 0 ? max_bytes : 1);
+        state->socket->async_read_some(boost::asio::buffer(state->read_buffer),
+            [state, done = std::move(done)](const boost::system::error_code& ec, std::size_t n) {
+                done(ec ? std::string() : state->read_buffer.substr(0, n));
+            });
+    }
+    void startWrite(std::string data, std::function<void(bool)> done) override {
+        auto state = state_;
+        auto buffer = std::make_shared<std::string>(std::move(data));
+        boost::asio::async_write(*state->socket, boost::asio::buffer(*buffer),
+            [state, buffer, done = std::move(done)](const boost::system::error_code& ec, std::size_t) {
+                done(!ec);
+            });
+    }
+    void close() override {
+        boost::system::error_code ec;
+        state_->socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        state_->socket->close(ec);
+    }
+
+   private:
+    struct State {
+        explicit State(std::shared_ptr<boost::asio::ip::tcp::socket> s) : socket(std::move(s)) {}
+        std::shared_ptr<boost::asio::ip::tcp::socket> socket;
+        std::string read_buffer;
+    };
+    std::shared_ptr<State> state_;
+};
+
+// IAsyncIO for one request. Timers and sockets are created on the session's executor,
+// so their completions resume the coroutine there. File reads are plain blocking reads
+// on a worker thread, posted back to the session once done.
+class SessionAsyncIO : public IAsyncIO {
+   public:
+    SessionAsyncIO(boost::asio::any_io_executor executor, WorkerPool& worker_pool)
+        : executor_(std::move(executor)), worker_pool_(worker_pool) {}
+
+    void startSleep(long ms, std::function<void(bool)> done) override {
+        if (cancelled_) {
+            boost::asio::post(executor_, [done = std::move(done)]() { done(false); });
+            return;
+        }
+        auto timer = std::make_shared<boost::asio::steady_timer>(executor_, std::chrono::milliseconds(ms));
+        timer->async_wait([timer, done = std::move(done)](const boost::system::error_code& ec) {
+            done(!ec);
+        });
+        track(timers_, timer);
+    }
+
+    // Called on the session's executor when the request is cancelled: pending sleeps
+    // resume with false, lookups and connects fail, outbound sockets are closed so
+    // their reads and writes complete with an error, and later calls fail at once.
+    // The coroutine winds down instead of waiting on a backend that may never answer.
+    void cancel() {
+        cancelled_ = true;
+        for (auto& weak : timers_) {
+            if (auto timer = weak.lock()) timer->cancel();
+        }
+        for (auto& weak : resolvers_) {
+            if (auto resolver = weak.lock()) resolver->cancel();
+        }
+        for (auto& weak : sockets_) {
+            if (auto socket = weak.lock()) {
+                boost::system::error_code ec;
+                socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                socket->close(ec);
+            }
+        }
+        timers_.clear();
+        resolvers_.clear();
+        sockets_.clear();
+    }
+
+    void startReadFile(const std::string& path, std::function<void(std::optional<std::string>)> done) override {
+        worker_pool_.post([path, done = std::move(done), executor = executor_]() mutable {
+            std::optional<std::string> data;
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            if (in) {
+                std::string content(static_cast<std::size_t>(in.tellg()), '\0');
+                in.seekg(0);
+                if (in.read(content.data(), static_cast<std::streamsize>(content.size()))) data = std::move(content);
+            }
+            boost::asio::post(executor, [done = std::move(done), data = std::move(data)]() mutable {
+                done(std::move(data));
+            });
+        });
+    }
+
+    void startConnect(const std::string& host, const std::string& port, std::function<void(std::unique_ptr<IAsyncSocket>)> done) override {
+        if (cancelled_) {
+            boost::asio::post(executor_, [done = std::move(done)]() { done(nullptr); });
+            return;
+        }
+        auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(executor_);
+        auto socket = std::make_shared<boost::asio::ip::tcp::socket>(executor_);
+        track(resolvers_, resolver);
+        track(sockets_, socket);
+        resolver->async_resolve(host, port,
+            [resolver, socket, done = std::move(done)](const boost::system::error_code& ec,
+                                                       boost::asio::ip::tcp::resolver::results_type results) mutable {
+                if (ec) {
+                    done(nullptr);
+                    return;
+                }
+                boost::asio::async_connect(*socket, results,
+                    [socket, done = std::move(done)](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint&) {
+                        // A cancel() between the lookup and here closed the socket: the connect fails.
+                        if (ec || !socket->is_open()) {
+                            done(nullptr);
+                            return;
+                        }
+                        done(std::make_unique<SessionAsyncSocket>(socket));
+                    });
+            });
+    }
+
+   private:
+    template <class T>
+    static void track(std::vector<std::weak_ptr<T>>& list, const std::shared_ptr<T>& item) {
+        list.erase(std::remove_if(list.begin(), list.end(), [](const auto& weak) { return weak.expired(); }), list.end());
+        list.push_back(item);
+    }
+
+    boost::asio::any_io_executor executor_;
+    WorkerPool& worker_pool_;
+    std::vector<std::weak_ptr<boost::asio::steady_timer>> timers_;
+    std::vector<std::weak_ptr<boost::asio::ip::tcp::resolver>> resolvers_;
+    std::vector<std::weak_ptr<boost::asio::ip::tcp::socket>> sockets_;
+    bool cancelled_ = false;
+};
+
+#endif
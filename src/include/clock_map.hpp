@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+// Byte-bounded map with CLOCK (second chance) eviction, an approximation of LRU.
+// A hit only sets the entry's reference bit, so lookups take a shared lock and never
+// reorder anything: concurrent readers don't serialize on each other. Writers take the
+// exclusive lock; eviction sweeps the clock hand, clearing reference bits until it finds
+// an entry that was not used since the last sweep.
+template <typename K, typename V>
+class clock_map {
+   private:
+    struct Slot {
+        K key;
+        V val;
+        long bytes = 0;
+        bool used = false;
+        mutable std::atomic<bool> referenced{false};
+    };
+    std::vector<Slot> slots;
+    std::vector<std::size_t> free_slots;
+    std::unordered_map<K, std::size_t> index;
+    std::size_t hand;
+    long bytes;
+    std::function<long(const V&)> func;
+    mutable std::shared_mutex mtx;
+
+    void erase_slot(std::size_t i) {
+        Slot& slot = slots[i];
+        index.erase(slot.key);
+        bytes -= slot.bytes;
+        slot.key = K();
+        slot.val = V();
+        slot.bytes = 0;
+        slot.used = false;
+        slot.referenced.store(false, std::memory_order_relaxed);
+        free_slots.push_back(i);
+    }
+    void evict_one() {
+        if (index.empty()) return;
+        while (true) {
+            if (hand >= slots.size()) hand = 0;
+            Slot& slot = slots[hand];
+            if (slot.used) {
+                if (!slot.referenced.exchange(false, std::memory_order_relaxed)) {
+                    erase_slot(hand++);
+                    return;
+                }
+            }
+            hand++;
+        }
+    }
+    std::size_t take_slot() {
+        if (!free_slots.empty()) {
+            std::size_t i = free_slots.back();
+            free_slots.pop_back();
+            return i;
+        }
+        // Slots hold atomics, so the vector is grown by rebuilding it.
+        std::vector<Slot> grown(slots.size() ? slots.size() * 2 : 16);
+        for (std::size_t i = 0; i < slots.size(); i++) {
+            grown[i].key = std::move(slots[i].key);
+            grown[i].val = std::move(slots[i].val);
+            grown[i].bytes = slots[i].bytes;
+            grown[i].used = slots[i].used;
+            grown[i].referenced.store(slots[i].referenced.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        for (std::size_t i = grown.size(); i-- > slots.size() + 1;) free_slots.push_back(i);
+        std::size_t i = slots.size();
+        slots = std::move(grown);
+        return i;
+    }
+
+   public:
+    long max_bytes;
+    clock_map(std::function<long(const V&)> one_element_size, long max_bytes) : hand(0), bytes(0), func(std::move(one_element_size)), max_bytes(max_bytes) {}
+
+    std::optional<V> find(const K& key) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it == index.end()) return std::nullopt;
+        const Slot& slot = slots[it->second];
+        if (!slot.referenced.load(std::memory_order_relaxed)) {
+            slot.referenced.store(true, std::memory_order_relaxed);
+        }
+        return slot.val;
+    }
+    void put(const K& key, const V& val) {
+        long val_bytes = func(val);
+        if (val_bytes > max_bytes) throw std::runtime_error("clock_map::put(const K& key, const V& val): val bigger than max_bytes");
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it != index.end()) erase_slot(it->second);
+        while (bytes + val_bytes > max_bytes && !index.empty()) evict_one();
+        std::size_t i = take_slot();
+        Slot& slot = slots[i];
+        slot.key = key;
+        slot.val = val;
+        slot.bytes = val_bytes;
+        slot.used = true;
+        slot.referenced.store(false, std::memory_order_relaxed);
+        index.emplace(key, i);
+        bytes += val_bytes;
+    }
+    bool exists(const K& key) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return index.find(key) != index.end();
+    }
+    void remove(const K& key) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it != index.end()) erase_slot(it->second);
+    }
+    int size() const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return static_cast<int>(index.size());
+    }
+    long byte_size() const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return bytes;
+    }
+    clock_map() = delete;
+    clock_map(const clock_map&) = delete;
+    clock_map& operator=(const clock_map&) = delete;
+};
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "request.hpp"
+
+// Brotli is used when its encoder is installed (link with -lbrotlienc); define
+// CROUTER_NO_BROTLI to build without it.
+#if !defined(CROUTER_NO_BROTLI) && __has_include(<brotli/encode.h>)
+#include <brotli/encode.h>
+#define CROUTER_BROTLI 1
+#endif
+
+// Response compression, applied after the handler. The encoding is negotiated from
+// Accept-Encoding when the request arrives; whether a response gets it depends on its
+// status, content type and size. Bodies are fed to the encoder in place and only the
+// compressed output is built, so a response never holds two full copies of its body.
+class Compression {
+   public:
+    enum Encoding : std::uint8_t { Identity, Gzip, Deflate, Brotli };
+
+    // Sets of encodings, e.g. the variants a file has on disk.
+    static constexpr unsigned bit(Encoding encoding) {
+        return 1u << encoding;
+    }
+
+    void configure(bool enabled, long min_bytes, int level, int brotli_quality, long offload_bytes) {
+        enabled_.store(enabled, std::memory_order_relaxed);
+        min_bytes_.store(min_bytes > 0 ? static_cast<std::size_t>(min_bytes) : 0, std::memory_order_relaxed);
+        level_.store(std::clamp(level, 1, 9), std::memory_order_relaxed);
+        brotli_quality_.store(std::clamp(brotli_quality, 0, 11), std::memory_order_relaxed);
+        offload_bytes_.store(offload_bytes > 0 ? static_cast<std::size_t>(offload_bytes) : 0, std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    static bool brotliAvailable() {
+#ifdef CROUTER_BROTLI
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static const char* name(Encoding encoding) {
+        switch (encoding) {
+            case Gzip: return "gzip";
+            case Deflate: return "deflate";
+            case Brotli: return "br";
+            default: return "identity";
+        }
+    }
+
+    // Encodings this build can produce.
+    static unsigned encodable() {
+        return bit(Gzip) | bit(Deflate) | (brotliAvailable() ? bit(Brotli) : 0);
+    }
+
+    // The best encoding the client accepts: highest q-value, ties going to br, gzip,
+    // then deflate. Identity when compression is off or nothing matches.
+    Encoding negotiate(const Request& req) const {
+        if (!enabled() || req.method == "HEAD") return Identity;
+        const std::string* accept = req.header("Accept-Encoding");
+        if (!accept) return Identity;
+        return negotiate(*accept, encodable());
+    }
+
+    // Same, limited to the encodings in `available`.
+    static Encoding negotiate(std::string_view accept, unsigned available) {
+        // q-values in thousandths; -1 = not mentioned.
+        int q[4] = {-1, -1, -1, -1};
+        int any = -1;
+        std::size_t pos = 0;
+        while (pos < accept.size()) {
+            std::size_t end = accept.find(',', pos);
+            if (end == std::string_view::npos) end = accept.size();
+            std::string_view item = trim(accept.substr(pos, end - pos));
+            pos = end + 1;
+            std::size_t semi = item.find(';');
+            std::string_view coding = trim(item.substr(0, semi));
+            int quality = 1000;
+            if (semi != std::string_view::npos) quality = parse_q(item.substr(semi + 1));
+            if (iequals(coding, "gzip") || iequals(coding, "x-gzip")) q[Gzip] = quality;
+            else if (iequals(coding, "deflate")) q[Deflate] = quality;
+            else if (iequals(coding, "br")) q[Brotli] = quality;
+            else if (coding == "*") any = quality;
+        }
+        Encoding best = Identity;
+        int best_q = 0;
+        for (Encoding encoding : {Brotli, Gzip, Deflate}) {
+            if (!(available & bit(encoding))) continue;
+            int quality = q[encoding] >= 0 ? q[encoding] : any;
+            if (quality > best_q) {
+                best = encoding;
+                best_q = quality;
+            }
+        }
+        return best;
+    }
+
+    // A response whose representation depends on Accept-Encoding: compressible type,
+    // big enough, not already encoded. Its caches need "Vary: Accept-Encoding".
+    bool varies(const Response& res) const {
+        if (!enabled() || res.serialized() || res.fileBody()) return false;
+        int status = res.getStatus();
+        if (status < 200 || status == 204 || status == 206 || status == 304) return false;
+        if (res.getHeader("Content-Encoding")) return false;
+        if (const std::string* cache_control = res.getHeader("Cache-Control")) {
+            if (cache_control->find("no-transform") != std::string::npos) return false;
+        }
+        const std::string* type = res.getHeader("Content-Type");
+        if (!type || !compressible(*type)) return false;
+        return res.body().size() >= min_bytes_.load(std::memory_order_relaxed);
+    }
+
+    // Bodies this large are compressed on the worker pool when they come from an IO thread.
+    bool offload(const Response& res) const {
+        std::size_t limit = offload_bytes_.load(std::memory_order_relaxed);
+        return limit > 0 && res.body().size() >= limit;
+    }
+
+    // Compresses `res` with `encoding` if it qualifies, and marks it as varying by
+    // Accept-Encoding either way. Kept as is if the output would not be smaller.
+    void apply(Response& res, Encoding encoding) const {
+        if (!varies(res)) return;
+        addVary(res);
+        if (encoding == Identity) return;
+        std::string out;
+        if (!encode(res.body(), encoding, out) || out.size() >= res.body().size()) return;
+        res.setContentEncoding(name(encoding));
+        res.setBody(std::move(out));
+        // A different representation needs a different strong ETag; Request::notModified
+        // still matches it against the identity one.
+        const std::string* etag = res.getHeader("ETag");
+        if (etag && etag->size() >= 2 && etag->back() == '"') {
+            res.setETag(etag->substr(0, etag->size() - 1) + "-" + name(encoding) + "\"");
+        }
+    }
+
+    // Compresses `in` into `out` at the configured level.
+    bool encode(std::string_view in, Encoding encoding, std::string& out) const {
+        if (encoding == Brotli) return encodeBrotli(in, brotli_quality_.load(std::memory_order_relaxed), out);
+        return encodeZlib(in, encoding, level_.load(std::memory_order_relaxed), out);
+    }
+
+    // Text, JSON, JavaScript, XML, SVG and WebAssembly.
+    static bool compressible(std::string_view type) {
+        type = trim(type.substr(0, type.find(';')));
+        if (type.size() >= 5 && iequals(type.substr(0, 5), "text/")) return true;
+        for (std::string_view suffix : {"json", "javascript", "xml", "svg+xml", "wasm"}) {
+            if (type.size() > suffix.size() && iequals(type.substr(type.size() - suffix.size()), suffix)) {
+                char before = type[type.size() - suffix.size() - 1];
+                if (before == '/' || before == '+' || before == '-') return true;
+            }
+        }
+        return false;
+    }
+
+    static void addVary(Response& res) {
+        const std::string* vary = res.getHeader("Vary");
+        if (!vary) {
+            res.setHeader("Vary", "Accept-Encoding");
+        } else if (vary->find("Accept-Encoding") == std::string::npos && *vary != "*") {
+            res.setHeader("Vary", *vary + ", Accept-Encoding");
+        }
+    }
+
+    // gzip or zlib-wrapped deflate (what "deflate" means in HTTP), fed in one pass from
+    // the caller's buffer and drained into `out` in steps.
+    static bool encodeZlib(std::string_view in, Encoding encoding, int level, std::string& out) {
+        z_stream zs{};
+        int window_bits = encoding == Gzip ? 15 + 16 : 15;
+        if (deflateInit2(&zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        zs.avail_in = static_cast<uInt>(in.size());
+        out.clear();
+        out.reserve(in.size() / 4 + 64);
+        int ret = Z_OK;
+        while (ret == Z_OK) {
+            std::size_t used = out.size();
+            out.resize(used + out_step);
+            zs.next_out = reinterpret_cast<Bytef*>(out.data() + used);
+            zs.avail_out = static_cast<uInt>(out_step);
+            ret = deflate(&zs, Z_FINISH);
+            out.resize(used + out_step - zs.avail_out);
+        }
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END;
+    }
+
+    static bool encodeBrotli(std::string_view in, int quality, std::string& out) {
+#ifdef CROUTER_BROTLI
+        BrotliEncoderState* state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        if (!state) return false;
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, static_cast<std::uint32_t>(quality));
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT, static_cast<std::uint32_t>(std::min<std::size_t>(in.size(), 1u << 30)));
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+        std::size_t available_in = in.size();
+        const std::uint8_t* next_in = reinterpret_cast<const std::uint8_t*>(in.data());
+        out.clear();
+        out.reserve(in.size() / 4 + 64);
+        bool ok = true;
+        while (ok && !BrotliEncoderIsFinished(state)) {
+            std::size_t used = out.size();
+            out.resize(used + out_step);
+            std::size_t available_out = out_step;
+            std::uint8_t* next_out = reinterpret_cast<std::uint8_t*>(out.data() + used);
+            ok = BrotliEncoderCompressStream(state, BROTLI_OPERATION_FINISH, &available_in, &next_in, &available_out, &next_out, nullptr);
+            out.resize(used + out_step - available_out);
+        }
+        BrotliEncoderDestroyInstance(state);
+        return ok;
+#else
+        (void)in;
+        (void)quality;
+        (void)out;
+        return false;
+#endif
+    }
+
+   private:
+    static constexpr std::size_t out_step = 16 * 1024;
+
+    static std::string_view trim(std::string_view s) {
+        std::size_t begin = s.find_first_not_of(" \t");
+        if (begin == std::string_view::npos) return {};
+        std::size_t end = s.find_last_not_of(" \t");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    static bool iequals(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    }
+
+    // "q=0.5" -> 500; anything unparsable counts as 1.
+    static int parse_q(std::string_view params) {
+        std::size_t pos = params.find("q=");
+        if (pos == std::string_view::npos) return 1000;
+        std::string_view value = trim(params.substr(pos + 2));
+        int q = 0;
+        int scale = 1000;
+        bool fraction = false;
+        for (char c : value) {
+            if (c == '.') {
+                fraction = true;
+            } else if (c >= '0' && c <= '9') {
+                if (!fraction) {
+                    q = (c - '0') * 1000;
+                } else if (scale > 1) {
+                    scale /= 10;
+                    q += (c - '0') * scale;
+                }
+            } else {
+                break;
+            }
+        }
+        return std::min(q, 1000);
+    }
+
+    std::atomic<bool> enabled_{true};
+    std::atomic<std::size_t> min_bytes_{1024};
+    std::atomic<int> level_{6};
+    std::atomic<int> brotli_quality_{5};
+    std::atomic<std::size_t> offload_bytes_{64 * 1024};
+};
+
+Compression _COMPRESSION_;
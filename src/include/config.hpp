@@ -7,22 +7,89 @@
 #include <sstream>
 #include <iostream>
 
+#include "adaptive.hpp"
+#include "admission.hpp"
+#include "compression.hpp"
+#include "deadline.hpp"
 #include "plugin.hpp"
 
 struct Config {
     // Server
     int port = 8080;
+    int keep_alive_timeout = 5;
+    int max_keep_alive_requests = 100;
+    long max_body_bytes = 10 * 1024 * 1024;
+    bool io_sharding = false;
+    int worker_threads = 0;
+    std::string worker_pool = "shared";
+
+    // HTTP/2 (h2c)
+    bool http2 = true;
+    int http2_max_streams = 100;
+    int http2_idle_timeout = 60;
+
+    // Response compression
+    bool compression = true;
+    long compression_min_bytes = 1024;
+    int compression_level = 6;
+    int brotli_quality = 5;
+    long compression_offload_kb = 64;
+
+    // TLS
+    bool tls = false;
+    std::string tls_cert = "./tls/cert.pem";
+    std::string tls_key = "./tls/key.pem";
+    long tls_session_cache = 20480;
+    bool tls_session_tickets = true;
+    bool ktls = true;
+
+    // Admission control (0 = unlimited)
+    long max_sessions = 0;
+    long max_inflight = 0;
+    long max_heavy_queue = 0;
+    std::string heavy_route_limits = "";
+    std::string overload_accept = "reject";
+    int retry_after = 1;
+
+    // Handler deadlines (0 = none)
+    long handler_timeout_ms = 0;
+    std::string route_timeouts = "";
+
+    // Adaptive heavy/light execution
+    bool adaptive_heavy = true;
+    long heavy_p95_us = 2000;
+    long light_p95_us = 500;
+    int adaptive_window = 200;
     
     // Plugin Loader
     bool default_request_handler = true;
     bool cache = true;
-    bool cache_size_kb = 65356;
+    long cache_size_kb = 65356;
+    int cache_shards = 16;
+    std::string cache_policy = "lru";
+    bool cache_preserialized = false;
     bool html_routing = true;
+    bool public_index = true;
+    long negative_cache_size = 10000;
+    int sendfile_threshold_kb = 256;
+    bool precompress = false;
+    long etag_cache_size = 10000;
 
     //CUSTOM_DEFAULT_HANDLER
     std::string custom_default_handler = "none";
 
 
+    // Logging
+    std::string log_level = "info";
+    int log_sample_rate = 1;
+    long log_buffer_size = 4096;
+    bool metrics = false;
+    std::string metrics_path = "/metrics";
+    bool access_log = false;
+    std::string access_log_dir = "./logs";
+    long access_log_max_mb = 64;
+    long access_log_rotate_minutes = 60;
+
     //Debugging
     bool debug_mode = false;
 };
@@ -60,6 +127,26 @@ std::unordered_map<std::string, std::string> parseEnvFile(const std::string& fil
 
     return env;
 }   
+
+// "GET /slow/:ms=4|/api/*=20": route labels as declared by the plugins, '|' separated.
+std::unordered_map<std::string, long> parseRouteValues(const std::string& list, const std::string& setting) {
+    std::unordered_map<std::string, long> values;
+    std::stringstream items(list);
+    std::string item;
+    while (std::getline(items, item, '|')) {
+        auto eq = item.rfind('=');
+        if (eq == std::string::npos) continue;
+        std::string route = item.substr(0, eq);
+        route.erase(0, route.find_first_not_of(" \t"));
+        route.erase(route.find_last_not_of(" \t") + 1);
+        try {
+            values[route] = std::stol(item.substr(eq + 1));
+        } catch (const std::exception&) {
+            _LOGGER_.warning("Invalid " + setting + " entry: " + item);
+        }
+    }
+    return values;
+}
 }
 
 void loadConfig(const std::string& filename) {
@@ -67,6 +154,70 @@ void loadConfig(const std::string& filename) {
     const std::unordered_map<std::string, std::string> env = env_parser::parseEnvFile(filename);
     if (env.count("SERVER_PORT"))
         config.port = std::stoi(env.at("SERVER_PORT"));
+    if (env.count("KEEP_ALIVE_TIMEOUT"))
+        config.keep_alive_timeout = std::stoi(env.at("KEEP_ALIVE_TIMEOUT"));
+    if (env.count("MAX_KEEP_ALIVE_REQUESTS"))
+        config.max_keep_alive_requests = std::stoi(env.at("MAX_KEEP_ALIVE_REQUESTS"));
+    if (env.count("MAX_BODY_BYTES"))
+        config.max_body_bytes = std::stol(env.at("MAX_BODY_BYTES"));
+    if(env.count("IO_SHARDING"))
+        config.io_sharding = (env.at("IO_SHARDING") == "true" || env.at("IO_SHARDING") == "1");
+    if (env.count("WORKER_THREADS"))
+        config.worker_threads = std::stoi(env.at("WORKER_THREADS"));
+    if (env.count("WORKER_POOL"))
+        config.worker_pool = env.at("WORKER_POOL");
+    if(env.count("HTTP2"))
+        config.http2 = (env.at("HTTP2") == "true" || env.at("HTTP2") == "1");
+    if (env.count("HTTP2_MAX_STREAMS"))
+        config.http2_max_streams = std::stoi(env.at("HTTP2_MAX_STREAMS"));
+    if (env.count("HTTP2_IDLE_TIMEOUT"))
+        config.http2_idle_timeout = std::stoi(env.at("HTTP2_IDLE_TIMEOUT"));
+    if(env.count("COMPRESSION"))
+        config.compression = (env.at("COMPRESSION") == "true" || env.at("COMPRESSION") == "1");
+    if (env.count("COMPRESSION_MIN_BYTES"))
+        config.compression_min_bytes = std::stol(env.at("COMPRESSION_MIN_BYTES"));
+    if (env.count("COMPRESSION_LEVEL"))
+        config.compression_level = std::stoi(env.at("COMPRESSION_LEVEL"));
+    if (env.count("BROTLI_QUALITY"))
+        config.brotli_quality = std::stoi(env.at("BROTLI_QUALITY"));
+    if (env.count("COMPRESSION_OFFLOAD_KB"))
+        config.compression_offload_kb = std::stol(env.at("COMPRESSION_OFFLOAD_KB"));
+    if(env.count("TLS"))
+        config.tls = (env.at("TLS") == "true" || env.at("TLS") == "1");
+    if (env.count("TLS_CERT"))
+        config.tls_cert = env.at("TLS_CERT");
+    if (env.count("TLS_KEY"))
+        config.tls_key = env.at("TLS_KEY");
+    if (env.count("TLS_SESSION_CACHE"))
+        config.tls_session_cache = std::stol(env.at("TLS_SESSION_CACHE"));
+    if(env.count("TLS_SESSION_TICKETS"))
+        config.tls_session_tickets = (env.at("TLS_SESSION_TICKETS") == "true" || env.at("TLS_SESSION_TICKETS") == "1");
+    if(env.count("KTLS"))
+        config.ktls = (env.at("KTLS") == "true" || env.at("KTLS") == "1");
+    if (env.count("MAX_SESSIONS"))
+        config.max_sessions = std::stol(env.at("MAX_SESSIONS"));
+    if (env.count("MAX_INFLIGHT"))
+        config.max_inflight = std::stol(env.at("MAX_INFLIGHT"));
+    if (env.count("MAX_HEAVY_QUEUE"))
+        config.max_heavy_queue = std::stol(env.at("MAX_HEAVY_QUEUE"));
+    if (env.count("HEAVY_ROUTE_LIMITS"))
+        config.heavy_route_limits = env.at("HEAVY_ROUTE_LIMITS");
+    if (env.count("OVERLOAD_ACCEPT"))
+        config.overload_accept = env.at("OVERLOAD_ACCEPT");
+    if (env.count("RETRY_AFTER"))
+        config.retry_after = std::stoi(env.at("RETRY_AFTER"));
+    if (env.count("HANDLER_TIMEOUT_MS"))
+        config.handler_timeout_ms = std::stol(env.at("HANDLER_TIMEOUT_MS"));
+    if (env.count("ROUTE_TIMEOUTS"))
+        config.route_timeouts = env.at("ROUTE_TIMEOUTS");
+    if(env.count("ADAPTIVE_HEAVY"))
+        config.adaptive_heavy = (env.at("ADAPTIVE_HEAVY") == "true" || env.at("ADAPTIVE_HEAVY") == "1");
+    if (env.count("HEAVY_P95_US"))
+        config.heavy_p95_us = std::stol(env.at("HEAVY_P95_US"));
+    if (env.count("LIGHT_P95_US"))
+        config.light_p95_us = std::stol(env.at("LIGHT_P95_US"));
+    if (env.count("ADAPTIVE_WINDOW"))
+        config.adaptive_window = std::stoi(env.at("ADAPTIVE_WINDOW"));
     if(env.count("DEBUG_MODE")) 
         config.debug_mode = (env.at("DEBUG_MODE") == "true" || env.at("DEBUG_MODE") == "1");
     if(env.count("DEFAULT_REQUEST_HANDLER")) 
@@ -76,12 +227,66 @@ void loadConfig(const std::string& filename) {
         config.cache = 
             (env.at("CACHE") == "true" || env.at("CACHE") == "1");
     if (env.count("CACHE_SIZE_KB"))
-        config.cache_size_kb = std::stoi(env.at("CACHE_SIZE_KB"));
+        config.cache_size_kb = std::stol(env.at("CACHE_SIZE_KB"));
+    if (env.count("CACHE_SHARDS"))
+        config.cache_shards = std::stoi(env.at("CACHE_SHARDS"));
+    if (env.count("CACHE_POLICY"))
+        config.cache_policy = env.at("CACHE_POLICY");
+    if(env.count("CACHE_PRESERIALIZED"))
+        config.cache_preserialized =
+            (env.at("CACHE_PRESERIALIZED") == "true" || env.at("CACHE_PRESERIALIZED") == "1");
+    if(env.count("PUBLIC_INDEX"))
+        config.public_index =
+            (env.at("PUBLIC_INDEX") == "true" || env.at("PUBLIC_INDEX") == "1");
+    if (env.count("NEGATIVE_CACHE_SIZE"))
+        config.negative_cache_size = std::stol(env.at("NEGATIVE_CACHE_SIZE"));
+    if (env.count("SENDFILE_THRESHOLD_KB"))
+        config.sendfile_threshold_kb = std::stoi(env.at("SENDFILE_THRESHOLD_KB"));
+    if (env.count("ETAG_CACHE_SIZE"))
+        config.etag_cache_size = std::stol(env.at("ETAG_CACHE_SIZE"));
+    if(env.count("PRECOMPRESS"))
+        config.precompress =
+            (env.at("PRECOMPRESS") == "true" || env.at("PRECOMPRESS") == "1");
     if (env.count("CUSTOM_DEFAULT_HANDLER"))
         config.custom_default_handler = env.at("CUSTOM_DEFAULT_HANDLER");
     if(env.count("HTML_ROUTING")) 
         config.html_routing = 
             (env.at("HTML_ROUTING") == "true" || env.at("HTML_ROUTING") == "1");
+    if (env.count("LOG_LEVEL"))
+        config.log_level = env.at("LOG_LEVEL");
+    if (env.count("LOG_SAMPLE_RATE"))
+        config.log_sample_rate = std::stoi(env.at("LOG_SAMPLE_RATE"));
+    if (env.count("LOG_BUFFER_SIZE"))
+        config.log_buffer_size = std::stol(env.at("LOG_BUFFER_SIZE"));
+    if(env.count("METRICS"))
+        config.metrics = (env.at("METRICS") == "true" || env.at("METRICS") == "1");
+    if (env.count("METRICS_PATH"))
+        config.metrics_path = env.at("METRICS_PATH");
+    if(env.count("ACCESS_LOG"))
+        config.access_log = (env.at("ACCESS_LOG") == "true" || env.at("ACCESS_LOG") == "1");
+    if (env.count("ACCESS_LOG_DIR"))
+        config.access_log_dir = env.at("ACCESS_LOG_DIR");
+    if (env.count("ACCESS_LOG_MAX_MB"))
+        config.access_log_max_mb = std::stol(env.at("ACCESS_LOG_MAX_MB"));
+    if (env.count("ACCESS_LOG_ROTATE_MINUTES"))
+        config.access_log_rotate_minutes = std::stol(env.at("ACCESS_LOG_ROTATE_MINUTES"));
+
+    Admission::Limits limits;
+    limits.sessions = config.max_sessions;
+    limits.inflight = config.max_inflight;
+    limits.heavy_queue = config.max_heavy_queue;
+    limits.pause_accept = config.overload_accept == "pause";
+    limits.retry_after = config.retry_after;
+    limits.routes = env_parser::parseRouteValues(config.heavy_route_limits, "HEAVY_ROUTE_LIMITS");
+    _ADMISSION_.configure(std::move(limits));
+    RequestParser::setMaxBodyBytes(static_cast<std::size_t>(std::max(config.max_body_bytes, 0L)));
+    _COMPRESSION_.configure(config.compression, config.compression_min_bytes, config.compression_level,
+                            config.brotli_quality, config.compression_offload_kb * 1024);
+    _DEADLINES_.configure(config.handler_timeout_ms, env_parser::parseRouteValues(config.route_timeouts, "ROUTE_TIMEOUTS"));
+    _ADAPTIVE_.configure(config.adaptive_heavy, config.heavy_p95_us * 1000, config.light_p95_us * 1000,
+                         static_cast<std::uint32_t>(config.adaptive_window > 0 ? config.adaptive_window : 0));
+
+    _LOGGER_.configure(Logger::parseLevel(config.log_level), config.log_sample_rate, config.log_buffer_size);
 }
 
 #endif
\ No newline at end of file
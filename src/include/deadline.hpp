@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "metrics.hpp"
+
+// Handler deadlines. Every request gets HANDLER_TIMEOUT_MS unless its route has its own
+// entry in ROUTE_TIMEOUTS (0 = no deadline). Like the admission limits, per-route values
+// are bound to route ids when the router is built, so the lookup is an array index.
+class Deadlines {
+   public:
+    Deadlines() {
+        for (auto& route : routes_) route.store(-1, std::memory_order_relaxed);
+    }
+
+    void configure(long default_ms, std::unordered_map<std::string, long> routes) {
+        default_ns_.store(to_ns(default_ms), std::memory_order_relaxed);
+        route_names_ = std::move(routes);
+        for (auto& route : routes_) route.store(-1, std::memory_order_relaxed);
+    }
+
+    // Looks up the timeout of a route; call while building the router.
+    void bindRoute(const std::string& route, std::uint32_t route_id) {
+        if (route_id >= Metrics::max_routes) return;
+        auto it = route_names_.find(route);
+        routes_[route_id].store(it == route_names_.end() ? -1 : to_ns(it->second), std::memory_order_relaxed);
+    }
+
+    // Handler time allowed for a request of this route, 0 for none.
+    std::int64_t timeoutNs(std::uint32_t route_id) const {
+        if (route_id < Metrics::max_routes) {
+            std::int64_t ns = routes_[route_id].load(std::memory_order_relaxed);
+            if (ns >= 0) return ns;
+        }
+        return default_ns_.load(std::memory_order_relaxed);
+    }
+
+   private:
+    static std::int64_t to_ns(long ms) {
+        return ms > 0 ? static_cast<std::int64_t>(ms) * 1000000 : 0;
+    }
+
+    std::atomic<std::int64_t> default_ns_{0};
+    // -1 = the route has no entry of its own.
+    std::array<std::atomic<std::int64_t>, Metrics::max_routes> routes_;
+    std::unordered_map<std::string, long> route_names_;
+};
+
+Deadlines _DEADLINES_;
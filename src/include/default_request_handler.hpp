@@ -1,31 +1,144 @@
 #pragma once
 #include <mime_type.h>
 
+#include <sys/stat.h>
+
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
+#include "compression.hpp"
 #include "config.hpp"
+#include "metrics.hpp"
+#include "precompress.hpp"
 #include "request.hpp"
+#include "public_index.hpp"
 #include "resources.hpp"
-#include "lru_map.hpp"
+#include "sharded_cache.hpp"
 
 
 
 namespace _default_req_handler {
-lru_map<std::string, std::string>* cache = nullptr;
+// Cached files are immutable shared buffers: responses reference them directly,
+// and an entry evicted while still being sent stays alive until the write is done.
+using cache_t = sharded_cache<std::string, std::shared_ptr<const std::string>>;
+
+// With CACHE_PRESERIALIZED the cache holds whole responses (status line, headers and
+// body) per file and encoding, so a hit is written out without any formatting. The
+// session does not compress a serialized response, so entries are stored already
+// encoded, keyed by the encoding negotiated for the request that built them.
+// The file's mtime and size are kept to rebuild the entry once the file changes, and
+// the set of precompressed variants because it decides whether the response varies.
+struct CachedResponse {
+    std::shared_ptr<const SerializedResponse> response;
+    std::filesystem::file_time_type mtime;
+    std::uintmax_t size;
+    unsigned variants;
+};
+using response_cache_t = sharded_cache<std::string, std::shared_ptr<const CachedResponse>>;
+
+std::string variant_key(const std::string& path, const char* encoding) {
+    return path + '\n' + encoding;
+}
+
+// Body cache entries are per file version, so an edited file is never answered with
+// its old content (or with content that does not match its ETag).
+std::string content_key(const PublicFile& file) {
+    return file.key + '\n' + std::to_string(file.mtime.time_since_epoch().count()) + '\n' + std::to_string(file.size);
+}
+
+// Validators for conditional requests, computed once per file version: the content
+// hash is taken the first time a version is served and kept until mtime or size change.
+// Streamed files are not read for it; their ETag comes from inode, size and mtime.
+struct Validators {
+    std::string etag;
+    std::string last_modified;
+    std::filesystem::file_time_type mtime;
+    std::uintmax_t size;
+};
+using validator_cache_t = sharded_cache<std::string, std::shared_ptr<const Validators>>;
+
+// 404s are answered with one response serialized at load time (swapped atomically, as
+// IO threads copy it while a reload runs), and misses on the on-disk path are remembered
+// (per generation of the ./public watcher, keyed without the query) so repeated probes
+// for missing paths skip the filesystem entirely.
+std::shared_ptr<const SerializedResponse> not_found_response = nullptr;
+using negative_cache_t = sharded_cache<std::string, std::uint64_t>;
+
+// The caches built by one load(), each null when disabled. A reload publishes a new
+// set atomically; requests already running finish with the set they loaded, and the
+// old one is freed with the last of them.
+struct Caches {
+    std::unique_ptr<cache_t> cache;
+    std::unique_ptr<response_cache_t> response_cache;
+    std::unique_ptr<validator_cache_t> validator_cache;
+    std::unique_ptr<negative_cache_t> negative_cache;
+};
+std::shared_ptr<const Caches> caches = std::make_shared<const Caches>();
+
 void load(){
-    if(CONF.cache) {
-        cache = new lru_map<std::string, std::string>([](std::string str) -> long {
-            return str.size();
+    // Without the index the watcher still runs, only to invalidate the negative cache.
+    _PUBLIC_INDEX_.stopWatching();
+    _PRECOMPRESSOR_.stop();
+    _PUBLIC_INDEX_.build("./public", CONF.public_index);
+    if (CONF.precompress) {
+        _PRECOMPRESSOR_.start("./public", static_cast<std::size_t>(std::max(CONF.compression_min_bytes, 0L)));
+        _PUBLIC_INDEX_.onFileChanged([](const std::filesystem::path& path) {
+            _PRECOMPRESSOR_.enqueue(path);
         });
+    } else {
+        _PUBLIC_INDEX_.onFileChanged(nullptr);
     }
-}
+    _PUBLIC_INDEX_.watch();
 
-Response func(Request& req) {
     Response res;
+    res.setStatus(404, "Not Found");
+    res.setContentType("text/html");
+    res.setBody("<h1>404 Not Found</h1>");
+    std::atomic_store(&not_found_response, std::shared_ptr<const SerializedResponse>(SerializedResponse::from(res)));
+
+    auto next = std::make_shared<Caches>();
+    if (!CONF.public_index && CONF.negative_cache_size > 0) {
+        next->negative_cache = std::make_unique<negative_cache_t>([](const std::uint64_t&) -> long {
+            return 1;
+        }, CONF.negative_cache_size, CONF.cache_shards, negative_cache_t::Policy::CLOCK);
+    }
+
+    if (CONF.etag_cache_size > 0) {
+        next->validator_cache = std::make_unique<validator_cache_t>([](const std::shared_ptr<const Validators>&) -> long {
+            return 1;
+        }, CONF.etag_cache_size, CONF.cache_shards, validator_cache_t::Policy::CLOCK);
+    }
+
+    if(CONF.cache && CONF.cache_preserialized) {
+        next->response_cache = std::make_unique<response_cache_t>([](const std::shared_ptr<const CachedResponse>& entry) -> long {
+            return entry->response->message.size();
+        }, CONF.cache_size_kb * 1024, CONF.cache_shards,
+            CONF.cache_policy == "clock" ? response_cache_t::Policy::CLOCK : response_cache_t::Policy::LRU);
+    } else if(CONF.cache) {
+        next->cache = std::make_unique<cache_t>([](const std::shared_ptr<const std::string>& str) -> long {
+            return str->size();
+        }, CONF.cache_size_kb * 1024, CONF.cache_shards,
+            CONF.cache_policy == "clock" ? cache_t::Policy::CLOCK : cache_t::Policy::LRU);
+    }
+    std::atomic_store(&caches, std::shared_ptr<const Caches>(std::move(next)));
+}
+
+Response not_found() {
+    Response res(404, "Not Found");
+    res.setSerialized(std::atomic_load(&not_found_response));
+    return res;
+}
+
+enum class Lookup { Found, NotFound, Forbidden };
 
-    std::string path = req.uri;
+// Looks the file up on disk for every request; used when PUBLIC_INDEX is off. `path`
+// is the request path without its query. Only error_code overloads are used, so a
+// miss never throws.
+Lookup probe(std::string path, std::shared_ptr<const PublicFile>& out) {
+    std::error_code ec;
     if (path == "/") {
         path = "/index.html";
     } else if (CONF.html_routing) {
@@ -39,7 +152,7 @@ Response func(Request& req) {
             std::string current_route = path.substr(0, next_slash);
             std::string potential_path = "./public" + current_route + ".html";
 
-            if (std::filesystem::is_regular_file(potential_path)) {
+            if (std::filesystem::is_regular_file(potential_path, ec)) {
                 path = current_route + ".html";
                 break;
             }
@@ -47,95 +160,268 @@ Response func(Request& req) {
             current_slash = next_slash;
         }
     }
-    if (req.method == "GET") {
-        try {
-            std::filesystem::path public_root = std::filesystem::canonical("./public");
-            if (path.empty() || path == "/") {
-                path = "/index.html";
-            }
+    std::filesystem::path public_root = std::filesystem::canonical("./public", ec);
+    if (ec) return Lookup::NotFound;
+    if (path.empty() || path == "/") {
+        path = "/index.html";
+    }
 
-            std::filesystem::path requested_path = std::filesystem::path(path).relative_path();
-            std::filesystem::path full_path = std::filesystem::canonical(public_root / requested_path);
+    std::filesystem::path requested_path = std::filesystem::path(path).relative_path();
+    std::filesystem::path full_path = std::filesystem::canonical(public_root / requested_path, ec);
+    if (ec) return Lookup::NotFound;
 
-            if (full_path.string().find(public_root.string()) != 0) {
-                res.setStatus(403, "Forbidden");
-                res.setHeader("Content-Type", "text/html");
-                res.setBody("<h1>403 Forbidden</h1>");
-                return res;
-            }
+    if (full_path.string().find(public_root.string()) != 0) {
+        return Lookup::Forbidden;
+    }
 
-            if (std::filesystem::is_directory(full_path)) {
-                full_path /= "index.html";
-            }
+    if (std::filesystem::is_directory(full_path, ec)) {
+        full_path /= "index.html";
+    }
 
-            if (!std::filesystem::is_regular_file(full_path)) {
-                throw std::filesystem::filesystem_error("File not found", std::error_code());
-            }
+    if (!std::filesystem::is_regular_file(full_path, ec)) {
+        return Lookup::NotFound;
+    }
 
-            std::string content;
-            if(cache){
-                if(cache->exists(full_path.string())){
-                    content = cache->get(full_path.string());
-                } else {
-                    std::ifstream file(full_path, std::ios::in | std::ios::binary);
-                    if (!file.is_open()) {
-                        throw std::filesystem::filesystem_error("File not found or inaccessible", std::error_code());
-                    }
-
-                    file.seekg(0, std::ios::end);
-                    std::streampos file_size = file.tellg();
-                    file.seekg(0, std::ios::beg);
-
-                    if (file_size > 0) {
-                        content.resize(static_cast<std::string::size_type>(file_size));
-                        file.read(&content[0], file_size);
-                    }
-                    try{
-                        cache->put(full_path.string(), content);
-                    } catch (const std::exception& e) {
-                        _LOGGER_.warning(e.what());
-                    }
-                }
-            } else {
-                std::ifstream file(full_path, std::ios::in | std::ios::binary);
-                if (!file.is_open()) {
-                    throw std::filesystem::filesystem_error("File not found or inaccessible", std::error_code());
-                }
+    auto file = std::make_shared<PublicFile>();
+    file->path = full_path;
+    file->key = full_path.string();
+    file->mime = MimeTypes::getType(full_path.extension().string().c_str());
+    if (!file->mime) file->mime = "application/octet-stream";
+    file->size = std::filesystem::file_size(full_path, ec);
+    if (ec) return Lookup::NotFound;
+    file->mtime = std::filesystem::last_write_time(full_path, ec);
+    if (ec) return Lookup::NotFound;
+    find_variants(*file);
+    out = std::move(file);
+    return Lookup::Found;
+}
 
-                file.seekg(0, std::ios::end);
-                std::streampos file_size = file.tellg();
-                file.seekg(0, std::ios::beg);
+unsigned variants_of(const PublicFile& file) {
+    return (file.gzip ? Compression::bit(Compression::Gzip) : 0) |
+           (file.brotli ? Compression::bit(Compression::Brotli) : 0);
+}
 
-                if (file_size > 0) {
-                    content.resize(static_cast<std::string::size_type>(file_size));
-                    file.read(&content[0], file_size);
-                }
-            }
+std::shared_ptr<const std::string> read_content(const Caches& caches, const PublicFile& file) {
+    std::string key;
+    if(caches.cache){
+        key = content_key(file);
+        if(auto hit = caches.cache->find(key)){
+            _METRICS_.cacheHit(Metrics::BodyCache);
+            return std::move(*hit);
+        }
+        _METRICS_.cacheMiss(Metrics::BodyCache);
+    }
+    std::ifstream stream(file.path, std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+        throw std::filesystem::filesystem_error("File not found or inaccessible", std::error_code());
+    }
+
+    stream.seekg(0, std::ios::end);
+    std::streampos file_size = stream.tellg();
+    stream.seekg(0, std::ios::beg);
 
-            res.setStatus(200, "OK");
-            res.setContentType(MimeTypes::getType(full_path.extension().string().c_str()));
-            res.setBody(content);
-            res.setCacheControl("public, max-age=2678400");
-            return res;
-        } catch (const std::filesystem::filesystem_error& e) {
-            _LOGGER_.warning("Filesystem error while serving: " + std::string(e.what()));
-            res.setStatus(404, "Not Found");
-            res.setContentType("text/html");
-            res.setBody("<h1>404 Not Found</h1>");
-            return res;
+    std::string data;
+    if (file_size > 0) {
+        data.resize(static_cast<std::string::size_type>(file_size));
+        stream.read(&data[0], file_size);
+    }
+    auto content = std::make_shared<const std::string>(std::move(data));
+    if(caches.cache){
+        try{
+            caches.cache->put(key, content);
         } catch (const std::exception& e) {
-            _LOGGER_.error("Unexpected error serving static file: " + std::string(e.what()));
-            res.setStatus(500, "Internal Server Error");
-            res.setContentType("text/html");
-            res.setBody("<h1>500 Internal Server Error</h1>");
-            return res;
+            _LOGGER_.warning(e.what());
         }
+    }
+    return content;
+}
+
+std::shared_ptr<const Validators> find_validators(const Caches& caches, const PublicFile& file) {
+    if (!caches.validator_cache) return nullptr;
+    auto hit = caches.validator_cache->find(file.key);
+    if (hit && (*hit)->mtime == file.mtime && (*hit)->size == file.size) return std::move(*hit);
+    return nullptr;
+}
+
+// Hashes `content` when given, else the file's identity (a stat, no read), so a large
+// file never costs a pass over its bytes on the IO thread. Without the validator cache
+// (ETAG_CACHE_SIZE=0) only Last-Modified is sent.
+std::shared_ptr<const Validators> make_validators(const Caches& caches, const PublicFile& file, const std::string* content) {
+    auto validators = std::make_shared<Validators>();
+    validators->mtime = file.mtime;
+    validators->size = file.size;
+    auto modified = std::chrono::file_clock::to_sys(file.mtime);
+    validators->last_modified = HttpDate::format(std::chrono::system_clock::to_time_t(
+        std::chrono::time_point_cast<std::chrono::system_clock::duration>(modified)));
+    if (!caches.validator_cache) return validators;
+
+    ContentHash hash;
+    if (content) {
+        hash.update(*content);
     } else {
+        struct stat st;
+        if (::stat(file.path.c_str(), &st) != 0) {
+            throw std::filesystem::filesystem_error("File not found or inaccessible", file.path,
+                                                    std::error_code(errno, std::generic_category()));
+        }
+        auto mtime = file.mtime.time_since_epoch().count();
+        std::uint64_t identity[] = {static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino),
+                                    static_cast<std::uint64_t>(file.size), static_cast<std::uint64_t>(mtime)};
+        hash.update(std::string_view(reinterpret_cast<const char*>(identity), sizeof(identity)));
+    }
+    validators->etag = hash.etag();
+    try{
+        caches.validator_cache->put(file.key, validators);
+    } catch (const std::exception& e) {
+        _LOGGER_.warning(e.what());
+    }
+    return validators;
+}
+
+// Headers every representation of `file` carries. Once it has a precompressed variant,
+// or compression is on for its type, the response depends on Accept-Encoding, the
+// identity one included.
+void describe(Response& res, const PublicFile& file, Compression::Encoding encoding, unsigned variants, const Validators& validators) {
+    res.setStatus(200, "OK");
+    res.setContentType(file.mime);
+    if (encoding != Compression::Identity) res.setContentEncoding(Compression::name(encoding));
+    if (variants || (_COMPRESSION_.enabled() && Compression::compressible(file.mime))) Compression::addVary(res);
+    res.setCacheControl("public, max-age=2678400");
+    if (!validators.etag.empty()) res.setETag(validators.etag);
+    res.setLastModified(validators.last_modified);
+}
+
+Response serve(const Caches& caches, const PublicFile& file, const Request& req) {
+    Response res;
+
+    // A precompressed sibling stands in for the file when the client accepts it. Each
+    // one is read, cached, validated and streamed as a file of its own.
+    unsigned variants = variants_of(file);
+    Compression::Encoding encoding = Compression::Identity;
+    if (variants) {
+        if (const std::string* accept = req.header("Accept-Encoding")) encoding = Compression::negotiate(*accept, variants);
+    }
+    const PublicFile& source = encoding == Compression::Brotli ? *file.brotli
+                             : encoding == Compression::Gzip   ? *file.gzip
+                                                               : file;
+    bool streamed = source.size >= static_cast<std::uintmax_t>(CONF.sendfile_threshold_kb) * 1024;
+
+    // Revalidation is answered before any body is touched. A version seen for the first
+    // time is hashed from the bytes about to be sent; a streamed one from its stat.
+    std::shared_ptr<const std::string> content;
+    std::shared_ptr<const Validators> validators = find_validators(caches, source);
+    if (!validators) {
+        if (!streamed && caches.validator_cache) content = read_content(caches, source);
+        validators = make_validators(caches, source, content.get());
+    }
+    if (req.notModified(validators->etag, validators->last_modified)) {
+        describe(res, file, encoding, variants, *validators);
+        res.setNotModified();
+        return res;
+    }
+
+    // Large files are streamed straight from disk by the session (sendfile on Linux).
+    if (streamed) {
+        std::error_code open_ec;
+        std::shared_ptr<FileBody> body = FileBody::open(source.path, open_ec);
+        if (!body) {
+            throw std::filesystem::filesystem_error("File not found or inaccessible", source.path, open_ec);
+        }
+        describe(res, file, encoding, variants, *validators);
+        res.setFileBody(std::move(body));
+        return res;
+    }
+
+    // Without a precompressed variant the body is compressed here, as the session would.
+    Compression::Encoding dynamic = Compression::Identity;
+    std::string response_key;
+    if (caches.response_cache) {
+        if (encoding == Compression::Identity) dynamic = _COMPRESSION_.negotiate(req);
+        response_key = variant_key(file.key, Compression::name(encoding != Compression::Identity ? encoding : dynamic));
+        if (auto hit = caches.response_cache->find(response_key)) {
+            if ((*hit)->mtime == source.mtime && (*hit)->size == source.size && (*hit)->variants == variants) {
+                _METRICS_.cacheHit(Metrics::ResponseCache);
+                res.setSerialized((*hit)->response);
+                return res;
+            }
+        }
+        _METRICS_.cacheMiss(Metrics::ResponseCache);
+    }
+
+    if (!content) content = read_content(caches, source);
+    describe(res, file, encoding, variants, *validators);
+    res.setBody(std::move(content));
+    // Responses over a shard's share of CACHE_SIZE_KB are not kept, and not serialized
+    // for nothing either; the body cache likewise skips such files.
+    if (caches.response_cache) _COMPRESSION_.apply(res, dynamic);
+    if (caches.response_cache && res.body().size() <= static_cast<std::size_t>(caches.response_cache->max_value_bytes())) {
+        auto entry = std::make_shared<CachedResponse>();
+        entry->response = SerializedResponse::from(res);
+        entry->mtime = source.mtime;
+        entry->size = source.size;
+        entry->variants = variants;
+        try{
+            caches.response_cache->put(response_key, entry);
+        } catch (const std::exception& e) {
+            _LOGGER_.warning(e.what());
+        }
+    }
+    return res;
+}
+
+Response func(Request& req) {
+    if (req.method != "GET") {
+        Response res;
         res.setStatus(405, "Method Not Allowed");
         res.setHeader("Allow", "GET");
         res.setBody("Method Not Allowed");
+        return res;
+    }
+    try {
+        std::shared_ptr<const Caches> current = std::atomic_load(&caches);
+        std::shared_ptr<const PublicFile> file;
+        if (CONF.public_index) {
+            // Pure memory lookup; paths outside ./public are simply not in the index.
+            file = _PUBLIC_INDEX_.resolve(req.uri, CONF.html_routing);
+            if (!file) return not_found();
+        } else {
+            std::string path(req.path());
+            std::uint64_t generation = _PUBLIC_INDEX_.generation();
+            negative_cache_t* negative_cache = current->negative_cache.get();
+            if (negative_cache) {
+                auto miss = negative_cache->find(path);
+                if (miss && *miss == generation) {
+                    _METRICS_.cacheHit(Metrics::NegativeCache);
+                    return not_found();
+                }
+                _METRICS_.cacheMiss(Metrics::NegativeCache);
+            }
+            switch (probe(path, file)) {
+                case Lookup::Found:
+                    break;
+                case Lookup::NotFound:
+                    if (negative_cache) negative_cache->put(path, generation);
+                    return not_found();
+                case Lookup::Forbidden: {
+                    Response res;
+                    res.setStatus(403, "Forbidden");
+                    res.setHeader("Content-Type", "text/html");
+                    res.setBody("<h1>403 Forbidden</h1>");
+                    return res;
+                }
+            }
+        }
+        return serve(*current, *file, req);
+    } catch (const std::filesystem::filesystem_error& e) {
+        _LOGGER_.warning("Filesystem error while serving: " + std::string(e.what()));
+        return not_found();
+    } catch (const std::exception& e) {
+        _LOGGER_.error("Unexpected error serving static file: " + std::string(e.what()));
+        Response res;
+        res.setStatus(500, "Internal Server Error");
+        res.setContentType("text/html");
+        res.setBody("<h1>500 Internal Server Error</h1>");
+        return res;
     }
-
-    return res;
 }
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Response body backed by an open file. The session streams it to the socket in
+// chunks (with sendfile where the platform has it) instead of loading it into memory.
+class FileBody {
+   public:
+    static std::shared_ptr<FileBody> open(const std::filesystem::path& path, std::error_code& ec) {
+        std::shared_ptr<FileBody> body(new FileBody());
+#ifdef _WIN32
+        body->file_ = _wfopen(path.c_str(), L"rb");
+        if (!body->file_) {
+            ec = std::error_code(errno, std::generic_category());
+            return nullptr;
+        }
+        _fseeki64(body->file_, 0, SEEK_END);
+        body->size_ = static_cast<std::uint64_t>(_ftelli64(body->file_));
+#else
+        body->fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (body->fd_ < 0) {
+            ec = std::error_code(errno, std::generic_category());
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(body->fd_, &st) != 0) {
+            ec = std::error_code(errno, std::generic_category());
+            return nullptr;
+        }
+        body->size_ = static_cast<std::uint64_t>(st.st_size);
+#endif
+        ec.clear();
+        return body;
+    }
+
+    std::uint64_t size() const {
+        return size_;
+    }
+
+    // Positional read used where sendfile is not available. Returns bytes read, 0 on error/EOF.
+    std::size_t read(std::uint64_t offset, char* buffer, std::size_t length) {
+#ifdef _WIN32
+        if (_fseeki64(file_, static_cast<long long>(offset), SEEK_SET) != 0) return 0;
+        return std::fread(buffer, 1, length, file_);
+#else
+        ssize_t n = ::pread(fd_, buffer, length, static_cast<off_t>(offset));
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+#endif
+    }
+
+#ifndef _WIN32
+    int fd() const {
+        return fd_;
+    }
+#endif
+
+    ~FileBody() {
+#ifdef _WIN32
+        if (file_) std::fclose(file_);
+#else
+        if (fd_ >= 0) ::close(fd_);
+#endif
+    }
+    FileBody(const FileBody&) = delete;
+    FileBody& operator=(const FileBody&) = delete;
+
+   private:
+    FileBody() = default;
+
+#ifdef _WIN32
+    std::FILE* file_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    std::uint64_t size_ = 0;
+};
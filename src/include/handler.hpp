@@ -0,0 +1,135 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+#include "access_log.hpp"
+#include "adaptive.hpp"
+#include "admission.hpp"
+#include "compression.hpp"
+#include "config.hpp"
+#include "metrics.hpp"
+#include "plugin.hpp"
+#include "request.hpp"
+#include "worker_pool.hpp"
+
+// What the HTTP/1 and HTTP/2 sessions share: the handler picked for a request and the
+// bookkeeping that follows the request until its response is written.
+namespace serv {
+
+struct Handler {
+    std::function<Response(Request&)> func;
+    bool isHeavy;
+    // Matched route pattern, empty for the default handler. Only used for logging.
+    std::string_view route = {};
+    std::uint32_t route_id = Metrics::default_route;
+    // Feed the handler time to _ADAPTIVE_ (the request ran under Execution::Auto).
+    bool adaptive = false;
+#ifdef CROUTER_ASYNC
+    // Set for async plugins; replaces func.
+    std::function<Async<Response>(Request&, IAsyncIO&)> async = nullptr;
+#endif
+};
+using HandlerBuilder = std::function<Handler(Request&)>;
+
+// The metrics path is answered by the session itself, ahead of plugin routing. GET
+// only: the HTTP/1 session writes whatever body the handler returns.
+inline bool is_metrics_request(const Request& req) {
+    return _METRICS_.enabled() && req.method == "GET" && req.path() == CONF.metrics_path;
+}
+inline Handler metrics_handler() {
+    return Handler{[](Request&) -> Response {
+        Response res;
+        res.setContentType("text/plain; version=0.0.4; charset=utf-8");
+        res.setHeader("Cache-Control", "no-store");
+        res.setBody(_METRICS_.render());
+        return res;
+    }, false, {}, Metrics::untracked};
+}
+
+// Per-request bookkeeping for admission control, the access log and metrics: filled
+// in as the request moves along and handed over once the response is written.
+struct RequestEntry {
+    AccessRecord record;
+    std::chrono::steady_clock::time_point start;
+    std::uint32_t route_id = Metrics::default_route;
+    bool admitted = false;
+    bool heavy = false;
+    bool adaptive = false;
+};
+
+inline bool tracking() {
+    return _ACCESS_LOG_.enabled() || _METRICS_.enabled();
+}
+
+inline std::uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count());
+}
+
+// Gives the admission slot back as soon as the handler is done.
+inline void release(RequestEntry& entry) {
+    if (!entry.admitted) return;
+    _ADMISSION_.release(entry.heavy, entry.route_id);
+    entry.admitted = false;
+}
+
+inline void handler_done(RequestEntry& entry, std::chrono::steady_clock::time_point handler_start) {
+    entry.record.handler_ns = elapsed_ns(handler_start);
+    if (entry.adaptive) _ADAPTIVE_.record(entry.route_id, entry.record.handler_ns);
+    release(entry);
+}
+
+inline RequestEntry make_entry(const boost::asio::ip::tcp::endpoint& remote, const Request* req, std::string_view route) {
+    RequestEntry entry;
+    if (!tracking()) return entry;
+    entry.start = std::chrono::steady_clock::now();
+    if (!_ACCESS_LOG_.enabled()) return entry;
+    entry.record.time_us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    auto address = remote.address();
+    auto v6 = address.is_v4() ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()) : address.to_v6();
+    auto bytes = v6.to_bytes();
+    std::memcpy(entry.record.address, bytes.data(), sizeof(entry.record.address));
+    entry.record.port = remote.port();
+    if (req) {
+        AccessLog::setMethod(entry.record, req->method);
+        AccessLog::setRoute(entry.record, route.empty() ? req->path() : route);
+    }
+    return entry;
+}
+
+inline std::uint64_t body_bytes(const Response& res) {
+    if (const auto& file = res.fileBody()) return file->size();
+    if (const auto& raw = res.serialized()) return raw->message.size() - raw->head_end;
+    return res.body().size();
+}
+
+// The compression stage for a response produced on an IO thread. Small bodies are
+// compressed in place and false is returned; large ones go to the worker pool, after
+// which `done` gets the response on `executor`.
+template <class Done>
+bool compress_response(Response& res, Compression::Encoding encoding, WorkerPool& worker_pool,
+                       const boost::asio::any_io_executor& executor, Done done) {
+    if (encoding == Compression::Identity || !_COMPRESSION_.offload(res) || !_COMPRESSION_.varies(res)) {
+        _COMPRESSION_.apply(res, encoding);
+        return false;
+    }
+    worker_pool.post([res = std::move(res), encoding, executor, done = std::move(done)]() mutable {
+        _COMPRESSION_.apply(res, encoding);
+        boost::asio::post(executor, [res = std::move(res), done = std::move(done)]() mutable { done(res); });
+    });
+    return true;
+}
+
+// Reports a written response to the access log and metrics.
+inline void finish_entry(RequestEntry& entry) {
+    entry.record.total_ns = elapsed_ns(entry.start);
+    _ACCESS_LOG_.record(entry.record);
+    _METRICS_.request(entry.route_id, entry.record.status, entry.record.total_ns);
+}
+
+}  // namespace serv
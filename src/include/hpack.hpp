@@ -0,0 +1,375 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HPACK header compression (RFC 7541) for the HTTP/2 session. The decoder keeps the
+// dynamic table and understands Huffman-coded strings; the encoder never indexes and
+// sends plain literals, which keeps responses independent of each other's order.
+namespace hpack {
+
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+struct StaticEntry {
+    std::string_view name;
+    std::string_view value;
+};
+
+inline constexpr std::array<StaticEntry, 61> static_table = {{
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+struct HuffmanCode {
+    std::uint32_t bits;
+    std::uint8_t length;
+};
+
+// Codes of the 256 octets and EOS (symbol 256), RFC 7541 Appendix B.
+inline constexpr std::array<HuffmanCode, 257> huffman_codes = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28},
+    {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24},
+    {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28},
+    {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28}, {0xffffff4, 28},
+    {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8},
+    {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7},
+    {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7},
+    {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+    {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15},
+    {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7},
+    {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20},
+    {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22},
+    {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22},
+    {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23},
+    {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22},
+    {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23},
+    {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20},
+    {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26},
+    {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26},
+    {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20},
+    {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24},
+    {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26},
+    {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+}};
+
+// Binary tree over huffman_codes, walked one bit at a time.
+class HuffmanDecoder {
+   public:
+    static const HuffmanDecoder& instance() {
+        static const HuffmanDecoder decoder;
+        return decoder;
+    }
+
+    // Appends the decoded string to `out`; false for EOS, a code that does not exist or
+    // padding that is longer than 7 bits or not all ones.
+    bool decode(std::string_view in, std::string& out) const {
+        int node = 0;
+        int pad_bits = 0;
+        bool pad_ones = true;
+        for (unsigned char byte : in) {
+            for (int shift = 7; shift >= 0; shift--) {
+                int bit = (byte >> shift) & 1;
+                int next = nodes_[node][bit];
+                if (next == 0) return false;
+                if (next < 0) {
+                    int symbol = -next - 1;
+                    if (symbol == 256) return false;
+                    out += static_cast<char>(symbol);
+                    node = 0;
+                    pad_bits = 0;
+                    pad_ones = true;
+                } else {
+                    node = next;
+                    pad_bits++;
+                    pad_ones = pad_ones && bit == 1;
+                }
+            }
+        }
+        return node == 0 || (pad_bits <= 7 && pad_ones);
+    }
+
+   private:
+    HuffmanDecoder() {
+        nodes_.push_back({0, 0});
+        for (int symbol = 0; symbol < 257; symbol++) {
+            const HuffmanCode& code = huffman_codes[symbol];
+            int node = 0;
+            for (int i = code.length - 1; i >= 0; i--) {
+                int bit = (code.bits >> i) & 1;
+                if (i == 0) {
+                    nodes_[node][bit] = static_cast<std::int16_t>(-symbol - 1);
+                } else {
+                    if (nodes_[node][bit] == 0) {
+                        nodes_[node][bit] = static_cast<std::int16_t>(nodes_.size());
+                        nodes_.push_back({0, 0});
+                    }
+                    node = nodes_[node][bit];
+                }
+            }
+        }
+    }
+
+    // Child per bit: 0 = none, > 0 = inner node, < 0 = leaf of symbol -value - 1.
+    std::vector<std::array<std::int16_t, 2>> nodes_;
+};
+
+// Decodes header blocks of one connection. Blocks must be fed in the order they were
+// received, as they update the shared dynamic table.
+class Decoder {
+   public:
+    // `max_table_size` is the SETTINGS_HEADER_TABLE_SIZE we announced, `max_list_size`
+    // caps the decoded headers (name + value + 32 per field).
+    explicit Decoder(std::size_t max_table_size = 4096, std::size_t max_list_size = 65536)
+        : max_table_size_(max_table_size), table_limit_(max_table_size), max_list_size_(max_list_size) {}
+
+    // False on a malformed block; the connection must then be closed (COMPRESSION_ERROR).
+    bool decode(std::string_view block, HeaderList& headers) {
+        std::size_t pos = 0;
+        std::size_t list_size = 0;
+        while (pos < block.size()) {
+            std::uint8_t first = static_cast<std::uint8_t>(block[pos]);
+            std::string name;
+            std::string value;
+            if (first & 0x80) {
+                // Indexed header field.
+                std::uint64_t index;
+                if (!integer(block, pos, 7, index) || index == 0 || !lookup(index, name, value)) return false;
+            } else if ((first & 0xe0) == 0x20) {
+                // Dynamic table size update.
+                std::uint64_t size;
+                if (!integer(block, pos, 5, size) || size > max_table_size_) return false;
+                table_limit_ = static_cast<std::size_t>(size);
+                evict(0);
+                continue;
+            } else {
+                // Literal, with incremental indexing (01), without (0000) or never indexed (0001).
+                bool indexing = (first & 0xc0) == 0x40;
+                std::uint64_t index;
+                if (!integer(block, pos, indexing ? 6 : 4, index)) return false;
+                if (index == 0) {
+                    if (!string(block, pos, name)) return false;
+                } else {
+                    std::string ignored;
+                    if (!lookup(index, name, ignored)) return false;
+                }
+                if (!string(block, pos, value)) return false;
+                if (indexing) insert(name, value);
+            }
+            list_size += name.size() + value.size() + 32;
+            if (list_size > max_list_size_) return false;
+            headers.emplace_back(std::move(name), std::move(value));
+        }
+        return true;
+    }
+
+   private:
+    // Prefix-coded integer (RFC 7541 section 5.1).
+    static bool integer(std::string_view in, std::size_t& pos, int prefix, std::uint64_t& value) {
+        if (pos >= in.size()) return false;
+        std::uint64_t max_prefix = (std::uint64_t(1) << prefix) - 1;
+        value = static_cast<std::uint8_t>(in[pos++]) & max_prefix;
+        if (value < max_prefix) return true;
+        for (int shift = 0; shift <= 28; shift += 7) {
+            if (pos >= in.size()) return false;
+            std::uint8_t byte = static_cast<std::uint8_t>(in[pos++]);
+            value += std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    static bool string(std::string_view in, std::size_t& pos, std::string& out) {
+        if (pos >= in.size()) return false;
+        bool huffman = static_cast<std::uint8_t>(in[pos]) & 0x80;
+        std::uint64_t length;
+        if (!integer(in, pos, 7, length) || length > in.size() - pos) return false;
+        std::string_view data = in.substr(pos, static_cast<std::size_t>(length));
+        pos += static_cast<std::size_t>(length);
+        if (!huffman) {
+            out.assign(data);
+            return true;
+        }
+        out.reserve(data.size() * 8 / 5);
+        return HuffmanDecoder::instance().decode(data, out);
+    }
+
+    bool lookup(std::uint64_t index, std::string& name, std::string& value) const {
+        if (index <= static_table.size()) {
+            name.assign(static_table[index - 1].name);
+            value.assign(static_table[index - 1].value);
+            return true;
+        }
+        index -= static_table.size() + 1;
+        if (index >= dynamic_.size()) return false;
+        name = dynamic_[static_cast<std::size_t>(index)].first;
+        value = dynamic_[static_cast<std::size_t>(index)].second;
+        return true;
+    }
+
+    void insert(const std::string& name, const std::string& value) {
+        std::size_t size = name.size() + value.size() + 32;
+        evict(size);
+        // An entry larger than the whole table empties it and is not added.
+        if (size > table_limit_) return;
+        dynamic_.emplace_front(name, value);
+        table_size_ += size;
+    }
+
+    // Makes room for `incoming` bytes below the current limit.
+    void evict(std::size_t incoming) {
+        while (!dynamic_.empty() && table_size_ + incoming > table_limit_) {
+            table_size_ -= dynamic_.back().first.size() + dynamic_.back().second.size() + 32;
+            dynamic_.pop_back();
+        }
+    }
+
+    std::deque<std::pair<std::string, std::string>> dynamic_;
+    std::size_t table_size_ = 0;
+    std::size_t max_table_size_;
+    std::size_t table_limit_;
+    std::size_t max_list_size_;
+};
+
+// Response header encoding. Names are expected in lower case.
+class Encoder {
+   public:
+    static void status(std::string& out, int code) {
+        // :status 200, 204, 206, 304, 400, 404 and 500 have entries of their own (8-14).
+        static constexpr int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+        for (int i = 0; i < 7; i++) {
+            if (indexed[i] == code) {
+                out += static_cast<char>(0x80 | (8 + i));
+                return;
+            }
+        }
+        std::string value = std::to_string(code);
+        integer(out, 0x00, 4, 8);
+        literal(out, value);
+    }
+
+    // Literal without indexing, naming the static table entry when there is one.
+    static void header(std::string& out, std::string_view name, std::string_view value) {
+        std::size_t index = name_index(name);
+        if (index != 0) {
+            integer(out, 0x00, 4, index);
+        } else {
+            out += '\0';
+            literal(out, name);
+        }
+        literal(out, value);
+    }
+
+   private:
+    static std::size_t name_index(std::string_view name) {
+        // :status and the request pseudo-headers come first; regular names start at 15.
+        for (std::size_t i = 14; i < static_table.size(); i++) {
+            if (static_table[i].name == name) return i + 1;
+        }
+        return 0;
+    }
+
+    static void integer(std::string& out, std::uint8_t flags, int prefix, std::uint64_t value) {
+        std::uint64_t max_prefix = (std::uint64_t(1) << prefix) - 1;
+        if (value < max_prefix) {
+            out += static_cast<char>(flags | value);
+            return;
+        }
+        out += static_cast<char>(flags | max_prefix);
+        value -= max_prefix;
+        while (value >= 0x80) {
+            out += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    static void literal(std::string& out, std::string_view value) {
+        integer(out, 0x00, 7, value.size());
+        out.append(value);
+    }
+};
+
+}  // namespace hpack
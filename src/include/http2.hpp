@@ -0,0 +1,1010 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async_io.hpp"
+#include "config.hpp"
+#include "deadline.hpp"
+#include "handler.hpp"
+#include "hpack.hpp"
+#include "worker_pool.hpp"
+
+namespace serv {
+
+// Cleartext HTTP/2 (h2c), entered with prior knowledge or through an HTTP/1.1
+// "Upgrade: h2c" request. Each stream is dispatched like an HTTP/1 request (same handler
+// builder, admission, deadlines and light/heavy/async placement) and answered as soon
+// as its handler is done, so responses complete out of order. Response bodies go out
+// as DATA frames within the peer's connection and stream windows, one frame per stream
+// in turn; request bodies are acknowledged with WINDOW_UPDATE as they arrive, up to MAX_BODY_BYTES.
+class Http2Session : public std::enable_shared_from_this<Http2Session> {
+   public:
+    static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    Http2Session(boost::asio::ip::tcp::socket socket, boost::asio::any_io_executor strand, WorkerPool& worker_pool,
+                 HandlerBuilder handler_builder, boost::asio::ip::tcp::endpoint remote)
+        : socket_(std::move(socket)),
+          strand_(std::move(strand)),
+          worker_pool_(worker_pool),
+          handler_builder_(std::move(handler_builder)),
+          remote_(remote),
+          idle_timer_(strand_),
+          max_streams_(CONF.http2_max_streams > 0 ? static_cast<std::size_t>(CONF.http2_max_streams) : 100) {
+        _ADMISSION_.sessionOpened();
+        _METRICS_.sessionOpened();
+    }
+
+    ~Http2Session() {
+        _ADMISSION_.sessionClosed();
+        _METRICS_.sessionClosed();
+    }
+
+    // `initial` holds bytes the HTTP/1 session had already read. With `upgraded` the
+    // connection came through Upgrade: h2c and that request becomes stream 1, and
+    // `settings` is the decoded HTTP2-Settings header.
+    void start(std::string_view initial, std::optional<Request> upgraded = std::nullopt, std::string_view settings = {}) {
+        _LOGGER_.debug("HTTP/2 session started.");
+        send_settings();
+        if (upgraded) {
+            if (ErrorCode error = apply_settings(settings); error != NoError) {
+                connection_error(error);
+                flush();
+                return;
+            }
+            last_stream_id_ = 1;
+            Stream& stream = open_stream(1);
+            stream.remote_closed = true;
+            stream.req = std::move(*upgraded);
+            dispatch(1, stream);
+        }
+        in_.assign(initial);
+        bool ok = process_input();
+        flush();
+        if (ok) do_read();
+    }
+
+    // HTTP2-Settings is the SETTINGS payload in base64url without padding.
+    static std::optional<std::string> decodeSettingsHeader(std::string_view value) {
+        std::string out;
+        std::uint32_t bits = 0;
+        int count = 0;
+        for (char c : value) {
+            int v;
+            if (c >= 'A' && c <= 'Z') v = c - 'A';
+            else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') v = c - '0' + 52;
+            else if (c == '-' || c == '+') v = 62;
+            else if (c == '_' || c == '/') v = 63;
+            else if (c == '=') break;
+            else return std::nullopt;
+            bits = (bits << 6) | static_cast<std::uint32_t>(v);
+            count += 6;
+            if (count >= 8) {
+                count -= 8;
+                out += static_cast<char>((bits >> count) & 0xff);
+            }
+        }
+        return out;
+    }
+
+   private:
+    enum FrameType : std::uint8_t {
+        Data = 0x0, Headers = 0x1, Priority = 0x2, RstStream = 0x3, Settings = 0x4,
+        PushPromise = 0x5, Ping = 0x6, GoAway = 0x7, WindowUpdate = 0x8, Continuation = 0x9
+    };
+    enum Flag : std::uint8_t { EndStream = 0x1, Ack = 0x1, EndHeaders = 0x4, Padded = 0x8, PriorityFlag = 0x20 };
+    enum ErrorCode : std::uint32_t {
+        NoError = 0x0, ProtocolError = 0x1, InternalError = 0x2, FlowControlError = 0x3, StreamClosed = 0x5,
+        FrameSizeError = 0x6, RefusedStream = 0x7, Cancel = 0x8, CompressionError = 0x9
+    };
+
+    static constexpr std::uint32_t max_frame_size = 16384;
+    static constexpr std::int64_t default_window = 65535;
+    static constexpr std::int64_t max_window = 0x7fffffff;
+    // Receive window announced for each stream and for the connection.
+    static constexpr std::uint32_t receive_window = 1 << 20;
+    static constexpr std::size_t max_header_list = 65536;
+    // Time a request may take to arrive in full once its headers are in, as on HTTP/1.
+    static constexpr auto request_timeout = std::chrono::seconds(30);
+    // DATA bytes gathered into one socket write.
+    static constexpr std::size_t write_budget = 256 * 1024;
+
+    struct Stream {
+        Request req;
+        bool remote_closed = false;
+        bool head = false;
+        bool dispatched = false;
+        std::shared_ptr<RequestCancellation> token;
+        std::function<void()> on_cancel;
+        std::unique_ptr<boost::asio::steady_timer> deadline;
+        // Copy for a 504; after respond() the entry of the response itself.
+        RequestEntry entry;
+
+        bool responding = false;
+        // END_STREAM has been queued; the stream goes once that write completes.
+        bool finished = false;
+        Response res;
+        std::string_view body;
+        std::shared_ptr<FileBody> file;
+        std::uint64_t body_size = 0;
+        std::uint64_t sent = 0;
+        std::int64_t send_window = 0;
+        // Request body bytes the client may still send.
+        std::int64_t recv_window = receive_window;
+    };
+
+    // Part of a gathered write: bytes of out_ (data == nullptr) or a response body.
+    struct Segment {
+        std::size_t offset;
+        std::size_t length;
+        const char* data;
+    };
+
+    // Reading
+
+    void do_read() {
+        if (closed_ || failed_) return;
+        socket_.async_read_some(boost::asio::buffer(read_buffer_),
+            boost::asio::bind_executor(strand_,
+                [self = shared_from_this()](boost::system::error_code ec, std::size_t length) {
+                    if (ec) {
+                        if (_LOGGER_.enabled(LogLevel::Debug))
+                            _LOGGER_.debug("HTTP/2 connection closed: " + ec.message());
+                        self->close();
+                        return;
+                    }
+                    _METRICS_.bytesIn(length);
+                    self->in_.append(self->read_buffer_.data(), length);
+                    bool ok = self->process_input();
+                    self->flush();
+                    if (ok) self->do_read();
+                }));
+    }
+
+    // Handles every complete frame in in_; false once the connection is failing.
+    bool process_input() {
+        std::size_t pos = 0;
+        if (!preface_received_) {
+            std::size_t n = std::min(in_.size(), preface.size());
+            if (std::string_view(in_).substr(0, n) != preface.substr(0, n)) {
+                _LOGGER_.warning("Invalid HTTP/2 connection preface, closing session.");
+                close();
+                return false;
+            }
+            if (n < preface.size()) return true;
+            pos = preface.size();
+            preface_received_ = true;
+        }
+        bool ok = true;
+        while (ok && in_.size() - pos >= 9) {
+            const auto* p = reinterpret_cast<const unsigned char*>(in_.data() + pos);
+            std::uint32_t length = (std::uint32_t(p[0]) << 16) | (std::uint32_t(p[1]) << 8) | p[2];
+            std::uint8_t type = p[3];
+            std::uint8_t flags = p[4];
+            std::uint32_t id = read_u32(p + 5) & 0x7fffffff;
+            if (length > max_frame_size) {
+                ok = connection_error(FrameSizeError);
+                break;
+            }
+            if (in_.size() - pos - 9 < length) break;
+            std::string_view payload(in_.data() + pos + 9, length);
+            pos += 9 + length;
+            ok = on_frame(type, flags, id, payload);
+        }
+        in_.erase(0, pos);
+        return ok;
+    }
+
+    bool on_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+        if (!settings_received_ && type != Settings) return connection_error(ProtocolError);
+        // A header block must not be interleaved with any other frame.
+        if (continuation_id_ != 0 && (type != Continuation || id != continuation_id_)) return connection_error(ProtocolError);
+        switch (type) {
+            case Data:
+                return on_data(flags, id, payload);
+            case Headers:
+                return on_headers(flags, id, payload);
+            case Continuation:
+                if (continuation_id_ == 0) return connection_error(ProtocolError);
+                header_block_.append(payload);
+                if (header_block_.size() > max_header_list) return connection_error(ProtocolError);
+                if (!(flags & EndHeaders)) return true;
+                continuation_id_ = 0;
+                return end_headers();
+            case Priority:
+                if (id == 0) return connection_error(ProtocolError);
+                if (payload.size() != 5) reset_stream(id, FrameSizeError);
+                return true;
+            case RstStream:
+                return on_rst_stream(id, payload);
+            case Settings:
+                return on_settings(flags, id, payload);
+            case PushPromise:
+                return connection_error(ProtocolError);
+            case Ping:
+                if (id != 0) return connection_error(ProtocolError);
+                if (payload.size() != 8) return connection_error(FrameSizeError);
+                if (!(flags & Ack)) queue_frame(Ping, Ack, 0, payload);
+                return true;
+            case GoAway:
+                if (id != 0) return connection_error(ProtocolError);
+                goaway_received_ = true;
+                return true;
+            case WindowUpdate:
+                return on_window_update(id, payload);
+            default:
+                // Unknown frame types are ignored.
+                return true;
+        }
+    }
+
+    bool on_settings(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+        if (id != 0) return connection_error(ProtocolError);
+        if (flags & Ack) return payload.empty() ? true : connection_error(FrameSizeError);
+        if (payload.size() % 6 != 0) return connection_error(FrameSizeError);
+        if (ErrorCode error = apply_settings(payload); error != NoError) return connection_error(error);
+        settings_received_ = true;
+        queue_frame(Settings, Ack, 0, {});
+        return true;
+    }
+
+    ErrorCode apply_settings(std::string_view payload) {
+        for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            const auto* p = reinterpret_cast<const unsigned char*>(payload.data() + i);
+            std::uint16_t setting = static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+            std::uint32_t value = read_u32(p + 2);
+            switch (setting) {
+                case 0x2:  // ENABLE_PUSH; we never push
+                    if (value > 1) return ProtocolError;
+                    break;
+                case 0x4: {  // INITIAL_WINDOW_SIZE, applies to open streams too
+                    if (value > max_window) return FlowControlError;
+                    std::int64_t delta = static_cast<std::int64_t>(value) - peer_initial_window_;
+                    for (auto& [stream_id, stream] : streams_) stream.send_window += delta;
+                    peer_initial_window_ = value;
+                    break;
+                }
+                case 0x5:  // MAX_FRAME_SIZE
+                    if (value < 16384 || value > 16777215) return ProtocolError;
+                    peer_max_frame_ = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return NoError;
+    }
+
+    bool on_headers(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+        if (id == 0 || id % 2 == 0) return connection_error(ProtocolError);
+        std::size_t padding = 0;
+        if (flags & Padded) {
+            if (payload.empty()) return connection_error(ProtocolError);
+            padding = static_cast<std::uint8_t>(payload[0]);
+            payload.remove_prefix(1);
+        }
+        if (flags & PriorityFlag) {
+            if (payload.size() < 5) return connection_error(ProtocolError);
+            payload.remove_prefix(5);
+        }
+        if (padding > payload.size()) return connection_error(ProtocolError);
+        payload.remove_suffix(padding);
+        header_block_.assign(payload);
+        header_stream_ = id;
+        header_end_stream_ = flags & EndStream;
+        if (flags & EndHeaders) return end_headers();
+        continuation_id_ = id;
+        return true;
+    }
+
+    // A complete header block: a new request, or trailers of one whose body is arriving.
+    bool end_headers() {
+        hpack::HeaderList fields;
+        bool decoded = decoder_.decode(header_block_, fields);
+        header_block_.clear();
+        if (!decoded) return connection_error(CompressionError);
+        std::uint32_t id = header_stream_;
+        auto it = streams_.find(id);
+        if (it != streams_.end()) {
+            Stream& stream = it->second;
+            if (stream.remote_closed) {
+                reset_stream(id, StreamClosed);
+            } else if (!header_end_stream_) {
+                reset_stream(id, ProtocolError);
+            } else {
+                stream.remote_closed = true;
+                dispatch(id, stream);
+            }
+            return true;
+        }
+        if (id <= last_stream_id_) return connection_error(ProtocolError);
+        last_stream_id_ = id;
+        // Past a GOAWAY new streams are ignored; the block was still decoded above,
+        // because it updated the dynamic table.
+        if (goaway_sent_) return true;
+        if (streams_.size() >= max_streams_) {
+            reset_stream(id, RefusedStream);
+            return true;
+        }
+        Request req;
+        if (!build_request(fields, req)) {
+            reset_stream(id, ProtocolError);
+            return true;
+        }
+        if (const std::string* length = req.header("content-length")) {
+            std::size_t declared = 0;
+            auto [end, ec] = std::from_chars(length->data(), length->data() + length->size(), declared);
+            if (ec != std::errc() || end != length->data() + length->size() || declared > RequestParser::maxBodyBytes()) {
+                reset_stream(id, ec == std::errc() && end == length->data() + length->size() ? Cancel : ProtocolError);
+                return true;
+            }
+        }
+        Stream& stream = open_stream(id);
+        stream.req = std::move(req);
+        if (header_end_stream_) {
+            stream.remote_closed = true;
+            dispatch(id, stream);
+        } else {
+            // The body is still to come; a client that stops sending loses the stream.
+            stream.deadline = std::make_unique<boost::asio::steady_timer>(strand_, request_timeout);
+            stream.deadline->async_wait([self = shared_from_this(), id](boost::system::error_code ec) {
+                if (!ec) self->on_request_timeout(id);
+            });
+        }
+        return true;
+    }
+
+    static bool build_request(hpack::HeaderList& fields, Request& req) {
+        std::string authority;
+        bool regular = false;
+        for (auto& [name, value] : fields) {
+            if (!name.empty() && name[0] == ':') {
+                if (regular) return false;
+                if (name == ":method") req.method = std::move(value);
+                else if (name == ":path") req.uri = std::move(value);
+                else if (name == ":authority") authority = std::move(value);
+                else if (name != ":scheme") return false;
+                continue;
+            }
+            regular = true;
+            if (std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; })) return false;
+            if (name == "connection") return false;
+            auto [it, inserted] = req.headers.try_emplace(name, value);
+            if (!inserted) it->second.append(name == "cookie" ? "; " : ", ").append(value);
+        }
+        if (req.method.empty() || req.uri.empty()) return false;
+        if (!authority.empty() && req.headers.find("host") == req.headers.end()) req.headers.emplace("host", std::move(authority));
+        req.http_version = "HTTP/2";
+        return true;
+    }
+
+    bool on_data(std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+        if (id == 0) return connection_error(ProtocolError);
+        std::size_t frame_length = payload.size();
+        if (flags & Padded) {
+            if (payload.empty()) return connection_error(ProtocolError);
+            std::size_t padding = static_cast<std::uint8_t>(payload[0]);
+            payload.remove_prefix(1);
+            if (padding > payload.size()) return connection_error(ProtocolError);
+            payload.remove_suffix(padding);
+        }
+        // The whole frame counts against the windows, padding included.
+        conn_recv_window_ -= static_cast<std::int64_t>(frame_length);
+        if (conn_recv_window_ < 0) return connection_error(FlowControlError);
+        if (frame_length > 0) {
+            queue_window_update(0, frame_length);
+            conn_recv_window_ += static_cast<std::int64_t>(frame_length);
+        }
+        auto it = streams_.find(id);
+        if (it == streams_.end() || it->second.remote_closed) {
+            if (id > last_stream_id_) return connection_error(ProtocolError);
+            reset_stream(id, StreamClosed);
+            return true;
+        }
+        Stream& stream = it->second;
+        std::size_t max_body = RequestParser::maxBodyBytes();
+        stream.recv_window -= static_cast<std::int64_t>(frame_length);
+        if (stream.recv_window < 0 || stream.req.body.size() + payload.size() > max_body) {
+            stream.deadline.reset();
+            reset_stream(id, stream.recv_window < 0 ? FlowControlError : Cancel);
+            retire_stream(id);
+            return true;
+        }
+        stream.req.body.append(payload);
+        if (flags & EndStream) {
+            stream.remote_closed = true;
+            dispatch(id, stream);
+        } else if (frame_length > 0 && stream.req.body.size() + receive_window <= max_body) {
+            // Credit is only returned up to MAX_BODY_BYTES, so flow control stops a
+            // client from sending more than a body may hold.
+            queue_window_update(id, frame_length);
+            stream.recv_window += static_cast<std::int64_t>(frame_length);
+        }
+        return true;
+    }
+
+    void on_request_timeout(std::uint32_t id) {
+        if (closed_) return;
+        auto it = streams_.find(id);
+        if (it == streams_.end() || it->second.dispatched) return;
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("HTTP/2 request on stream " + std::to_string(id) + " did not arrive in time, resetting it.");
+        it->second.deadline.reset();
+        reset_stream(id, Cancel);
+        retire_stream(id);
+        flush();
+    }
+
+    bool on_rst_stream(std::uint32_t id, std::string_view payload) {
+        if (id == 0) return connection_error(ProtocolError);
+        if (payload.size() != 4) return connection_error(FrameSizeError);
+        auto it = streams_.find(id);
+        if (it == streams_.end()) return true;
+        cancel_stream(it->second, RequestCancellation::Disconnected);
+        retire_stream(id);
+        return true;
+    }
+
+    bool on_window_update(std::uint32_t id, std::string_view payload) {
+        if (payload.size() != 4) return connection_error(FrameSizeError);
+        std::int64_t increment = read_u32(reinterpret_cast<const unsigned char*>(payload.data())) & 0x7fffffff;
+        if (id == 0) {
+            if (increment == 0) return connection_error(ProtocolError);
+            conn_send_window_ += increment;
+            if (conn_send_window_ > max_window) return connection_error(FlowControlError);
+            return true;
+        }
+        auto it = streams_.find(id);
+        if (it == streams_.end()) return true;
+        Stream& stream = it->second;
+        stream.send_window += increment;
+        if (increment == 0 || stream.send_window > max_window) {
+            reset_stream(id, increment == 0 ? ProtocolError : FlowControlError);
+            cancel_stream(stream, RequestCancellation::Disconnected);
+            retire_stream(id);
+        }
+        return true;
+    }
+
+    // Streams
+
+    Stream& open_stream(std::uint32_t id) {
+        idle_timer_.cancel();
+        Stream& stream = streams_[id];
+        stream.send_window = peer_initial_window_;
+        return stream;
+    }
+
+    void dispatch(std::uint32_t id, Stream& stream) {
+        stream.dispatched = true;
+        stream.deadline.reset();
+        Request req = std::move(stream.req);
+        stream.head = req.method == "HEAD";
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("HTTP/2 request received on stream " + std::to_string(id) + ": " + req.method + " " + req.uri);
+
+        Handler handler = is_metrics_request(req) ? metrics_handler() : handler_builder_(req);
+        Compression::Encoding encoding = _COMPRESSION_.negotiate(req);
+        RequestEntry entry = make_entry(remote_, &req, handler.route);
+        entry.route_id = handler.route_id;
+        entry.adaptive = handler.adaptive;
+
+        if (handler.route_id != Metrics::untracked) {
+            if (!_ADMISSION_.admit(handler.isHeavy, handler.route_id, worker_pool_.queueDepth())) {
+                Response res(503, "Service Unavailable");
+                res.setSerialized(_ADMISSION_.rejection());
+                respond(id, stream, std::move(res), entry);
+                return;
+            }
+            entry.admitted = true;
+            entry.heavy = handler.isHeavy;
+        }
+
+        // Every stream can be cancelled by RST_STREAM or the connection closing.
+        stream.token = std::make_shared<RequestCancellation>();
+        req.cancellation = stream.token;
+        stream.entry = entry;
+        stream.entry.admitted = false;
+        std::int64_t timeout_ns = handler.route_id == Metrics::untracked ? 0 : _DEADLINES_.timeoutNs(handler.route_id);
+        if (timeout_ns > 0) {
+            stream.token->deadline_ns = RequestCancellation::now_ns() + timeout_ns;
+            stream.deadline = std::make_unique<boost::asio::steady_timer>(strand_, std::chrono::nanoseconds(timeout_ns));
+            stream.deadline->async_wait([self = shared_from_this(), id, token = stream.token](boost::system::error_code ec) {
+                if (!ec) self->on_deadline(id, token);
+            });
+        }
+
+#ifdef CROUTER_ASYNC
+        if (handler.async) {
+            run_async(id, stream, handler.async, std::move(req), encoding, entry);
+            return;
+        }
+#endif
+
+        if (handler.isHeavy) {
+            worker_pool_.post([self = shared_from_this(), id, req = std::move(req), func = handler.func, encoding, entry]() mutable {
+                // Cancelled while queued: the stream has already been answered or reset.
+                if (req.cancelled()) {
+                    release(entry);
+                    return;
+                }
+                Response res;
+                try {
+                    auto handler_start = std::chrono::steady_clock::now();
+                    res = func(req);
+                    handler_done(entry, handler_start);
+                    _COMPRESSION_.apply(res, encoding);
+                } catch (const std::exception& ex) {
+                    _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+                    release(entry);
+                    res = error_response();
+                }
+                boost::asio::post(self->strand_, [self, id, token = req.cancellation, res = std::move(res), entry]() mutable {
+                    self->complete(id, token, std::move(res), entry);
+                });
+            });
+            return;
+        }
+
+        Response res;
+        try {
+            auto handler_start = std::chrono::steady_clock::now();
+            res = handler.func(req);
+            handler_done(entry, handler_start);
+        } catch (const std::exception& ex) {
+            _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+            release(entry);
+            respond(id, stream, error_response(), entry);
+            return;
+        }
+        if (compress_response(res, encoding, worker_pool_, strand_,
+                [self = shared_from_this(), id, token = stream.token, entry](Response& res) { self->complete(id, token, std::move(res), entry); })) {
+            return;
+        }
+        respond(id, stream, std::move(res), entry);
+    }
+
+#ifdef CROUTER_ASYNC
+    // As in Session::run_async: the coroutine runs on the connection's executor and the
+    // call owns the request until the response is handed to the stream.
+    void run_async(std::uint32_t id, Stream& stream, const std::function<Async<Response>(Request&, IAsyncIO&)>& handler, Request req,
+                   Compression::Encoding encoding, RequestEntry entry) {
+        struct Call {
+            Call(Request r, SessionAsyncIO i) : req(std::move(r)), io(std::move(i)) {}
+            Request req;
+            SessionAsyncIO io;
+            Async<Response> task;
+            RequestEntry entry;
+            std::chrono::steady_clock::time_point started;
+        };
+        auto call = std::make_shared<Call>(std::move(req), SessionAsyncIO(strand_, worker_pool_));
+        call->entry = entry;
+        call->started = std::chrono::steady_clock::now();
+        try {
+            call->task = handler(call->req, call->io);
+        } catch (const std::exception& ex) {
+            _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+            release(call->entry);
+            respond(id, stream, error_response(), call->entry);
+            return;
+        }
+        stream.on_cancel = [weak = std::weak_ptr<Call>(call)]() {
+            if (auto c = weak.lock()) c->io.cancel();
+        };
+        call->task.start([self = shared_from_this(), call, id, encoding]() {
+            boost::asio::post(self->strand_, [self, call, id, encoding]() {
+                Response res;
+                bool failed = false;
+                try {
+                    res = call->task.result();
+                    handler_done(call->entry, call->started);
+                } catch (const std::exception& ex) {
+                    _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+                    release(call->entry);
+                    res = error_response();
+                    failed = true;
+                }
+                call->task = {};
+                if (!failed && compress_response(res, encoding, self->worker_pool_, self->strand_,
+                        [self, id, token = call->req.cancellation, entry = call->entry](Response& res) { self->complete(id, token, std::move(res), entry); })) {
+                    return;
+                }
+                self->complete(id, call->req.cancellation, std::move(res), call->entry);
+            });
+        });
+    }
+#endif
+
+    // Same answer as the HTTP/1 session gives when a handler throws.
+    static Response error_response() {
+        Response res(400, "Bad Request");
+        res.setBody("");
+        return res;
+    }
+
+    // A handler finished off the read path. The result is dropped if the stream was
+    // answered (504), reset or closed meanwhile.
+    void complete(std::uint32_t id, const std::shared_ptr<RequestCancellation>& token, Response res, RequestEntry entry) {
+        if (closed_) return;
+        auto it = streams_.find(id);
+        if (it == streams_.end() || it->second.token != token || it->second.responding) return;
+        respond(id, it->second, std::move(res), entry);
+        flush();
+    }
+
+    void on_deadline(std::uint32_t id, const std::shared_ptr<RequestCancellation>& token) {
+        if (closed_) return;
+        auto it = streams_.find(id);
+        if (it == streams_.end() || it->second.token != token || it->second.responding) return;
+        Stream& stream = it->second;
+        cancel_stream(stream, RequestCancellation::Timeout);
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("Handler deadline passed for route " + _METRICS_.routeName(stream.entry.route_id) + ", answering 504.");
+        Response res(504, "Gateway Timeout");
+        res.setBody("Gateway Timeout");
+        respond(id, stream, std::move(res), stream.entry);
+        flush();
+    }
+
+    // Tells a handler that is still running that its stream is gone.
+    void cancel_stream(Stream& stream, RequestCancellation::Reason reason) {
+        stream.deadline.reset();
+        if (!stream.dispatched || stream.responding || !stream.token) return;
+        stream.token->reason.store(reason, std::memory_order_relaxed);
+        _METRICS_.cancelled(reason == RequestCancellation::Timeout ? Metrics::CancelTimeout : Metrics::CancelDisconnect);
+        if (stream.on_cancel) stream.on_cancel();
+        stream.on_cancel = nullptr;
+    }
+
+    // Drops a stream, once no write in flight can still point at its body.
+    void retire_stream(std::uint32_t id) {
+        if (writing_) {
+            retiring_.push_back(id);
+        } else {
+            streams_.erase(id);
+        }
+    }
+
+    // Writing
+
+    void respond(std::uint32_t id, Stream& stream, Response res, RequestEntry entry) {
+        stream.deadline.reset();
+        stream.on_cancel = nullptr;
+        stream.responding = true;
+        stream.res = std::move(res);
+
+        std::string block;
+        int status;
+        std::string_view body;
+        if (const auto& raw = stream.res.serialized()) {
+            // "HTTP/1.1 200 OK\r\nName: value\r\n..." up to head_end, the body after the blank line.
+            std::string_view head(raw->message.data(), raw->head_end);
+            std::size_t line_end = head.find("\r\n");
+            std::string_view status_line = head.substr(0, line_end);
+            std::size_t space = status_line.find(' ');
+            status = space == std::string_view::npos ? 500 : std::atoi(std::string(status_line.substr(space + 1, 3)).c_str());
+            hpack::Encoder::status(block, status);
+            for (std::size_t pos = line_end == std::string_view::npos ? head.size() : line_end + 2; pos < head.size();) {
+                std::size_t next = head.find("\r\n", pos);
+                if (next == std::string_view::npos) next = head.size();
+                std::string_view line = head.substr(pos, next - pos);
+                std::size_t colon = line.find(':');
+                if (colon != std::string_view::npos) {
+                    std::size_t value = line.find_first_not_of(' ', colon + 1);
+                    encode_header(block, line.substr(0, colon), value == std::string_view::npos ? std::string_view() : line.substr(value));
+                }
+                pos = next + 2;
+            }
+            body = std::string_view(raw->message).substr(raw->head_end + 2);
+        } else {
+            status = stream.res.getStatus();
+            hpack::Encoder::status(block, status);
+            for (const auto& [name, value] : stream.res.headers()) encode_header(block, name, value);
+            body = stream.res.body();
+            stream.file = stream.res.fileBody();
+        }
+        if (stream.head || status == 204 || status == 304 || status < 200) {
+            body = {};
+            stream.file.reset();
+        }
+        stream.body = body;
+        stream.body_size = stream.file ? stream.file->size() : body.size();
+
+        if (tracking()) {
+            entry.record.status = static_cast<std::uint16_t>(status);
+            entry.record.bytes = stream.body_size;
+        }
+        stream.entry = entry;
+
+        bool end_stream = stream.body_size == 0;
+        for (std::size_t pos = 0, first = 1; first || pos < block.size(); first = 0) {
+            std::size_t n = std::min<std::size_t>(peer_max_frame_, block.size() - pos);
+            bool last = pos + n == block.size();
+            std::uint8_t flags = (last ? EndHeaders : 0) | (first && end_stream ? EndStream : 0);
+            queue_frame(first ? Headers : Continuation, flags, id, std::string_view(block).substr(pos, n));
+            pos += n;
+        }
+        if (end_stream) {
+            stream.finished = true;
+            finishing_.push_back(id);
+        }
+    }
+
+    // Connection-specific headers have no place in HTTP/2; names go lower case.
+    static void encode_header(std::string& block, std::string_view name, std::string_view value) {
+        std::string lower(name);
+        for (char& c : lower) {
+            if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        }
+        if (lower == "connection" || lower == "keep-alive" || lower == "transfer-encoding" || lower == "upgrade" ||
+            lower == "proxy-connection") {
+            return;
+        }
+        hpack::Encoder::header(block, lower, value);
+    }
+
+    void send_settings() {
+        std::string payload;
+        append_setting(payload, 0x3, static_cast<std::uint32_t>(max_streams_));  // MAX_CONCURRENT_STREAMS
+        append_setting(payload, 0x4, receive_window);                            // INITIAL_WINDOW_SIZE
+        append_setting(payload, 0x6, max_header_list);                           // MAX_HEADER_LIST_SIZE
+        queue_frame(Settings, 0, 0, payload);
+        queue_window_update(0, receive_window - default_window);
+    }
+
+    static void append_setting(std::string& out, std::uint16_t setting, std::uint32_t value) {
+        out += static_cast<char>(setting >> 8);
+        out += static_cast<char>(setting & 0xff);
+        append_u32(out, value);
+    }
+
+    void queue_window_update(std::uint32_t id, std::size_t increment) {
+        std::string payload;
+        append_u32(payload, static_cast<std::uint32_t>(increment));
+        queue_frame(WindowUpdate, 0, id, payload);
+    }
+
+    void reset_stream(std::uint32_t id, ErrorCode code) {
+        std::string payload;
+        append_u32(payload, code);
+        queue_frame(RstStream, 0, id, payload);
+    }
+
+    // Sends GOAWAY and stops reading; the connection closes once it is written.
+    bool connection_error(ErrorCode code) {
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("HTTP/2 connection error " + std::to_string(code) + ", closing session.");
+        go_away(code);
+        failed_ = true;
+        for (auto& [id, stream] : streams_) cancel_stream(stream, RequestCancellation::Disconnected);
+        return false;
+    }
+
+    void go_away(ErrorCode code) {
+        if (goaway_sent_) return;
+        goaway_sent_ = true;
+        std::string payload;
+        append_u32(payload, last_stream_id_);
+        append_u32(payload, code);
+        queue_frame(GoAway, 0, 0, payload);
+    }
+
+    void queue_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id, std::string_view payload) {
+        append_frame_header(pending_, payload.size(), type, flags, id);
+        pending_.append(payload);
+    }
+
+    static void append_frame_header(std::string& out, std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t id) {
+        char header[9] = {
+            static_cast<char>((length >> 16) & 0xff), static_cast<char>((length >> 8) & 0xff), static_cast<char>(length & 0xff),
+            static_cast<char>(type), static_cast<char>(flags),
+            static_cast<char>((id >> 24) & 0x7f), static_cast<char>((id >> 16) & 0xff), static_cast<char>((id >> 8) & 0xff),
+            static_cast<char>(id & 0xff)};
+        out.append(header, sizeof(header));
+    }
+
+    static void append_u32(std::string& out, std::uint32_t value) {
+        out += static_cast<char>(value >> 24);
+        out += static_cast<char>((value >> 16) & 0xff);
+        out += static_cast<char>((value >> 8) & 0xff);
+        out += static_cast<char>(value & 0xff);
+    }
+
+    static std::uint32_t read_u32(const unsigned char* p) {
+        return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | p[3];
+    }
+
+    // Starts a gathered write of the queued control and header frames followed by as
+    // much DATA as the flow-control windows allow, unless a write is in flight.
+    void flush() {
+        if (writing_ || closed_) return;
+        out_.clear();
+        segments_.clear();
+        out_.swap(pending_);
+        if (!out_.empty()) segments_.push_back({0, out_.size(), nullptr});
+        retiring_.insert(retiring_.end(), finishing_.begin(), finishing_.end());
+        finishing_.clear();
+        // After an upgrade, body data waits for the client's preface and SETTINGS.
+        if (!failed_ && settings_received_) pump_data();
+
+        if (segments_.empty()) {
+            retire_written();
+            if (failed_ || (streams_.empty() && (goaway_sent_ || goaway_received_))) {
+                close();
+            } else if (streams_.empty()) {
+                arm_idle_timer();
+            }
+            return;
+        }
+        write_buffers_.clear();
+        for (const Segment& segment : segments_) {
+            write_buffers_.push_back(boost::asio::buffer(segment.data ? segment.data : out_.data() + segment.offset, segment.length));
+        }
+        writing_ = true;
+        boost::asio::async_write(socket_, write_buffers_,
+            boost::asio::bind_executor(strand_,
+                [self = shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    self->writing_ = false;
+                    _METRICS_.bytesOut(bytes_transferred);
+                    if (ec) {
+                        _LOGGER_.error("Error during HTTP/2 write: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
+                        self->close();
+                        return;
+                    }
+                    if (self->closed_) {
+                        self->streams_.clear();
+                        return;
+                    }
+                    self->retire_written();
+                    self->flush();
+                }));
+    }
+
+    // One DATA frame per stream in turn, starting after the stream served last, until
+    // the windows or the write budget run out.
+    void pump_data() {
+        std::size_t budget = write_budget;
+        bool progress = true;
+        while (progress && budget > 0 && conn_send_window_ > 0) {
+            progress = false;
+            auto visit = [&](std::uint32_t id, Stream& stream) {
+                if (!stream.responding || stream.finished || conn_send_window_ <= 0 || budget == 0) return;
+                std::int64_t allowed = std::min<std::int64_t>({stream.send_window, conn_send_window_, peer_max_frame_,
+                                                               static_cast<std::int64_t>(budget),
+                                                               static_cast<std::int64_t>(stream.body_size - stream.sent)});
+                if (allowed <= 0) return;
+                std::size_t n = static_cast<std::size_t>(allowed);
+                const char* data;
+                if (stream.file) {
+                    file_chunks_.emplace_back(n, '\0');
+                    n = stream.file->read(stream.sent, file_chunks_.back().data(), n);
+                    if (n == 0) {
+                        _LOGGER_.error("Error reading file body, resetting HTTP/2 stream.");
+                        std::size_t offset = out_.size();
+                        std::string payload;
+                        append_u32(payload, InternalError);
+                        append_frame_header(out_, payload.size(), RstStream, 0, id);
+                        out_.append(payload);
+                        segments_.push_back({offset, out_.size() - offset, nullptr});
+                        stream.finished = true;
+                        retiring_.push_back(id);
+                        return;
+                    }
+                    data = file_chunks_.back().data();
+                } else {
+                    data = stream.body.data() + stream.sent;
+                }
+                stream.sent += n;
+                stream.send_window -= static_cast<std::int64_t>(n);
+                conn_send_window_ -= static_cast<std::int64_t>(n);
+                budget -= n;
+                bool last = stream.sent == stream.body_size;
+                std::size_t offset = out_.size();
+                append_frame_header(out_, n, Data, last ? EndStream : 0, id);
+                segments_.push_back({offset, 9, nullptr});
+                segments_.push_back({0, n, data});
+                if (last) {
+                    stream.finished = true;
+                    retiring_.push_back(id);
+                }
+                last_served_ = id;
+                progress = true;
+            };
+            std::uint32_t start = last_served_;
+            for (auto it = streams_.upper_bound(start); it != streams_.end(); ++it) visit(it->first, it->second);
+            for (auto it = streams_.begin(); it != streams_.end() && it->first <= start; ++it) visit(it->first, it->second);
+        }
+    }
+
+    // After a write: streams whose END_STREAM went out are logged and dropped, as are
+    // streams reset while the write was in flight.
+    void retire_written() {
+        for (std::uint32_t id : retiring_) {
+            auto it = streams_.find(id);
+            if (it == streams_.end()) continue;
+            if (it->second.finished && it->second.responding && tracking()) finish_entry(it->second.entry);
+            streams_.erase(it);
+        }
+        retiring_.clear();
+        file_chunks_.clear();
+    }
+
+    void arm_idle_timer() {
+        if (CONF.http2_idle_timeout <= 0) return;
+        idle_timer_.expires_after(std::chrono::seconds(CONF.http2_idle_timeout));
+        idle_timer_.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+            if (ec || self->closed_ || !self->streams_.empty()) return;
+            _LOGGER_.debug("HTTP/2 connection idle, sending GOAWAY.");
+            self->go_away(NoError);
+            self->flush();
+        });
+    }
+
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+        for (auto& [id, stream] : streams_) cancel_stream(stream, RequestCancellation::Disconnected);
+        idle_timer_.cancel();
+        boost::system::error_code ec;
+        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        socket_.close(ec);
+        // A write in flight may still point into the streams; it clears them when it fails.
+        if (!writing_) streams_.clear();
+        _LOGGER_.debug("HTTP/2 session closed.");
+    }
+
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::any_io_executor strand_;
+    WorkerPool& worker_pool_;
+    HandlerBuilder handler_builder_;
+    boost::asio::ip::tcp::endpoint remote_;
+    boost::asio::steady_timer idle_timer_;
+    std::int64_t conn_recv_window_ = receive_window;
+    std::size_t max_streams_;
+
+    std::array<char, 16384> read_buffer_;
+    std::string in_;
+    bool preface_received_ = false;
+    bool settings_received_ = false;
+    hpack::Decoder decoder_{4096, max_header_list};
+    std::string header_block_;
+    std::uint32_t header_stream_ = 0;
+    bool header_end_stream_ = false;
+    std::uint32_t continuation_id_ = 0;
+
+    std::map<std::uint32_t, Stream> streams_;
+    std::uint32_t last_stream_id_ = 0;
+    std::uint32_t last_served_ = 0;
+    std::int64_t peer_initial_window_ = default_window;
+    std::int64_t conn_send_window_ = default_window;
+    std::int64_t peer_max_frame_ = 16384;
+
+    // Frames queued for the next write; out_ and segments_ belong to the one in flight.
+    std::string pending_;
+    std::vector<std::uint32_t> finishing_;
+    std::string out_;
+    std::vector<Segment> segments_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    std::deque<std::string> file_chunks_;
+    std::vector<std::uint32_t> retiring_;
+    bool writing_ = false;
+    bool goaway_sent_ = false;
+    bool goaway_received_ = false;
+    bool failed_ = false;
+    bool closed_ = false;
+};
+
+}  // namespace serv
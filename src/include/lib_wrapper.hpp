@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <functional>
 #include <fstream>
@@ -29,7 +30,7 @@ class LibWraper{
         std::filesystem::path dllPath = entry.parent_path() / (name + ".dll");
 
         std::string compileCmd =
-            "g++ -shared -fPIC -o \"" + dllPath.string()  + "\" \"" + entry.string() + "\" -I\"app/headers\"";
+            "g++ -std=c++20 -shared -fPIC -o \"" + dllPath.string()  + "\" \"" + entry.string() + "\" -I\"app/headers\"";
         
         std::ifstream file(entry.string());
         std::string line;
@@ -47,9 +48,19 @@ class LibWraper{
         }
         path2lib = dllPath.string();
 
-        HMODULE lib = LoadLibraryA(path2lib.c_str());
+        // Loaded from a private copy, so the DLL can be rebuilt on reload while this
+        // version is still in use; the copy is deleted once it is freed.
+        loadPath = dllPath;
+        loadPath.replace_extension("." + std::to_string(GetCurrentProcessId()) + "." + std::to_string(++loads_) + ".dll");
+        std::error_code ec;
+        std::filesystem::copy_file(dllPath, loadPath, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            throw std::runtime_error("Error while loading " + path2lib + ": " + ec.message());
+        }
+        HMODULE lib = LoadLibraryA(loadPath.string().c_str());
         if (!lib) {
             DWORD err = GetLastError();
+            std::filesystem::remove(loadPath, ec);
             throw std::runtime_error(std::string("Error while loading " + path2lib));
         }
         this->lib_ = lib;
@@ -77,13 +88,19 @@ class LibWraper{
         return name;
     }
     ~LibWraper(){
-        if(lib_) FreeLibrary(lib_);
+        if(lib_) {
+            FreeLibrary(lib_);
+            std::error_code ec;
+            std::filesystem::remove(loadPath, ec);
+        }
     }
     LibWraper(const LibWraper&) = delete;
     LibWraper(LibWraper&&) = default;
  private:
+    static inline std::atomic<unsigned> loads_{0};
     std::string name;
     std::string path2lib;
+    std::filesystem::path loadPath;
     HMODULE lib_ = nullptr;
     std::unordered_map<std::string, void*> map_;
 };
@@ -91,6 +108,7 @@ class LibWraper{
 #else
 
 #include <dlfcn.h>
+#include <unistd.h>
 #include <cstdlib>
 
 class LibWrapper {
@@ -112,7 +130,7 @@ public:
         fs::path soPath = entry.parent_path() / ("lib" + name + ".so");
 
         std::string compileCmd =
-            "g++ -shared -fPIC -o \"" + soPath.string() + "\" \"" + entry.string() + "\" -I\"app/headers\"";
+            "g++ -std=c++20 -shared -fPIC -o \"" + soPath.string() + "\" \"" + entry.string() + "\" -I\"app/headers\"";
 
         std::ifstream file(entry.string());
         std::string line;
@@ -131,7 +149,18 @@ public:
 
         path2lib = soPath.string();
 
-        void* lib = dlopen(path2lib.c_str(), RTLD_LAZY);
+        // dlopen() hands back the library already loaded from a path, so each load opens
+        // a private copy: a reload gets the new code while the previous version stays
+        // mapped for requests still running it. The copy is unlinked once mapped.
+        fs::path loadPath = soPath;
+        loadPath += "." + std::to_string(::getpid()) + "." + std::to_string(++loads_);
+        std::error_code ec;
+        fs::copy_file(soPath, loadPath, fs::copy_options::overwrite_existing, ec);
+        if (ec) {
+            throw std::runtime_error("Error while loading " + path2lib + ": " + ec.message());
+        }
+        void* lib = dlopen(loadPath.c_str(), RTLD_LAZY);
+        fs::remove(loadPath, ec);
         if (!lib) {
             throw std::runtime_error("Error while loading " + path2lib + ": " + std::string(dlerror()));
         }
@@ -171,6 +200,7 @@ public:
     }
 
 private:
+    static inline std::atomic<unsigned> loads_{0};
     std::string name;
     std::string path2lib;
     void* lib_ = nullptr;
@@ -2,155 +2,129 @@
 #include <functional>
 #include <stdexcept>
 #include <mutex>
+#include <optional>
+#include <unordered_map>
 
+// Byte-bounded LRU map. A hash index points into an intrusive doubly linked list
+// (head = most recently used) and the total byte size is kept as a running counter,
+// so get/exists/put/remove are amortized O(1) and eviction never rescans the list.
 template <typename K, typename V>
 class lru_map {
    private:
     struct Node {
         K key;
         V val;
+        long bytes = 0;
         Node* next = nullptr;
         Node* prev = nullptr;
     };
     Node* head;
     Node* tail;
-    std::function<long(V)> func;
+    std::unordered_map<K, Node*> index;
+    long bytes;
+    std::function<long(const V&)> func;
     std::mutex mtx;
 
-    void move_to_head(Node* n) {
-        if (n == head) {
-            return;
-        }
-        
-        if (n->prev) {
+    void unlink(Node* n) {
+        if (n->prev)
             n->prev->next = n->next;
-        }
-
-        if (n->next) {
+        else
+            head = n->next;
+        if (n->next)
             n->next->prev = n->prev;
-        } else {
+        else
             tail = n->prev;
-        }
-
-        n->next = head;
+        n->next = nullptr;
         n->prev = nullptr;
-        if (head) {
-            head->prev = n;
-        }
+    }
+    void push_head(Node* n) {
+        n->prev = nullptr;
+        n->next = head;
+        if (head) head->prev = n;
         head = n;
-
-        if (!tail) {
-            tail = n;
+        if (!tail) tail = n;
+    }
+    void move_to_head(Node* n) {
+        if (n == head) {
+            return;
         }
+        unlink(n);
+        push_head(n);
+    }
+    void erase_node(Node* n) {
+        unlink(n);
+        index.erase(n->key);
+        bytes -= n->bytes;
+        delete n;
     }
     void remove_tail() {
         if (!tail) return;
-        Node* node_to_delete = tail;
-        if (head == tail) {
-            head = nullptr;
-            tail = nullptr;
-        } else {
-            tail = tail->prev;
-            tail->next = nullptr;
-        }
-        delete node_to_delete;
-    }
-    long byte_size_mtx() {
-        long size = 0;
-        Node* current = head;
-        while (current) {
-            size += func(current->val);
-            current = current->next;
-        }
-        return size;
+        erase_node(tail);
     }
 
    public:
     long max_bytes;
-    lru_map(std::function<long(V)> one_element_size) : head(nullptr), tail(nullptr), func(std::move(one_element_size)), max_bytes(16777216) {}
-    lru_map(std::function<long(V)> one_element_size, long max_bytes) : head(nullptr), tail(nullptr), func(std::move(one_element_size)), max_bytes(max_bytes) {}
+    lru_map(std::function<long(const V&)> one_element_size) : head(nullptr), tail(nullptr), bytes(0), func(std::move(one_element_size)), max_bytes(16777216) {}
+    lru_map(std::function<long(const V&)> one_element_size, long max_bytes) : head(nullptr), tail(nullptr), bytes(0), func(std::move(one_element_size)), max_bytes(max_bytes) {}
     void put(const K& key, const V& val) {
         std::lock_guard<std::mutex> lock(mtx);
-        if (func(val) > max_bytes) throw std::runtime_error("lru_map::put(const K& key, const V& val): val bigger than max_bytes");
-        if (!head) {
-            head = new Node;
-            tail = head;
-            head->key = key;
-            head->val = val;
+        long val_bytes = func(val);
+        if (val_bytes > max_bytes) throw std::runtime_error("lru_map::put(const K& key, const V& val): val bigger than max_bytes");
+        auto it = index.find(key);
+        if (it != index.end()) {
+            Node* find = it->second;
+            move_to_head(find);
+            bytes -= find->bytes;
+            while (bytes + val_bytes > max_bytes && tail != find) remove_tail();
+            find->val = val;
+            find->bytes = val_bytes;
+            bytes += val_bytes;
         } else {
-            Node* find = head;
-            while (find) {
-                if (find->key == key) break;
-                find = find->next;
-            }
-            if (find) {
-                while (byte_size_mtx() - func(find->val) + func(val) > max_bytes) remove_tail();
-                find->val = val;
-            } else {
-                while (byte_size_mtx() + func(val) > max_bytes) remove_tail();
-                find = new Node;
-                find->key = key;
-                find->val = val;
-                find->next = head;
-                head->prev = find;
-                head = find;
-            }
+            while (bytes + val_bytes > max_bytes && tail) remove_tail();
+            Node* find = new Node;
+            find->key = key;
+            find->val = val;
+            find->bytes = val_bytes;
+            push_head(find);
+            index.emplace(key, find);
+            bytes += val_bytes;
         }
     }
+    // Lookup and copy in one critical section, unlike exists() followed by get().
+    std::optional<V> find(const K& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it == index.end()) return std::nullopt;
+        move_to_head(it->second);
+        return it->second->val;
+    }
     bool exists(const K& key) {
         std::lock_guard<std::mutex> lock(mtx);
-        Node* find = head;
-        while (find) {
-            if (find->key == key) break;
-            find = find->next;
-        }
-        return find != nullptr;
+        return index.find(key) != index.end();
     }
     void remove(const K& key) {
         std::lock_guard<std::mutex> lock(mtx);
-        Node* find = head;
-        while (find) {
-            if (find->key == key) break;
-            find = find->next;
-        }
-        if (find) {
-            if (find->prev)
-                find->prev->next = find->next;
-            else
-                head = find->next;
-            if (find->next)
-                find->next->prev = find->prev;
-            else
-                tail = find->prev;
-            delete find;
+        auto it = index.find(key);
+        if (it != index.end()) {
+            erase_node(it->second);
         }
     }
     const V& get(const K& key) {
         std::lock_guard<std::mutex> lock(mtx);
-        Node* find = head;
-        while (find) {
-            if (find->key == key) break;
-            find = find->next;
-        }
-        if (find) {
-            move_to_head(find);
-            return find->val;
+        auto it = index.find(key);
+        if (it != index.end()) {
+            move_to_head(it->second);
+            return it->second->val;
         }
         throw std::runtime_error("lru_map::get(const K& key): key not found");
     }
     int size() {
         std::lock_guard<std::mutex> lock(mtx);
-        int counter = 0;
-        Node* current = head;
-        while (current) {
-            counter++;
-            current = current->next;
-        }
-        return counter;
+        return static_cast<int>(index.size());
     }
     long byte_size() {
         std::lock_guard<std::mutex> lock(mtx);
-        return byte_size_mtx();
+        return bytes;
     }
     ~lru_map() {
         std::lock_guard<std::mutex> lock(mtx);
@@ -164,4 +138,4 @@ class lru_map {
     lru_map() = delete;
     lru_map(const lru_map&) = delete;
     lru_map& operator=(const lru_map&) = delete;
-};
\ No newline at end of file
+};
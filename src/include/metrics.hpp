@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram: every power of two of
+// nanoseconds from 2^min_exp up to 2^max_exp is split into sub_count linear buckets,
+// so the relative error stays under 1/sub_count across the whole range.
+// Written by one thread only (see Metrics), read by any.
+struct LatencyHistogram {
+    static constexpr int min_exp = 10;  // ~1 us
+    static constexpr int max_exp = 36;  // ~69 s
+    static constexpr int sub_bits = 2;
+    static constexpr int sub_count = 1 << sub_bits;
+    // Bucket 0 holds everything below 2^min_exp, the last one everything from 2^max_exp.
+    static constexpr int bucket_count = (max_exp - min_exp) * sub_count + 2;
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> buckets{};
+    std::atomic<std::uint64_t> sum_ns{0};
+
+    static int index(std::uint64_t ns) {
+        if (ns < (std::uint64_t(1) << min_exp)) return 0;
+        int exp = log2(ns);
+        if (exp >= max_exp) return bucket_count - 1;
+        int sub = static_cast<int>((ns >> (exp - sub_bits)) & (sub_count - 1));
+        return 1 + (exp - min_exp) * sub_count + sub;
+    }
+    static int log2(std::uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(x);
+#else
+        int r = 0;
+        while (x >>= 1) r++;
+        return r;
+#endif
+    }
+    // Exclusive upper bound of a bucket in nanoseconds; the last bucket has none.
+    static std::uint64_t upper_bound(int index) {
+        if (index == 0) return std::uint64_t(1) << min_exp;
+        int exp = min_exp + (index - 1) / sub_count;
+        int sub = (index - 1) % sub_count;
+        return (std::uint64_t(1) << exp) + (std::uint64_t(sub + 1) << (exp - sub_bits));
+    }
+};
+
+// Process-wide counters for the /metrics endpoint. Each thread updates its own block
+// with plain relaxed loads and stores (no locked instructions, no shared cache lines);
+// a scrape walks every block and sums them. Routes get small ids when the router is
+// built, so per-route data is a direct array index.
+class Metrics {
+   public:
+    static constexpr std::size_t max_routes = 128;
+    // Route id 0 collects the default handler and anything without a route of its own.
+    static constexpr std::uint32_t default_route = 0;
+    // Requests that are not counted per route (the scrapes themselves).
+    static constexpr std::uint32_t untracked = UINT32_MAX;
+
+    enum Cache { BodyCache, ResponseCache, NegativeCache, cache_kinds };
+    enum Rejection { RejectSessions, RejectInflight, RejectHeavyQueue, RejectRouteQueue, rejection_kinds };
+    enum Cancel { CancelTimeout, CancelDisconnect, cancel_kinds };
+
+    Metrics() {
+        route_names_.push_back("default");
+    }
+
+    bool enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+    void setEnabled(bool enabled) {
+        enabled_.store(enabled, std::memory_order_relaxed);
+    }
+
+    // Stable id for a route label. Once max_routes is reached, new routes share "other".
+    std::uint32_t routeId(const std::string& route) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = route_ids_.find(route);
+        if (it != route_ids_.end()) return it->second;
+        if (route_names_.size() == max_routes - 1) route_names_.push_back("other");
+        if (route_names_.size() >= max_routes) return max_routes - 1;
+        std::uint32_t id = static_cast<std::uint32_t>(route_names_.size());
+        route_names_.push_back(route);
+        route_ids_.emplace(route, id);
+        return id;
+    }
+    std::string routeName(std::uint32_t route_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return route_id < route_names_.size() ? route_names_[route_id] : "other";
+    }
+
+    // Every recorder is a no-op while metrics are disabled.
+    void accepted() { if (enabled()) bump(local().accepts); }
+    void sessionOpened() { if (enabled()) bump(local().sessions_opened); }
+    void sessionClosed() { if (enabled()) bump(local().sessions_closed); }
+    void bytesIn(std::uint64_t n) { if (enabled()) bump(local().bytes_in, n); }
+    void bytesOut(std::uint64_t n) { if (enabled()) bump(local().bytes_out, n); }
+    void cacheHit(Cache cache) { if (enabled()) bump(local().cache_hits[cache]); }
+    void cacheMiss(Cache cache) { if (enabled()) bump(local().cache_misses[cache]); }
+    void rejected(Rejection reason) { if (enabled()) bump(local().rejected[reason]); }
+    void cancelled(Cancel reason) { if (enabled()) bump(local().cancelled[reason]); }
+
+    void request(std::uint32_t route, int status, std::uint64_t total_ns) {
+        if (!enabled() || route == untracked) return;
+        if (route >= max_routes) route = default_route;
+        Block& block = local();
+        int status_class = status / 100 - 1;
+        if (status_class < 0 || status_class > 4) status_class = 4;
+        bump(block.routes[route].status[status_class]);
+        record(block.routes[route].latency, total_ns);
+    }
+
+    // Worker pool instrumentation: queued() when a task is posted, started() when a
+    // worker picks it up, with the time it spent waiting.
+    void workerQueued() {
+        if (!enabled()) return;
+        queue_depth_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void workerStarted(std::uint64_t wait_ns) {
+        if (!enabled()) return;
+        queue_depth_.fetch_sub(1, std::memory_order_relaxed);
+        Block& block = local();
+        bump(block.worker_tasks);
+        record(block.worker_wait, wait_ns);
+    }
+
+    // Prometheus text exposition format, version 0.0.4.
+    std::string render() {
+        std::vector<std::string> names;
+        std::vector<Block*> blocks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            names = route_names_;
+            for (auto& block : blocks_) blocks.push_back(block.get());
+        }
+        auto sum = [&](auto member) {
+            std::uint64_t total = 0;
+            for (Block* block : blocks) total += (block->*member).load(std::memory_order_relaxed);
+            return total;
+        };
+
+        std::string out;
+        out.reserve(4096);
+        counter(out, "crouter_accepts_total", "Accepted connections.", sum(&Block::accepts));
+        std::uint64_t opened = sum(&Block::sessions_opened);
+        std::uint64_t closed = sum(&Block::sessions_closed);
+        gauge(out, "crouter_sessions_active", "Open HTTP sessions.", opened >= closed ? opened - closed : 0);
+        counter(out, "crouter_received_bytes_total", "Bytes read from clients.", sum(&Block::bytes_in));
+        counter(out, "crouter_sent_bytes_total", "Bytes written to clients.", sum(&Block::bytes_out));
+
+        static const char* cache_names[cache_kinds] = {"body", "response", "negative"};
+        header(out, "crouter_cache_hits_total", "Static file cache hits.", "counter");
+        for (int c = 0; c < cache_kinds; c++) {
+            std::uint64_t total = 0;
+            for (Block* block : blocks) total += block->cache_hits[c].load(std::memory_order_relaxed);
+            out += "crouter_cache_hits_total{cache=\"" + std::string(cache_names[c]) + "\"} " + std::to_string(total) + "\n";
+        }
+        header(out, "crouter_cache_misses_total", "Static file cache misses.", "counter");
+        for (int c = 0; c < cache_kinds; c++) {
+            std::uint64_t total = 0;
+            for (Block* block : blocks) total += block->cache_misses[c].load(std::memory_order_relaxed);
+            out += "crouter_cache_misses_total{cache=\"" + std::string(cache_names[c]) + "\"} " + std::to_string(total) + "\n";
+        }
+
+        static const char* rejection_names[rejection_kinds] = {"sessions", "inflight", "heavy_queue", "route_queue"};
+        header(out, "crouter_rejected_total", "Connections and requests shed by admission control.", "counter");
+        for (int r = 0; r < rejection_kinds; r++) {
+            std::uint64_t total = 0;
+            for (Block* block : blocks) total += block->rejected[r].load(std::memory_order_relaxed);
+            out += "crouter_rejected_total{reason=\"" + std::string(rejection_names[r]) + "\"} " + std::to_string(total) + "\n";
+        }
+
+        static const char* cancel_names[cancel_kinds] = {"timeout", "disconnect"};
+        header(out, "crouter_cancelled_total", "Requests abandoned while their handler ran.", "counter");
+        for (int c = 0; c < cancel_kinds; c++) {
+            std::uint64_t total = 0;
+            for (Block* block : blocks) total += block->cancelled[c].load(std::memory_order_relaxed);
+            out += "crouter_cancelled_total{reason=\"" + std::string(cancel_names[c]) + "\"} " + std::to_string(total) + "\n";
+        }
+
+        gauge(out, "crouter_worker_queue_depth", "Heavy tasks waiting for a worker.",
+              static_cast<std::uint64_t>(std::max<std::int64_t>(0, queue_depth_.load(std::memory_order_relaxed))));
+        counter(out, "crouter_worker_tasks_total", "Heavy tasks started.", sum(&Block::worker_tasks));
+        Snapshot wait;
+        for (Block* block : blocks) wait.add(block->worker_wait);
+        header(out, "crouter_worker_wait_seconds", "Time heavy tasks spent queued.", "histogram");
+        histogram(out, "crouter_worker_wait_seconds", "", wait);
+
+        static const char* status_names[5] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+        header(out, "crouter_requests_total", "Requests by route and status class.", "counter");
+        std::vector<Snapshot> latency(names.size());
+        for (std::size_t r = 0; r < names.size(); r++) {
+            std::string label = "route=\"" + escape(names[r]) + "\"";
+            for (int s = 0; s < 5; s++) {
+                std::uint64_t total = 0;
+                for (Block* block : blocks) total += block->routes[r].status[s].load(std::memory_order_relaxed);
+                if (total == 0) continue;
+                out += "crouter_requests_total{" + label + ",status=\"" + status_names[s] + "\"} " + std::to_string(total) + "\n";
+            }
+            for (Block* block : blocks) latency[r].add(block->routes[r].latency);
+        }
+        header(out, "crouter_request_duration_seconds", "Time from a request being parsed to its response being written.", "histogram");
+        for (std::size_t r = 0; r < names.size(); r++) {
+            if (latency[r].count == 0) continue;
+            histogram(out, "crouter_request_duration_seconds", "route=\"" + escape(names[r]) + "\",", latency[r]);
+        }
+        header(out, "crouter_request_duration_quantile_seconds", "Request duration quantiles from the full-resolution histogram.", "gauge");
+        for (std::size_t r = 0; r < names.size(); r++) {
+            if (latency[r].count == 0) continue;
+            for (const char* q : {"0.5", "0.9", "0.99", "0.999"}) {
+                out += "crouter_request_duration_quantile_seconds{route=\"" + escape(names[r]) + "\",quantile=\"" + q + "\"} " +
+                       seconds(latency[r].quantile(std::stod(q))) + "\n";
+            }
+        }
+        return out;
+    }
+
+   private:
+    struct RouteStats {
+        std::array<std::atomic<std::uint64_t>, 5> status{};
+        LatencyHistogram latency;
+    };
+    struct Block {
+        std::atomic<std::uint64_t> accepts{0};
+        std::atomic<std::uint64_t> sessions_opened{0};
+        std::atomic<std::uint64_t> sessions_closed{0};
+        std::atomic<std::uint64_t> bytes_in{0};
+        std::atomic<std::uint64_t> bytes_out{0};
+        std::atomic<std::uint64_t> worker_tasks{0};
+        std::array<std::atomic<std::uint64_t>, cache_kinds> cache_hits{};
+        std::array<std::atomic<std::uint64_t>, cache_kinds> cache_misses{};
+        std::array<std::atomic<std::uint64_t>, rejection_kinds> rejected{};
+        std::array<std::atomic<std::uint64_t>, cancel_kinds> cancelled{};
+        LatencyHistogram worker_wait;
+        std::array<RouteStats, max_routes> routes;
+    };
+
+    // Histogram summed over all threads.
+    struct Snapshot {
+        std::array<std::uint64_t, LatencyHistogram::bucket_count> buckets{};
+        std::uint64_t count = 0;
+        std::uint64_t sum_ns = 0;
+        void add(const LatencyHistogram& h) {
+            for (int i = 0; i < LatencyHistogram::bucket_count; i++) {
+                std::uint64_t n = h.buckets[i].load(std::memory_order_relaxed);
+                buckets[i] += n;
+                count += n;
+            }
+            sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+        }
+        std::uint64_t quantile(double q) const {
+            std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count));
+            std::uint64_t seen = 0;
+            for (int i = 0; i < LatencyHistogram::bucket_count - 1; i++) {
+                seen += buckets[i];
+                if (seen > rank) return LatencyHistogram::upper_bound(i);
+            }
+            return LatencyHistogram::upper_bound(LatencyHistogram::bucket_count - 2);
+        }
+    };
+
+    // Only the owning thread writes, so a load and a store replace a locked add.
+    static void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static void record(LatencyHistogram& h, std::uint64_t ns) {
+        bump(h.buckets[LatencyHistogram::index(ns)]);
+        bump(h.sum_ns, ns);
+    }
+
+    Block& local() {
+        thread_local Block* block = nullptr;
+        if (!block) {
+            auto owned = std::make_unique<Block>();
+            block = owned.get();
+            // Blocks outlive their threads so totals never go backwards.
+            std::lock_guard<std::mutex> lock(mutex_);
+            blocks_.push_back(std::move(owned));
+        }
+        return *block;
+    }
+
+    static std::string seconds(std::uint64_t ns) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.9g", static_cast<double>(ns) / 1e9);
+        return buf;
+    }
+    static std::string escape(const std::string& value) {
+        std::string out;
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out;
+    }
+    static void header(std::string& out, const char* name, const char* help, const char* type) {
+        out += "# HELP " + std::string(name) + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    }
+    static void counter(std::string& out, const char* name, const char* help, std::uint64_t value) {
+        header(out, name, help, "counter");
+        out += std::string(name) + " " + std::to_string(value) + "\n";
+    }
+    static void gauge(std::string& out, const char* name, const char* help, std::uint64_t value) {
+        header(out, name, help, "gauge");
+        out += std::string(name) + " " + std::to_string(value) + "\n";
+    }
+    // Exposes the histogram with one bucket per power of two, coarser than it is kept.
+    static void histogram(std::string& out, const char* name, const std::string& labels, const Snapshot& s) {
+        std::uint64_t cumulative = s.buckets[0];
+        out += std::string(name) + "_bucket{" + labels + "le=\"" + seconds(LatencyHistogram::upper_bound(0)) + "\"} " + std::to_string(cumulative) + "\n";
+        for (int i = 1; i < LatencyHistogram::bucket_count - 1; i++) {
+            cumulative += s.buckets[i];
+            if (i % LatencyHistogram::sub_count != 0) continue;
+            out += std::string(name) + "_bucket{" + labels + "le=\"" + seconds(LatencyHistogram::upper_bound(i)) + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        std::string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+        out += std::string(name) + "_bucket{" + labels + "le=\"+Inf\"} " + std::to_string(s.count) + "\n";
+        out += std::string(name) + "_sum" + plain + " " + seconds(s.sum_ns) + "\n";
+        out += std::string(name) + "_count" + plain + " " + std::to_string(s.count) + "\n";
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Block>> blocks_;
+    std::vector<std::string> route_names_;
+    std::unordered_map<std::string, std::uint32_t> route_ids_;
+    std::atomic<std::int64_t> queue_depth_{0};
+};
+
+Metrics _METRICS_;
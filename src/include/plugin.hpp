@@ -9,6 +9,10 @@
 
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <iostream>
 #include <functional>
@@ -21,6 +25,8 @@
 #include <queue>
 
 #include "request.hpp"
+#include "spsc_ring.hpp"
+#include "worker_pool.hpp"
 
 class ILogger {
    public:
@@ -48,6 +54,181 @@ class IWebSocketPool {
     virtual ~IWebSocketPool() = default;
 };
 
+class IAsyncPlugin;
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#define CROUTER_ASYNC 1
+
+// Where an Async<T> keeps its result: `co_return value;`, or a bare `co_return;` for
+// Async<void>.
+template <typename T>
+struct AsyncResult {
+    std::optional<T> value;
+    template <typename U>
+    void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+    T take() { return std::move(*value); }
+};
+template <>
+struct AsyncResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+// Lazy coroutine returning a T: async handlers return Async<Response>, and helpers a
+// plugin writes itself can return any Async<T> (Async<void> included) and be
+// co_awaited from there.
+template <typename T>
+class Async {
+   public:
+    struct promise_type : AsyncResult<T> {
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+        std::function<void()> on_done;
+
+        Async get_return_object() { return Async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Final {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    promise_type& promise = handle.promise();
+                    if (promise.continuation) return promise.continuation;
+                    if (promise.on_done) promise.on_done();
+                    return std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Async() = default;
+    Async(Async&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Async& operator=(Async&& other) noexcept {
+        if (this != &other) {
+            reset();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    ~Async() { reset(); }
+
+    auto operator co_await() noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+            T await_resume() { return take(handle.promise()); }
+        };
+        return Awaiter{handle_};
+    }
+
+    // Used by the server: runs the coroutine up to its first suspension; on_done is
+    // called once it has finished, after which result() returns or rethrows.
+    void start(std::function<void()> on_done) {
+        handle_.promise().on_done = std::move(on_done);
+        handle_.resume();
+    }
+    T result() { return take(handle_.promise()); }
+
+   private:
+    explicit Async(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    static T take(promise_type& promise) {
+        if (promise.error) std::rethrow_exception(promise.error);
+        return promise.take();
+    }
+    void reset() {
+        if (handle_) handle_.destroy();
+        handle_ = {};
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Awaitable over a callback-style server call. The server always completes the call
+// later on the request's executor, never from inside start.
+template <typename T>
+class AsyncCall {
+   public:
+    using Start = std::function<void(std::function<void(T)>)>;
+    explicit AsyncCall(Start start) : start_(std::move(start)) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> caller) {
+        start_([this, caller](T result) {
+            result_.emplace(std::move(result));
+            caller.resume();
+        });
+    }
+    T await_resume() { return std::move(*result_); }
+
+   private:
+    Start start_;
+    std::optional<T> result_;
+};
+
+class IAsyncSocket {
+   public:
+    // An empty string means the peer closed the connection or the read failed.
+    virtual void startRead(std::size_t max_bytes, std::function<void(std::string)> done) = 0;
+    virtual void startWrite(std::string data, std::function<void(bool)> done) = 0;
+    virtual void close() = 0;
+    virtual ~IAsyncSocket() = default;
+
+    AsyncCall<std::string> read(std::size_t max_bytes = 16384) {
+        return AsyncCall<std::string>([this, max_bytes](auto done) { startRead(max_bytes, std::move(done)); });
+    }
+    AsyncCall<bool> write(std::string data) {
+        return AsyncCall<bool>([this, data = std::move(data)](auto done) { startWrite(std::move(data), std::move(done)); });
+    }
+};
+
+// Non-blocking primitives for async handlers, e.g.
+//   co_await io.sleep(100);
+//   std::optional<std::string> page = co_await io.readFile("public/index.html");
+//   std::unique_ptr<IAsyncSocket> upstream = co_await io.connect("localhost", "9000");
+// The coroutine resumes on the executor of the request's connection.
+class IAsyncIO {
+   public:
+    virtual void startSleep(long ms, std::function<void(bool)> done) = 0;
+    virtual void startReadFile(const std::string& path, std::function<void(std::optional<std::string>)> done) = 0;
+    virtual void startConnect(const std::string& host, const std::string& port, std::function<void(std::unique_ptr<IAsyncSocket>)> done) = 0;
+    virtual ~IAsyncIO() = default;
+
+    // Resumes with false if the wait was cut short.
+    AsyncCall<bool> sleep(long ms) {
+        return AsyncCall<bool>([this, ms](auto done) { startSleep(ms, std::move(done)); });
+    }
+    // Resumes with std::nullopt if the file cannot be read.
+    AsyncCall<std::optional<std::string>> readFile(std::string path) {
+        return AsyncCall<std::optional<std::string>>([this, path = std::move(path)](auto done) { startReadFile(path, std::move(done)); });
+    }
+    // Resumes with nullptr if the host cannot be resolved or reached.
+    AsyncCall<std::unique_ptr<IAsyncSocket>> connect(std::string host, std::string port) {
+        return AsyncCall<std::unique_ptr<IAsyncSocket>>([this, host = std::move(host), port = std::move(port)](auto done) {
+            startConnect(host, port, std::move(done));
+        });
+    }
+};
+
+class IAsyncPlugin {
+   public:
+    virtual Async<Response> handleAsync(Request&, IAsyncIO&) = 0;
+    virtual ~IAsyncPlugin() = default;
+};
+#endif
+
+// Where a request runs: Light on the IO thread, Heavy on the worker pool, Auto lets the
+// server decide from the route's recent handler latency (see ADAPTIVE_HEAVY).
+enum class Execution { Auto, Light, Heavy };
+
 class IPlugin {
    public:
     virtual Response handle(Request &) = 0;
@@ -62,19 +243,41 @@ class IPlugin {
         return this;
     }
     virtual ~IPlugin() = default;
+    // Routes served by this plugin, e.g. "GET /api/users/:id" or "/api/*" (any method).
+    // Empty means "/<plugin name>" and everything below it.
+    virtual std::vector<std::string> routes(){return {};};
+    // Per-request override of where handle() runs. Only asked when isHeavy() is false.
+    virtual Execution execution(Request&){return Execution::Auto;};
+    // Plugins that also derive from IAsyncPlugin return this; the server then runs
+    // handleAsync() as a coroutine instead of calling handle().
+    virtual IAsyncPlugin* asAsync(){return nullptr;};
 
    protected:
     ILogger *_LOGGER_ = nullptr;
     IWebSocketPool *_WEBSOCKETS_ = nullptr;
 };
 
+#ifdef CROUTER_ASYNC
+// Convenience base for plugins that only implement handleAsync().
+class AsyncPlugin : public IPlugin, public IAsyncPlugin {
+   public:
+    Response handle(Request&) override { return Response(501, "Not Implemented"); }
+    IAsyncPlugin* asAsync() override { return this; }
+};
+#endif
+
 #include <ctime>
 
 namespace __PLUGIN_HELPER__ {
-inline std::string getTime() {
-    std::time_t now = std::time(nullptr);
+inline std::string getTime(std::time_t now = std::time(nullptr)) {
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
     char buf[20];
-    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
     return buf;
 }
 inline std::string replace_all(const std::string &str, const std::string &from, const std::string &to) {
@@ -131,42 +334,169 @@ void showCursor(){
 void enableANSI() {}
 #endif
 
+enum class LogLevel { Debug = 0, Info, Warning, Error, Off };
+
+// Asynchronous logger. Every thread that logs gets its own lock-free ring buffer, a
+// background thread drains them and writes to the terminal, so IO threads never
+// wait on std::cout. Messages are dropped (and counted) when a ring is full.
 class Logger : public ILogger {
    public:
-    Logger(){
+    Logger() {
         std::cout << "\n\n";
+        writer_ = std::thread([this] { drain_loop(); });
     }
+    ~Logger() {
+        stop();
+    }
+
+    // Messages below `level` are discarded. With sample_rate N > 1 about one in N debug
+    // messages (the per-request ones) is kept.
+    // buffer_size applies to threads that log for the first time afterwards.
+    void configure(LogLevel level, int sample_rate, std::size_t buffer_size) {
+        level_.store(level, std::memory_order_relaxed);
+        sample_rate_.store(sample_rate < 1 ? 1 : sample_rate, std::memory_order_relaxed);
+        rings_.set_capacity(buffer_size);
+    }
+    static LogLevel parseLevel(const std::string& name) {
+        if (name == "debug") return LogLevel::Debug;
+        if (name == "warning") return LogLevel::Warning;
+        if (name == "error") return LogLevel::Error;
+        if (name == "off" || name == "none") return LogLevel::Off;
+        return LogLevel::Info;
+    }
+    // Lets hot paths skip building a message that would be thrown away.
+    bool enabled(LogLevel level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
     void commandLine(const std::string& cmd){
-        if(!to_print) return;
-        std::lock_guard<std::mutex> lock(mutex_);
+        if(!to_print.exchange(false)) return;
+        std::lock_guard<std::mutex> lock(out_mutex_);
         hideCursor();
         std::cout << clrl << "\r> " << cmd;
         showCursor();
-        to_print = false;
+    }
+    void debug(std::string message) {
+        push(LogLevel::Debug, std::move(message));
     }
     void log(const std::string &message) override {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::cout << "\r" << clrl << upl << clrl << upl << "\033[0m[" << __PLUGIN_HELPER__::getTime() << "][T" << std::this_thread::get_id() << "] " << __PLUGIN_HELPER__::replace_all(message, "\n", "\n    ") << "\033[0m\n\n\n";
-        to_print = true;
+        push(LogLevel::Info, std::string(message));
+    }
+    void log(std::string &&message) {
+        push(LogLevel::Info, std::move(message));
     }
     void warning(const std::string &message) override {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::cout << "\r" << clrl << upl << clrl << upl << "\033[0m[" << __PLUGIN_HELPER__::getTime() << "][T" << std::this_thread::get_id() << "] \033[33m[WhuiRNING] " << __PLUGIN_HELPER__::replace_all(message, "\n", "\n    ") << "\033[0m\n\n\n";
-        showCursor();
-        to_print = true;
+        push(LogLevel::Warning, std::string(message));
+    }
+    void warning(std::string &&message) {
+        push(LogLevel::Warning, std::move(message));
     }
     void error(const std::string &message) override {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::cout << "\r" << clrl << upl << clrl << upl << "\033[0m[" << __PLUGIN_HELPER__::getTime() << "][T" << std::this_thread::get_id() << "] \033[31m[ERROR] " << __PLUGIN_HELPER__::replace_all(message, "\n", "\n    ") << "\033[0m\n\n\n";
-        to_print = true;
+        push(LogLevel::Error, std::string(message));
+    }
+    void error(std::string &&message) {
+        push(LogLevel::Error, std::move(message));
     }
     void update(){
         to_print = true;
     }
 
+    // Writes out everything queued so far and stops the background thread.
+    void stop() {
+        if (!running_.exchange(false)) return;
+        wake_.notify_one();
+        if (writer_.joinable()) writer_.join();
+    }
+
    private:
-    bool to_print = true;
-    std::mutex mutex_;
+    struct Entry {
+        LogLevel level = LogLevel::Info;
+        std::time_t time = 0;
+        std::string message;
+    };
+    void push(LogLevel level, std::string&& message) {
+        if (!enabled(level)) return;
+        if (level == LogLevel::Debug) {
+            int rate = sample_rate_.load(std::memory_order_relaxed);
+            // Random rather than every Nth, so fixed message patterns don't alias.
+            if (rate > 1) {
+                thread_local std::uint64_t sample_state = 0x9E3779B97F4A7C15ull;
+                sample_state ^= sample_state << 13;
+                sample_state ^= sample_state >> 7;
+                sample_state ^= sample_state << 17;
+                if (sample_state % rate != 0) return;
+            }
+        }
+        if (rings_.push(Entry{level, std::time(nullptr), std::move(message)}) && idle_.load(std::memory_order_relaxed)) {
+            wake_.notify_one();
+        }
+    }
+
+    void drain_loop() {
+        std::string out;
+        while (true) {
+            bool stopping = !running_.load();
+            out.clear();
+            rings_.drain(
+                [&](const auto& ring, const Entry& entry) {
+                    append(out, entry.level, entry.time, ring.id, entry.message);
+                },
+                [&](const auto& ring, std::uint64_t dropped) {
+                    append(out, LogLevel::Warning, std::time(nullptr), ring.id,
+                           "Log buffer full, dropped " + std::to_string(dropped) + " messages.");
+                });
+            if (!out.empty()) {
+                std::lock_guard<std::mutex> lock(out_mutex_);
+                std::cout << "\r" << clrl << upl << clrl << upl << out << "\n\n" << std::flush;
+                to_print = true;
+                continue;
+            }
+            if (stopping) break;
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            idle_.store(true, std::memory_order_relaxed);
+            // The timeout covers a notify that raced with going idle.
+            wake_.wait_for(lock, std::chrono::milliseconds(20));
+            idle_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void append(std::string& out, LogLevel level, std::time_t time, unsigned thread, const std::string& message) {
+        if (time != cached_time_) {
+            cached_time_ = time;
+            cached_stamp_ = __PLUGIN_HELPER__::getTime(time);
+        }
+        out += "\033[0m[";
+        out += cached_stamp_;
+        out += "][T";
+        out += std::to_string(thread);
+        out += "] ";
+        if (level == LogLevel::Warning) out += "\033[33m[WARNING] ";
+        else if (level == LogLevel::Error) out += "\033[31m[ERROR] ";
+        else if (level == LogLevel::Debug) out += "\033[90m[DEBUG] ";
+        for (char c : message) {
+            out += c;
+            if (c == '\n') out += "    ";
+        }
+        out += "\033[0m\n";
+    }
+
+    std::atomic<LogLevel> level_{LogLevel::Info};
+    std::atomic<int> sample_rate_{1};
+    per_thread_rings<Entry> rings_{4096};
+
+    std::atomic<bool> running_{true};
+    std::atomic<bool> idle_{false};
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::thread writer_;
+
+    // Only touched by the writer thread.
+    std::time_t cached_time_ = 0;
+    std::string cached_stamp_;
+
+    // Serializes the writer with the command prompt redraw; IO threads never take it.
+    std::mutex out_mutex_;
+    std::atomic<bool> to_print{true};
     inline static const char* upl = "\033[A";
     inline static const char* clrl = "\033[2K";
 };
@@ -178,7 +508,7 @@ class WebSocketSession : public std::enable_shared_from_this<WebSocketSession>,
     WebSocketSession(
         std::shared_ptr<boost::beast::websocket::stream<boost::beast::tcp_stream>> ws,
         boost::asio::io_context &io_context,
-        boost::asio::thread_pool &worker_pool)
+        WorkerPool &worker_pool)
         : ws_(ws),
           io_context_(io_context),
           worker_pool_(worker_pool),
@@ -246,9 +576,10 @@ class WebSocketSession : public std::enable_shared_from_this<WebSocketSession>,
                     std::string message = boost::beast::buffers_to_string(self->buffer_.data());
                     self->buffer_.consume(self->buffer_.size());
 
-                    _LOGGER_.log("WebSocket message received: " + message);
+                    if (_LOGGER_.enabled(LogLevel::Debug))
+                        _LOGGER_.debug("WebSocket message received: " + message);
 
-                    boost::asio::post(self->worker_pool_, [self, message]() {
+                    self->worker_pool_.post([self, message]() {
                         if(self->onrecieve) self->onrecieve(message);
                     });
 
@@ -275,7 +606,7 @@ class WebSocketSession : public std::enable_shared_from_this<WebSocketSession>,
     friend class WebSocketPool;
     std::shared_ptr<boost::beast::websocket::stream<boost::beast::tcp_stream>> ws_;
     boost::asio::io_context &io_context_;
-    boost::asio::thread_pool &worker_pool_;
+    WorkerPool &worker_pool_;
     boost::asio::io_context::strand strand_;
     boost::beast::flat_buffer buffer_;
     std::queue<std::string> write_queue_;
@@ -1,44 +1,101 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <lib_wrapper.hpp>
+#include "admission.hpp"
+#include "deadline.hpp"
+#include "metrics.hpp"
 #include "plugin.hpp"
+#include "router.hpp"
 
 
 namespace _PLUGINS_ {
+    // A plugin's library and the instance it created, shared by the routes and the
+    // custom default handler serving it: the library stays loaded until the last request
+    // using the plugin is done. Members are destroyed in reverse, instance before library.
     struct LibInstance{
         std::unique_ptr<LibWraper> lib = nullptr;
-        std::shared_ptr<IPlugin> instance = nullptr;
+        std::unique_ptr<IPlugin> instance = nullptr;
         LibInstance(std::unique_ptr<LibWraper> l, IPlugin* p): lib(std::move(l)), instance(p) {}
     };
-    std::unordered_map<std::string, LibInstance> loadedPlugins;
+    std::unordered_map<std::string, std::shared_ptr<LibInstance>> loadedPlugins;
+
+    // The instance, owning its LibInstance.
+    std::shared_ptr<IPlugin> pin(const std::shared_ptr<LibInstance>& loaded) {
+        return std::shared_ptr<IPlugin>(loaded, loaded->instance.get());
+    }
+
     void clear(){
         loadedPlugins.clear();
     }
+    // Compiles and loads every plugin in `dir`, then replaces loadedPlugins. Plugins of
+    // the previous load stay loaded while routers or requests still hold them.
     void loadPlugins(const std::string& dir){
-        clear();
+        std::unordered_map<std::string, std::shared_ptr<LibInstance>> loaded;
         for (const auto& entry : std::filesystem::directory_iterator(dir)) {
             if (entry.path().extension() != ".cpp") continue;
             try{
                 auto lib = std::make_unique<LibWraper>(entry.path().string());
                 auto lib_ptr = lib.get();
-                loadedPlugins.emplace(
+                IPlugin* instance = lib_ptr->loadAndGetProcedure<IPlugin*()>("create")();
+                loaded.emplace(
                     lib_ptr->getName(),
-                    std::move(LibInstance{
-                        std::move(lib),
-                        lib_ptr->loadAndGetProcedure<IPlugin*()>("create")()
-                        ->setLogger(&_LOGGER_)->setWSM(&_WEBSOCKETS_)
-                    }));
+                    std::make_shared<LibInstance>(std::move(lib), instance->setLogger(&_LOGGER_)->setWSM(&_WEBSOCKETS_)));
                 _LOGGER_.log("Loaded plugin: " + lib_ptr->getName());
             } catch(const std::exception& e){
                 _LOGGER_.error("Failed to load " + entry.path().string() + ": " + e.what());
             }
         }
+        loadedPlugins = std::move(loaded);
+    }
+    struct PluginRoute {
+        std::shared_ptr<IPlugin> plugin;
+        std::string route;
+        std::uint32_t metrics_id;
+    };
+    using PluginRouter = RadixRouter<PluginRoute>;
+    // The live router, swapped atomically on reload. A request's handler holds the router
+    // it was matched on (its path parameters point at the router's names), which holds
+    // the plugins; a replaced router, and the plugins only it used, are freed once the
+    // last request matched on it is done.
+    std::shared_ptr<const PluginRouter> router = std::make_shared<const PluginRouter>();
+
+    std::shared_ptr<const PluginRouter> currentRouter() {
+        return std::atomic_load(&router);
+    }
+
+    // Builds the router from the plugins currently in loadedPlugins. Call it after
+    // loadPlugins() and after the custom default handler has been taken out.
+    void buildRouter(){
+        auto built = std::make_unique<PluginRouter>();
+        for (auto& [name, plugin] : loadedPlugins) {
+            std::vector<std::string> routes = plugin->instance->routes();
+            if (routes.empty()) {
+                routes = {"/" + name, "/" + name + "/*"};
+            }
+            for (const std::string& route : routes) {
+                std::size_t space = route.find(' ');
+                std::string method = space == std::string::npos ? "" : route.substr(0, space);
+                std::string pattern = space == std::string::npos ? route : route.substr(space + 1);
+                try {
+                    std::uint32_t id = _METRICS_.routeId(route);
+                    built->insert(method, pattern, PluginRoute{pin(plugin), route, id});
+                    _ADMISSION_.bindRoute(route, id);
+                    _DEADLINES_.bindRoute(route, id);
+                } catch (const std::exception& e) {
+                    _LOGGER_.error("Invalid route \"" + route + "\" in plugin " + name + ": " + e.what());
+                }
+            }
+        }
+        std::atomic_store(&router, std::shared_ptr<const PluginRouter>(std::move(built)));
     }
+
     std::shared_ptr<IPlugin> getPlugin(const std::string& pluginName) {
         auto it = loadedPlugins.find(pluginName);
         if (it != loadedPlugins.end()) {
-            return it->second.instance;
+            return pin(it->second);
         }
         return nullptr;
     }
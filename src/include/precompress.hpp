@@ -0,0 +1,173 @@
+#pragma once
+#include <mime_type.h>
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "compression.hpp"
+#include "plugin.hpp"
+#include "public_index.hpp"
+
+// Writes .gz and .br siblings at the highest levels for the compressible files in
+// ./public, on a background thread, so the default handler serves them without
+// compressing per request. The whole tree is scanned at start; the ./public watcher
+// queues files again as they change. A sibling gets its source's mtime, so one that
+// is older than the file (edited since, or written by hand) is ignored until redone.
+class Precompressor {
+   public:
+    ~Precompressor() {
+        stop();
+    }
+
+    void start(const std::filesystem::path& root, std::size_t min_bytes) {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            queue_.clear();
+            queue_.push_back(root);
+            min_bytes_ = min_bytes;
+            running_ = true;
+        }
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // A file or directory to (re)compress; ignored when stopped.
+    void enqueue(const std::filesystem::path& path) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!running_) return;
+            queue_.push_back(path);
+        }
+        cv_.notify_one();
+    }
+
+   private:
+    static constexpr int gzip_level = 9;
+    static constexpr int brotli_quality = 11;
+
+    void run() {
+        std::size_t written = 0;
+        while (true) {
+            std::filesystem::path path;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this]() { return !running_ || !queue_.empty(); });
+                if (!running_) return;
+                path = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            std::error_code ec;
+            if (std::filesystem::is_directory(path, ec)) {
+                for (auto it = std::filesystem::recursive_directory_iterator(path, std::filesystem::directory_options::skip_permission_denied, ec);
+                     !ec && it != std::filesystem::recursive_directory_iterator() && running(); it.increment(ec)) {
+                    written += process(it->path());
+                }
+            } else {
+                written += process(path);
+            }
+            if (written > 0 && idle()) {
+                _LOGGER_.log("Precompressed " + std::to_string(written) + " files in ./public");
+                written = 0;
+            }
+        }
+    }
+
+    bool running() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return running_;
+    }
+
+    bool idle() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return queue_.empty();
+    }
+
+    // Number of siblings written for `path`.
+    std::size_t process(const std::filesystem::path& path) {
+        if (is_precompressed(path) || path.extension() == ".tmp") return 0;
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) return 0;
+        const char* mime = MimeTypes::getType(path.extension().string().c_str());
+        if (!mime || !Compression::compressible(mime)) return 0;
+        std::uintmax_t size = std::filesystem::file_size(path, ec);
+        if (ec || size < min_bytes_) return 0;
+        auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) return 0;
+        bool gzip = stale(path, ".gz", mtime);
+        bool brotli = Compression::brotliAvailable() && stale(path, ".br", mtime);
+        if (!gzip && !brotli) return 0;
+
+        std::ifstream stream(path, std::ios::in | std::ios::binary);
+        if (!stream.is_open()) return 0;
+        std::string data(static_cast<std::size_t>(size), '\0');
+        if (!stream.read(data.data(), static_cast<std::streamsize>(size))) return 0;
+
+        std::size_t written = 0;
+        std::string out;
+        if (gzip && Compression::encodeZlib(data, Compression::Gzip, gzip_level, out)) {
+            written += write(path, ".gz", out, size, mtime);
+        }
+        if (brotli && Compression::encodeBrotli(data, brotli_quality, out)) {
+            written += write(path, ".br", out, size, mtime);
+        }
+        return written;
+    }
+
+    static bool stale(const std::filesystem::path& path, const char* suffix, std::filesystem::file_time_type mtime) {
+        std::filesystem::path sibling = path;
+        sibling += suffix;
+        std::error_code ec;
+        auto sibling_mtime = std::filesystem::last_write_time(sibling, ec);
+        return ec || sibling_mtime < mtime;
+    }
+
+    // Written to a temporary file and renamed over the sibling, so a request never sees
+    // a partial one. Skipped when compression does not make the file smaller.
+    static std::size_t write(const std::filesystem::path& path, const char* suffix, const std::string& out,
+                             std::uintmax_t size, std::filesystem::file_time_type mtime) {
+        if (out.size() >= size) return 0;
+        std::filesystem::path sibling = path;
+        sibling += suffix;
+        std::filesystem::path tmp = sibling;
+        tmp += ".tmp";
+        {
+            std::ofstream stream(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!stream.write(out.data(), static_cast<std::streamsize>(out.size()))) {
+                _LOGGER_.warning("Failed to write " + tmp.string());
+                return 0;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::last_write_time(tmp, mtime, ec);
+        if (!ec) std::filesystem::rename(tmp, sibling, ec);
+        if (ec) {
+            _LOGGER_.warning("Failed to write " + sibling.string() + ": " + ec.message());
+            std::filesystem::remove(tmp, ec);
+            return 0;
+        }
+        return 1;
+    }
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::filesystem::path> queue_;
+    std::size_t min_bytes_ = 0;
+    bool running_ = false;
+    std::thread thread_;
+};
+
+Precompressor _PRECOMPRESSOR_;
@@ -0,0 +1,329 @@
+#pragma once
+#include <mime_type.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "plugin.hpp"
+
+// A static file known to the index. Everything the default handler needs to serve it
+// is resolved once, so route resolution on the request path is a pure memory lookup.
+struct PublicFile {
+    std::filesystem::path path;
+    std::string key;
+    const char* mime;
+    std::uintmax_t size;
+    std::filesystem::file_time_type mtime;
+    // Precompressed siblings ("app.js.gz", "app.js.br"), served instead of the file to
+    // clients that accept them. Only siblings at least as new as the file count.
+    std::shared_ptr<const PublicFile> gzip;
+    std::shared_ptr<const PublicFile> brotli;
+};
+
+inline bool is_precompressed(const std::filesystem::path& path) {
+    auto extension = path.extension();
+    return extension == ".gz" || extension == ".br";
+}
+
+inline std::shared_ptr<const PublicFile> find_variant(const PublicFile& file, const char* suffix) {
+    std::error_code ec;
+    std::filesystem::path path = file.path;
+    path += suffix;
+    if (!std::filesystem::is_regular_file(path, ec)) return nullptr;
+    // A sibling symlinked elsewhere is not a variant of this file.
+    if (std::filesystem::canonical(path, ec).parent_path() != file.path.parent_path() || ec) return nullptr;
+    auto variant = std::make_shared<PublicFile>();
+    variant->path = path;
+    variant->key = path.string();
+    variant->mime = file.mime;
+    variant->size = std::filesystem::file_size(path, ec);
+    if (ec) return nullptr;
+    variant->mtime = std::filesystem::last_write_time(path, ec);
+    if (ec || variant->mtime < file.mtime) return nullptr;
+    return variant;
+}
+
+inline void find_variants(PublicFile& file) {
+    if (is_precompressed(file.path)) return;
+    file.gzip = find_variant(file, ".gz");
+    file.brotli = find_variant(file, ".br");
+}
+
+// In-memory map of ./public from URL path ("/css/style.css") to PublicFile, built at
+// startup. On Linux an inotify thread applies changes incrementally; elsewhere the
+// index is rebuilt by the reload command. Files whose real path leaves the public
+// root (e.g. symlinks pointing outside) are never indexed.
+// Built with index_files = false it only tracks the generation of the tree, which is
+// all the on-disk lookup path needs to invalidate its negative cache.
+class PublicIndex {
+   public:
+    ~PublicIndex() {
+        stopWatching();
+    }
+
+    void build(const std::string& root, bool index_files = true) {
+        std::error_code ec;
+        std::filesystem::path canonical_root = std::filesystem::canonical(root, ec);
+        std::unordered_map<std::string, std::shared_ptr<const PublicFile>, string_hash, std::equal_to<>> files;
+        if (!ec && index_files) {
+            for (auto it = std::filesystem::recursive_directory_iterator(canonical_root, std::filesystem::directory_options::skip_permission_denied, ec);
+                 !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                if (auto file = make_file(canonical_root, it->path())) {
+                    files[url_of(canonical_root, it->path())] = std::move(file);
+                }
+            }
+        }
+        std::size_t count = files.size();
+        {
+            std::unique_lock<std::shared_mutex> lock(mtx_);
+            root_ = canonical_root;
+            files_ = std::move(files);
+            index_files_ = index_files;
+        }
+        generation_.fetch_add(1, std::memory_order_release);
+        if (index_files) _LOGGER_.log("Indexed " + std::to_string(count) + " files in " + root);
+    }
+
+    std::shared_ptr<const PublicFile> find(std::string_view url) const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        auto it = files_.find(url);
+        return it == files_.end() ? nullptr : it->second;
+    }
+
+    // Resolves a request path the way the default handler always has: "/" and
+    // directories map to their index.html, and with html routing the first path
+    // prefix that names an .html file wins (/blog/post -> /blog.html).
+    std::shared_ptr<const PublicFile> resolve(std::string_view uri, bool html_routing) const {
+        uri = uri.substr(0, uri.find_first_of("?#"));
+        if (uri.empty() || uri == "/") return find("/index.html");
+
+        std::string candidate;
+        candidate.reserve(uri.size() + 11);
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        if (html_routing) {
+            std::size_t current_slash = 0;
+            while (current_slash < uri.size()) {
+                std::size_t next_slash = uri.find('/', current_slash + 1);
+                if (next_slash == std::string_view::npos) next_slash = uri.size();
+                candidate.assign(uri.substr(0, next_slash)).append(".html");
+                if (auto it = files_.find(candidate); it != files_.end()) return it->second;
+                current_slash = next_slash;
+            }
+        }
+        if (auto it = files_.find(uri); it != files_.end()) return it->second;
+        candidate.assign(uri);
+        if (candidate.back() != '/') candidate.push_back('/');
+        candidate.append("index.html");
+        if (auto it = files_.find(candidate); it != files_.end()) return it->second;
+        return nullptr;
+    }
+
+    // Bumped on every change, so derived caches can tell their entries are stale.
+    std::uint64_t generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    std::size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        return files_.size();
+    }
+
+    // Called from the watcher with every regular file that was written or moved in.
+    // Set before watch().
+    void onFileChanged(std::function<void(const std::filesystem::path&)> callback) {
+        on_file_changed_ = std::move(callback);
+    }
+
+#ifdef __linux__
+    void watch() {
+        stopWatching();
+        inotify_fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (inotify_fd_ < 0) {
+            _LOGGER_.warning("inotify unavailable, ./public changes need the reload command.");
+            return;
+        }
+        std::filesystem::path root;
+        {
+            std::shared_lock<std::shared_mutex> lock(mtx_);
+            root = root_;
+        }
+        add_watches(root);
+        watching_ = true;
+        watcher_ = std::thread([this]() { watch_loop(); });
+    }
+    void stopWatching() {
+        if (!watching_) return;
+        watching_ = false;
+        if (watcher_.joinable()) watcher_.join();
+        ::close(inotify_fd_);
+        inotify_fd_ = -1;
+        watch_dirs_.clear();
+    }
+#else
+    void watch() {
+        _LOGGER_.log("./public is not watched on this platform, use the reload command after changing files.");
+    }
+    void stopWatching() {}
+#endif
+
+   private:
+    struct string_hash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>()(s);
+        }
+    };
+
+    static std::string url_of(const std::filesystem::path& root, const std::filesystem::path& path) {
+        return "/" + std::filesystem::relative(path, root).generic_string();
+    }
+
+    static std::shared_ptr<const PublicFile> make_file(const std::filesystem::path& root, const std::filesystem::path& path) {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) return nullptr;
+        std::filesystem::path real = std::filesystem::canonical(path, ec);
+        if (ec) return nullptr;
+        auto mismatch = std::mismatch(root.begin(), root.end(), real.begin(), real.end());
+        if (mismatch.first != root.end()) return nullptr;
+
+        auto file = std::make_shared<PublicFile>();
+        file->path = real;
+        file->key = real.string();
+        file->mime = MimeTypes::getType(real.extension().string().c_str());
+        if (!file->mime) file->mime = "application/octet-stream";
+        file->size = std::filesystem::file_size(real, ec);
+        if (ec) return nullptr;
+        file->mtime = std::filesystem::last_write_time(real, ec);
+        if (ec) return nullptr;
+        find_variants(*file);
+        return file;
+    }
+
+    void refresh(const std::filesystem::path& path) {
+        std::filesystem::path root;
+        bool index_files;
+        {
+            std::shared_lock<std::shared_mutex> lock(mtx_);
+            root = root_;
+            index_files = index_files_;
+        }
+        std::string url = url_of(root, path);
+        std::error_code ec;
+        if (!index_files) {
+#ifdef __linux__
+            if (std::filesystem::is_directory(path, ec)) add_watches(path);
+#endif
+            if (on_file_changed_ && std::filesystem::is_regular_file(path, ec)) on_file_changed_(path);
+        } else if (std::filesystem::is_directory(path, ec)) {
+            // A directory appeared (or was moved in): index and watch its whole subtree.
+#ifdef __linux__
+            add_watches(path);
+#endif
+            for (auto it = std::filesystem::recursive_directory_iterator(path, std::filesystem::directory_options::skip_permission_denied, ec);
+                 !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                auto file = make_file(root, it->path());
+                std::unique_lock<std::shared_mutex> lock(mtx_);
+                if (file) files_[url_of(root, it->path())] = std::move(file);
+            }
+        } else {
+            auto file = make_file(root, path);
+            // A precompressed sibling came, went or changed: the file it belongs to picks it up.
+            std::string base_url;
+            std::shared_ptr<const PublicFile> base;
+            if (is_precompressed(path)) {
+                base_url = url.substr(0, url.size() - path.extension().string().size());
+                base = make_file(root, path.parent_path() / path.stem());
+            }
+            std::unique_lock<std::shared_mutex> lock(mtx_);
+            if (base && files_.count(base_url)) files_[base_url] = std::move(base);
+            if (file) {
+                files_[url] = std::move(file);
+                lock.unlock();
+                if (on_file_changed_) on_file_changed_(path);
+            } else {
+                // Gone, or a directory that was removed/moved away: drop it and its subtree.
+                files_.erase(url);
+                std::string prefix = url + "/";
+                for (auto it = files_.begin(); it != files_.end();) {
+                    if (it->first.compare(0, prefix.size(), prefix) == 0)
+                        it = files_.erase(it);
+                    else
+                        ++it;
+                }
+            }
+        }
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+#ifdef __linux__
+    void add_watches(const std::filesystem::path& dir) {
+        const uint32_t mask = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+        std::error_code ec;
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(), mask);
+        if (wd >= 0) watch_dirs_[wd] = dir;
+        for (auto it = std::filesystem::recursive_directory_iterator(dir, std::filesystem::directory_options::skip_permission_denied, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec)) {
+                int sub = inotify_add_watch(inotify_fd_, it->path().c_str(), mask);
+                if (sub >= 0) watch_dirs_[sub] = it->path();
+            }
+        }
+    }
+
+    void watch_loop() {
+        alignas(struct inotify_event) char buffer[16384];
+        while (watching_) {
+            // Short poll timeout so stopWatching() never waits long for the thread.
+            struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 250) <= 0) continue;
+            ssize_t len = ::read(inotify_fd_, buffer, sizeof(buffer));
+            if (len <= 0) {
+                if (len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                break;
+            }
+            for (char* p = buffer; p < buffer + len;) {
+                auto* event = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (!watching_) break;
+                auto dir = watch_dirs_.find(event->wd);
+                if (dir == watch_dirs_.end()) continue;
+                if (event->mask & IN_IGNORED) {
+                    watch_dirs_.erase(dir);
+                    continue;
+                }
+                if (event->len == 0) continue;
+                refresh(dir->second / event->name);
+            }
+        }
+    }
+
+    int inotify_fd_ = -1;
+    std::atomic<bool> watching_{false};
+    std::thread watcher_;
+    std::unordered_map<int, std::filesystem::path> watch_dirs_;
+#endif
+
+    std::function<void(const std::filesystem::path&)> on_file_changed_;
+    mutable std::shared_mutex mtx_;
+    std::filesystem::path root_;
+    bool index_files_ = true;
+    std::unordered_map<std::string, std::shared_ptr<const PublicFile>, string_hash, std::equal_to<>> files_;
+    std::atomic<std::uint64_t> generation_{0};
+};
+
+PublicIndex _PUBLIC_INDEX_;
@@ -1,12 +1,106 @@
 #ifndef REQUEST_HPP
 #define REQUEST_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 
+#include "file_body.hpp"
+
+// Shared between the server and the handler of one request. The server sets `reason`
+// once the request's deadline passes or its client goes away; by then it has already
+// answered (504) or dropped the connection, so the handler's result is discarded.
+struct RequestCancellation {
+    enum Reason : std::uint8_t { None = 0, Timeout, Disconnected };
+    std::atomic<std::uint8_t> reason{None};
+    // steady_clock time in nanoseconds, 0 = no deadline.
+    std::int64_t deadline_ns = 0;
+
+    static std::int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+// Strong entity tags for conditional requests: a 64-bit FNV-1a hash of the exact bytes
+// sent, so the tag changes with the content and differs between encodings of it.
+struct ContentHash {
+    std::uint64_t value = 0xcbf29ce484222325ull;
+
+    void update(std::string_view data) {
+        for (unsigned char c : data) {
+            value ^= c;
+            value *= 0x100000001b3ull;
+        }
+    }
+
+    // Quoted, e.g. "9f2c54e0a1b3d877".
+    std::string etag() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string tag(18, '"');
+        for (int i = 0; i < 16; i++) tag[1 + i] = digits[(value >> (60 - 4 * i)) & 0xf];
+        return tag;
+    }
+
+    static std::string etag(std::string_view content) {
+        ContentHash hash;
+        hash.update(content);
+        return hash.etag();
+    }
+};
+
+// HTTP dates (IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT") for Last-Modified and
+// If-Modified-Since. Formatted and parsed by hand, independent of the C locale.
+struct HttpDate {
+    static std::string format(std::time_t time) {
+        static const char* days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+        static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        std::tm tm{};
+        gmtime_r(&time, &tm);
+        char out[32];
+        std::snprintf(out, sizeof(out), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+                      months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        return out;
+    }
+
+    // Other (obsolete) date formats are rejected.
+    static bool parse(std::string_view date, std::time_t& out) {
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if (date.size() != 29 || date[3] != ',' || date.substr(25) != " GMT") return false;
+        auto number = [&](std::size_t pos, std::size_t len, int& value) {
+            auto [end, ec] = std::from_chars(date.data() + pos, date.data() + pos + len, value);
+            return ec == std::errc() && end == date.data() + pos + len;
+        };
+        int day, year, hour, minute, second;
+        if (!number(5, 2, day) || !number(12, 4, year) || !number(17, 2, hour) || !number(20, 2, minute) || !number(23, 2, second)) return false;
+        const char* month_pos = std::strstr(months, std::string(date.substr(8, 3)).c_str());
+        if (!month_pos || (month_pos - months) % 3 != 0) return false;
+        int month = static_cast<int>(month_pos - months) / 3 + 1;
+        // Days since 1970-01-01 in the proleptic Gregorian calendar.
+        int y = year - (month <= 2);
+        int era = (y >= 0 ? y : y - 399) / 400;
+        int yoe = y - era * 400;
+        int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        long long days = static_cast<long long>(era) * 146097 + doe - 719468;
+        out = static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+        return true;
+    }
+};
+
 class Request {
    public:
     std::string method;
@@ -15,33 +109,92 @@ class Request {
     std::unordered_map<std::string, std::string> headers;
     std::string body;
 
-    static Request parse(const std::string& raw_request) {
-        Request req;
-        std::istringstream stream(raw_request);
-        std::string line;
-
-        std::getline(stream, line);
-        std::istringstream req_line(line);
-        req_line >> req.method >> req.uri >> req.http_version;
-
-        while (std::getline(stream, line) && line != "\r") {
-            auto colon_pos = line.find(':');
-            if (colon_pos != std::string::npos) {
-                std::string key = line.substr(0, colon_pos);
-                std::string value = line.substr(colon_pos + 1);
-
-                key.erase(key.find_last_not_of(" \r\n") + 1);
-                value.erase(0, value.find_first_not_of(" "));
-                value.erase(value.find_last_not_of(" \r\n") + 1);
-                req.headers[key] = value;
-            }
+    // Route parameters captured by the router, stored as offsets into `uri` so they
+    // survive the request being moved (e.g. to the worker pool).
+    struct PathParam {
+        std::string_view name;
+        std::uint32_t offset = 0;
+        std::uint32_t length = 0;
+    };
+    static constexpr std::size_t max_path_params = 8;
+    std::array<PathParam, max_path_params> path_params{};
+    std::size_t path_param_count = 0;
+
+    // Value of the ":name" route parameter ("*" for a wildcard's rest), empty if absent.
+    std::string_view param(std::string_view name) const {
+        for (std::size_t i = 0; i < path_param_count; i++) {
+            if (path_params[i].name == name) return std::string_view(uri).substr(path_params[i].offset, path_params[i].length);
         }
+        return {};
+    }
+    std::string_view path() const {
+        return std::string_view(uri).substr(0, uri.find('?'));
+    }
+    std::string_view query() const {
+        std::size_t q = uri.find('?');
+        return q == std::string::npos ? std::string_view() : std::string_view(uri).substr(q + 1);
+    }
 
-        std::ostringstream body_stream;
-        body_stream << stream.rdbuf();
-        req.body = body_stream.str();
+    // Set by the server for requests with a deadline and for handlers running off the
+    // connection's thread. Long-running handlers can poll cancelled() and return early.
+    std::shared_ptr<RequestCancellation> cancellation;
 
-        return req;
+    bool cancelled() const {
+        if (!cancellation) return false;
+        if (cancellation->reason.load(std::memory_order_relaxed) != RequestCancellation::None) return true;
+        return cancellation->deadline_ns != 0 && RequestCancellation::now_ns() >= cancellation->deadline_ns;
+    }
+    // Milliseconds until the deadline, -1 without one.
+    long remainingMs() const {
+        if (!cancellation || cancellation->deadline_ns == 0) return -1;
+        std::int64_t left = cancellation->deadline_ns - RequestCancellation::now_ns();
+        return left > 0 ? static_cast<long>(left / 1000000) : 0;
+    }
+
+    static Request parse(const std::string& raw_request);
+
+    // Case-insensitive header lookup, nullptr when the header is absent.
+    const std::string* header(std::string_view name) const;
+
+    // Conditional GET: true when the client's cached copy is still current, so a 304
+    // can be sent instead of the body. If-None-Match is checked against `etag` and,
+    // only when absent, If-Modified-Since against `last_modified` (an HTTP date).
+    bool notModified(std::string_view etag, std::string_view last_modified = {}) const {
+        if (method != "GET" && method != "HEAD") return false;
+        if (const std::string* if_none_match = header("If-None-Match")) {
+            return !etag.empty() && etagListed(*if_none_match, etag);
+        }
+        const std::string* if_modified_since = header("If-Modified-Since");
+        std::time_t since, modified;
+        if (!if_modified_since || last_modified.empty()) return false;
+        return HttpDate::parse(*if_modified_since, since) && HttpDate::parse(last_modified, modified) && modified <= since;
+    }
+
+    // Weak comparison, as If-None-Match asks for. A tag the compression stage derived
+    // from `etag` ("tag-gzip") stands for the same content and matches too.
+    static bool etagListed(std::string_view list, std::string_view etag) {
+        auto opaque = [](std::string_view tag) {
+            if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+            return tag;
+        };
+        etag = opaque(etag);
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t end = list.find(',', pos);
+            if (end == std::string_view::npos) end = list.size();
+            std::string_view tag = list.substr(pos, end - pos);
+            pos = end + 1;
+            tag.remove_prefix(std::min(tag.find_first_not_of(" \t"), tag.size()));
+            tag = tag.substr(0, tag.find_last_not_of(" \t") + 1);
+            if (tag == "*") return true;
+            tag = opaque(tag);
+            if (tag == etag) return true;
+            if (etag.size() >= 2 && tag.size() > etag.size() && tag.substr(0, etag.size() - 1) == etag.substr(0, etag.size() - 1)) {
+                std::string_view suffix = tag.substr(etag.size() - 1);
+                if (suffix == "-gzip\"" || suffix == "-br\"" || suffix == "-deflate\"") return true;
+            }
+        }
+        return false;
     }
 
     boost::beast::http::request<boost::beast::http::string_body> to_beast() const {
@@ -73,6 +226,192 @@ class Request {
     }
 };
 
+// Single-pass incremental HTTP/1.x request parser.
+// `feed` is called with everything buffered so far for the current request
+// (the view may grow and move between calls); only new bytes are scanned.
+// Positions are kept as offsets so the underlying buffer is free to reallocate.
+class RequestParser {
+   public:
+    enum class Status { Incomplete, Complete, Bad };
+
+    static constexpr std::size_t max_header_bytes = 65536;
+
+    // Largest request body accepted (MAX_BODY_BYTES), shared by every connection.
+    static std::size_t maxBodyBytes() {
+        return max_body_bytes_.load(std::memory_order_relaxed);
+    }
+    static void setMaxBodyBytes(std::size_t bytes) {
+        max_body_bytes_.store(bytes, std::memory_order_relaxed);
+    }
+
+    // Status to answer a Bad request with: 400, 413 for a body over the limit, or 501
+    // for a Transfer-Encoding, since chunked bodies are not decoded.
+    int errorStatus() const {
+        return error_status_;
+    }
+
+    Status feed(std::string_view data) {
+        while (!headers_done_) {
+            // memchr is vectorized by the C library, so this is the hot CRLF scan.
+            const void* nl = data.size() > scan_ ? std::memchr(data.data() + scan_, '\n', data.size() - scan_) : nullptr;
+            if (!nl) {
+                scan_ = data.size();
+                return scan_ > max_header_bytes ? Status::Bad : Status::Incomplete;
+            }
+            std::size_t nl_pos = static_cast<const char*>(nl) - data.data();
+            std::size_t line_end = nl_pos;
+            if (line_end > line_start_ && data[line_end - 1] == '\r') line_end--;
+            std::size_t line_off = line_start_;
+            std::string_view line = data.substr(line_off, line_end - line_off);
+            scan_ = line_start_ = nl_pos + 1;
+
+            if (!request_line_done_) {
+                if (line.empty()) continue;  // tolerate leading CRLFs between requests
+                if (!parse_request_line(line, line_off)) return Status::Bad;
+                request_line_done_ = true;
+            } else if (line.empty()) {
+                headers_done_ = true;
+                header_size_ = scan_;
+            } else if (!parse_header_line(line, line_off)) {
+                return Status::Bad;
+            }
+            if (scan_ > max_header_bytes) return Status::Bad;
+        }
+        return data.size() >= messageSize() ? Status::Complete : Status::Incomplete;
+    }
+
+    // Size of the complete message (headers + body); valid once the headers are parsed.
+    std::size_t messageSize() const {
+        return header_size_ + content_length_;
+    }
+
+    Request build(std::string_view data) const {
+        Request req;
+        req.method.assign(method_.in(data));
+        req.uri.assign(uri_.in(data));
+        req.http_version.assign(version_.in(data));
+        req.headers.reserve(headers_.size());
+        for (const auto& [key, value] : headers_) {
+            req.headers.insert_or_assign(std::string(key.in(data)), std::string(value.in(data)));
+        }
+        std::size_t body_start = headers_done_ ? header_size_ : data.size();
+        if (body_start < data.size()) {
+            req.body.assign(data.substr(body_start, std::min(content_length_, data.size() - body_start)));
+        }
+        return req;
+    }
+
+    void reset() {
+        *this = RequestParser();
+    }
+
+    static bool iequals(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) return false;
+        for (std::size_t i = 0; i < a.size(); i++) {
+            char x = a[i];
+            char y = b[i];
+            if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+            if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+            if (x != y) return false;
+        }
+        return true;
+    }
+
+   private:
+    struct Span {
+        std::uint32_t off = 0;
+        std::uint32_t len = 0;
+        std::string_view in(std::string_view data) const {
+            return data.substr(off, len);
+        }
+    };
+
+    bool parse_request_line(std::string_view line, std::size_t off) {
+        std::size_t sp1 = line.find(' ');
+        if (sp1 == std::string_view::npos || sp1 == 0) return false;
+        std::size_t uri_start = line.find_first_not_of(' ', sp1);
+        if (uri_start == std::string_view::npos) return false;
+        std::size_t sp2 = line.find(' ', uri_start);
+        std::size_t uri_end = sp2 == std::string_view::npos ? line.size() : sp2;
+        std::size_t ver_start = sp2 == std::string_view::npos ? line.size() : line.find_first_not_of(' ', sp2);
+        if (ver_start == std::string_view::npos) ver_start = line.size();
+        std::size_t ver_end = line.find(' ', ver_start);
+        if (ver_end == std::string_view::npos) ver_end = line.size();
+
+        method_ = {static_cast<std::uint32_t>(off), static_cast<std::uint32_t>(sp1)};
+        uri_ = {static_cast<std::uint32_t>(off + uri_start), static_cast<std::uint32_t>(uri_end - uri_start)};
+        version_ = {static_cast<std::uint32_t>(off + ver_start), static_cast<std::uint32_t>(ver_end - ver_start)};
+        return true;
+    }
+
+    bool parse_header_line(std::string_view line, std::size_t off) {
+        std::size_t colon = line.find(':');
+        if (colon == std::string_view::npos) return true;  // ignored, as before
+
+        // No whitespace between field name and colon (RFC 7230 3.2.4): an intermediary
+        // could read "Content-Length :" as another header and frame the body differently.
+        std::size_t key_end = colon;
+        if (key_end > 0 && (line[key_end - 1] == ' ' || line[key_end - 1] == '\t')) return false;
+        std::size_t value_start = colon + 1;
+        while (value_start < line.size() && (line[value_start] == ' ' || line[value_start] == '\t')) value_start++;
+        std::size_t value_end = line.size();
+        while (value_end > value_start && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) value_end--;
+
+        std::string_view key = line.substr(0, key_end);
+        std::string_view value = line.substr(value_start, value_end - value_start);
+        if (iequals(key, "content-length")) {
+            std::size_t length = 0;
+            auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), length);
+            if (ec != std::errc() || ptr != value.data() + value.size()) return false;
+            // Repeated lengths must agree, or the message boundary is ambiguous.
+            if (has_content_length_ && length != content_length_) return false;
+            if (length > maxBodyBytes()) {
+                error_status_ = 413;
+                return false;
+            }
+            has_content_length_ = true;
+            content_length_ = length;
+        } else if (iequals(key, "transfer-encoding")) {
+            error_status_ = 501;
+            return false;
+        }
+        headers_.push_back({{static_cast<std::uint32_t>(off), static_cast<std::uint32_t>(key_end)},
+                            {static_cast<std::uint32_t>(off + value_start), static_cast<std::uint32_t>(value.size())}});
+        return true;
+    }
+
+    std::size_t scan_ = 0;
+    std::size_t line_start_ = 0;
+    bool request_line_done_ = false;
+    bool headers_done_ = false;
+    std::size_t header_size_ = 0;
+    std::size_t content_length_ = 0;
+    bool has_content_length_ = false;
+    int error_status_ = 400;
+    static inline std::atomic<std::size_t> max_body_bytes_{10 * 1024 * 1024};
+    Span method_;
+    Span uri_;
+    Span version_;
+    std::vector<std::pair<Span, Span>> headers_;
+};
+
+inline Request Request::parse(const std::string& raw_request) {
+    RequestParser parser;
+    parser.feed(raw_request);
+    return parser.build(raw_request);
+}
+
+inline const std::string* Request::header(std::string_view name) const {
+    auto it = headers.find(std::string(name));
+    if (it != headers.end()) return &it->second;
+    for (const auto& [key, value] : headers) {
+        if (RequestParser::iequals(key, name)) return &value;
+    }
+    return nullptr;
+}
+
+struct SerializedResponse;
+
 class Response {
    public:
     Response(int statusCode = 200, const std::string& statusMessage = "OK")
@@ -141,30 +480,123 @@ class Response {
         setHeader("Keep-Alive", value);
     }
 
+    const std::string* getHeader(const std::string& name) const {
+        auto it = headers_.find(name);
+        return it == headers_.end() ? nullptr : &it->second;
+    }
+    void removeHeader(const std::string& name) {
+        headers_.erase(name);
+    }
+    const std::unordered_map<std::string, std::string>& headers() const {
+        return headers_;
+    }
+
     void setBody(const std::string& body) {
         body_ = body;
+        shared_body_.reset();
         headers_["Content-Length"] = std::to_string(body.size());
     }
 
-    std::string toString() const {
-        std::string headers_str;
+    void setBody(std::string&& body) {
+        headers_["Content-Length"] = std::to_string(body.size());
+        body_ = std::move(body);
+        shared_body_.reset();
+    }
 
-        headers_str += "HTTP/1.1 " + std::to_string(statusCode_) + " " + statusMessage_ + "\r\n";
+    // References an immutable buffer (e.g. a cache entry) instead of copying it;
+    // the buffer stays alive as long as any response still points at it.
+    void setBody(std::shared_ptr<const std::string> body) {
+        headers_["Content-Length"] = std::to_string(body->size());
+        body_.clear();
+        shared_body_ = std::move(body);
+    }
+
+    const std::string& body() const {
+        return shared_body_ ? *shared_body_ : body_;
+    }
 
+    // Makes the response stream `file` instead of an in-memory body.
+    void setFileBody(std::shared_ptr<FileBody> file) {
+        body_.clear();
+        shared_body_.reset();
+        headers_["Content-Length"] = std::to_string(file->size());
+        file_body_ = std::move(file);
+    }
+
+    const std::shared_ptr<FileBody>& fileBody() const {
+        return file_body_;
+    }
+
+    // Makes the response a complete message serialized earlier (see SerializedResponse),
+    // which is written verbatim; status, headers and body set on this object are ignored.
+    void setSerialized(std::shared_ptr<const SerializedResponse> serialized) {
+        serialized_ = std::move(serialized);
+    }
+
+    const std::shared_ptr<const SerializedResponse>& serialized() const {
+        return serialized_;
+    }
+
+    // Appends the status line and header block to `out`, so callers can reuse one
+    // buffer across responses and send the body as a separate buffer without copying it.
+    void serializeHeaders(std::string& out) const {
+        char code[12];
+        auto [code_end, ec] = std::to_chars(code, code + sizeof(code), statusCode_);
+        out.append("HTTP/1.1 ").append(code, code_end).append(" ").append(statusMessage_).append("\r\n");
         for (const auto& [name, value] : headers_) {
-            headers_str += name + ": " + value + "\r\n";
+            out.append(name).append(": ").append(value).append("\r\n");
         }
+        out.append("\r\n");
+    }
 
-        headers_str += "\r\n";
+    std::string toString() const {
+        std::string full_response;
+        full_response.reserve(256 + body().size());
+        serializeHeaders(full_response);
+        full_response.append(body());
+        return full_response;
+    }
 
-        std::string full_response = headers_str;
-        full_response.append(body_);
+    int getStatus() const {
+        return statusCode_;
+    }
 
-        return full_response;
+    // Sets a strong ETag for the body set so far (see ContentHash).
+    void setETagFromBody() {
+        setETag(ContentHash::etag(body()));
+    }
+
+    // Turns a 200 into a header-only 304 when `req` already holds this representation,
+    // judged by the ETag and Last-Modified set on the response. Returns whether it did.
+    //   res.setBody(render());
+    //   res.setETagFromBody();
+    //   res.revalidate(req);
+    bool revalidate(const Request& req) {
+        if (statusCode_ != 200 || serialized_) return false;
+        const std::string* etag = getHeader("ETag");
+        const std::string* last_modified = getHeader("Last-Modified");
+        if (!req.notModified(etag ? *etag : std::string_view(), last_modified ? *last_modified : std::string_view())) return false;
+        setNotModified();
+        return true;
+    }
+
+    // 304 Not Modified: the validators and caching headers stay, the body and the headers
+    // describing it go.
+    void setNotModified() {
+        setStatus(304);
+        for (const char* name : {"Content-Type", "Content-Length", "Content-Encoding"}) headers_.erase(name);
+        body_.clear();
+        shared_body_.reset();
+        file_body_.reset();
+        serialized_.reset();
     }
+
     void clear() {
         headers_.clear();
         body_.clear();
+        shared_body_.reset();
+        file_body_.reset();
+        serialized_.reset();
     }
 
    private:
@@ -184,8 +616,16 @@ class Response {
                 return "Unauthorized";
             case 404:
                 return "Not Found";
+            case 413:
+                return "Payload Too Large";
             case 500:
                 return "Internal Server Error";
+            case 501:
+                return "Not Implemented";
+            case 503:
+                return "Service Unavailable";
+            case 504:
+                return "Gateway Timeout";
             default:
                 return "Unknown";
         }
@@ -195,5 +635,25 @@ class Response {
     std::string statusMessage_;
     std::unordered_map<std::string, std::string> headers_;
     std::string body_;
+    std::shared_ptr<FileBody> file_body_;
+    std::shared_ptr<const std::string> shared_body_;
+    std::shared_ptr<const SerializedResponse> serialized_;
+};
+
+// A complete HTTP/1.1 message built once (e.g. by a cache) and then sent as a single
+// buffer. `head_end` is the offset of the blank line ending the header block, where the
+// session can still splice in a per-connection header such as Connection.
+struct SerializedResponse {
+    std::string message;
+    std::size_t head_end = 0;
+
+    static std::shared_ptr<const SerializedResponse> from(const Response& res) {
+        auto serialized = std::make_shared<SerializedResponse>();
+        serialized->message.reserve(256 + res.body().size());
+        res.serializeHeaders(serialized->message);
+        serialized->head_end = serialized->message.size() - 2;
+        serialized->message.append(res.body());
+        return serialized;
+    }
 };
 #endif
\ No newline at end of file
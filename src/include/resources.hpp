@@ -1,6 +1,58 @@
 #pragma once
 const char* _env =
     R"#(SERVER_PORT=8080
+# Requests with a larger body are answered 413. Chunked request bodies are not supported (501).
+MAX_BODY_BYTES=10485760
+# Threads running heavy plugins and websocket callbacks (0 = one per core).
+# WORKER_POOL=steal gives each worker its own queue and lets idle workers take tasks from busy ones. Needs a restart.
+WORKER_THREADS=0
+WORKER_POOL=shared
+
+# Cleartext HTTP/2, by prior knowledge or "Upgrade: h2c". Streams per connection and idle seconds before GOAWAY.
+HTTP2=true
+HTTP2_MAX_STREAMS=100
+HTTP2_IDLE_TIMEOUT=60
+
+# Compress text, JSON, JS, XML and SVG responses of at least COMPRESSION_MIN_BYTES with br, gzip or deflate,
+# as the client accepts. COMPRESSION_LEVEL is the gzip/deflate level (1-9), BROTLI_QUALITY the brotli one (0-11).
+# Bodies from COMPRESSION_OFFLOAD_KB up are compressed on the worker pool instead of an IO thread.
+COMPRESSION=true
+COMPRESSION_MIN_BYTES=1024
+COMPRESSION_LEVEL=6
+BROTLI_QUALITY=5
+COMPRESSION_OFFLOAD_KB=64
+
+# TLS on SERVER_PORT. Without TLS_CERT and TLS_KEY a self-signed localhost certificate is written there.
+# TLS_SESSION_CACHE sessions are kept for resumption by id (0 = off); KTLS hands encryption to the kernel
+# after the handshake where supported, so static files still go out with sendfile. Needs a restart.
+TLS=false
+TLS_CERT=./tls/cert.pem
+TLS_KEY=./tls/key.pem
+TLS_SESSION_CACHE=20480
+TLS_SESSION_TICKETS=true
+KTLS=true
+
+# Load shedding (0 = unlimited). Over a limit requests get a 503 with Retry-After and the connection is closed.
+# MAX_SESSIONS caps open connections; OVERLOAD_ACCEPT=pause stops accepting at the cap instead of answering 503.
+MAX_SESSIONS=0
+MAX_INFLIGHT=0
+MAX_HEAVY_QUEUE=0
+# Heavy requests queued or running per route, e.g. HEAVY_ROUTE_LIMITS=GET /slow/:ms=4|/api/*=20
+HEAVY_ROUTE_LIMITS=
+OVERLOAD_ACCEPT=reject
+RETRY_AFTER=1
+
+# Handler deadlines in milliseconds (0 = none). Past its deadline a request gets a 504 and its connection is closed;
+# handlers can check request.cancelled() to stop early. Per route, e.g. ROUTE_TIMEOUTS=GET /report/:id=30000|/api/*=500
+HANDLER_TIMEOUT_MS=0
+ROUTE_TIMEOUTS=
+
+# Plugins that are not isHeavy() move to the worker pool while the p95 of their handler time over the last
+# ADAPTIVE_WINDOW requests is above HEAVY_P95_US, and back once it drops below LIGHT_P95_US (microseconds).
+ADAPTIVE_HEAVY=true
+HEAVY_P95_US=2000
+LIGHT_P95_US=500
+ADAPTIVE_WINDOW=200
 
 #<SETTINGS RELATED TO THE DEFAULT HANDLER>
 # If true, the app will use the default request handler. Otherwise, it will generate a new .cpp file with a function that you need to complete as needed. 
@@ -10,11 +62,38 @@ HTML_ROUTING=true
 # Caches the most used static files (default 64 MB).
 CACHE=true
 CACHE_SIZE_KB=65356
+# The cache is split into CACHE_SHARDS independently locked parts, each with CACHE_SIZE_KB / CACHE_SHARDS of it.
+# A file larger than one part (4 MB by default) is never cached and is read from disk on every request.
+CACHE_SHARDS=16
+# ./public/app.js.gz and app.js.br are sent instead of app.js to clients that accept them. If true, they are written
+# in the background (max levels) for compressible files of at least COMPRESSION_MIN_BYTES, and redone when a file changes.
+PRECOMPRESS=false
+# Static files are sent with Last-Modified and a strong ETag (a hash of the content, or of inode, size and mtime for
+# files streamed from disk; kept for up to ETAG_CACHE_SIZE files), and conditional requests for unchanged files get a 304.
+# 0 = no ETags.
+ETAG_CACHE_SIZE=10000
 #</SETTINGS RELATED TO THE DEFAULT HANDLER>
 
 #If DEFAULT_REQUEST_HANDLER=false, then program will look for a handler from ./app/handlers/. E.g. CUSTOM_DEFAULT_HANDLER=my_handler -> ./app/handlers/my_handler.cpp
 CUSTOM_DEFAULT_HANDLER=none
 
+# Logging: debug, info, warning, error or off. Per-request lines are logged at debug level.
+LOG_LEVEL=info
+# Keep about one in N debug messages (1 keeps all).
+LOG_SAMPLE_RATE=1
+# Messages each thread can queue before new ones are dropped.
+LOG_BUFFER_SIZE=4096
+# Prometheus metrics (request counts and latency per route, cache and worker pool stats) served at METRICS_PATH.
+# The path is answered before any plugin or file and is not authenticated. METRICS needs a restart.
+METRICS=false
+METRICS_PATH=/metrics
+# Binary access log, one record per request, written to ACCESS_LOG_DIR. Files roll over at ACCESS_LOG_MAX_MB or after
+# ACCESS_LOG_ROTATE_MINUTES (0 disables either). Convert them with src/tools/accesslog2json.cpp. Needs a restart.
+ACCESS_LOG=false
+ACCESS_LOG_DIR=./logs
+ACCESS_LOG_MAX_MB=64
+ACCESS_LOG_ROTATE_MINUTES=60
+
 # Debug mode not implemented yet
 DEBUG_MODE=false)#";
 
@@ -60,27 +139,315 @@ class IWebSocketPool {
     virtual ~IWebSocketPool() = default;
 };
 
+class IAsyncPlugin;
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#define CROUTER_ASYNC 1
+
+// Where an Async<T> keeps its result: `co_return value;`, or a bare `co_return;` for
+// Async<void>.
+template <typename T>
+struct AsyncResult {
+    std::optional<T> value;
+    template <typename U>
+    void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+    T take() { return std::move(*value); }
+};
+template <>
+struct AsyncResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+// Lazy coroutine returning a T: async handlers return Async<Response>, and helpers a
+// plugin writes itself can return any Async<T> (Async<void> included) and be
+// co_awaited from there.
+template <typename T>
+class Async {
+   public:
+    struct promise_type : AsyncResult<T> {
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+        std::function<void()> on_done;
+
+        Async get_return_object() { return Async(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Final {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    promise_type& promise = handle.promise();
+                    if (promise.continuation) return promise.continuation;
+                    if (promise.on_done) promise.on_done();
+                    return std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Async() = default;
+    Async(Async&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Async& operator=(Async&& other) noexcept {
+        if (this != &other) {
+            reset();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+    ~Async() { reset(); }
+
+    auto operator co_await() noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+            T await_resume() { return take(handle.promise()); }
+        };
+        return Awaiter{handle_};
+    }
+
+    // Used by the server: runs the coroutine up to its first suspension; on_done is
+    // called once it has finished, after which result() returns or rethrows.
+    void start(std::function<void()> on_done) {
+        handle_.promise().on_done = std::move(on_done);
+        handle_.resume();
+    }
+    T result() { return take(handle_.promise()); }
+
+   private:
+    explicit Async(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    static T take(promise_type& promise) {
+        if (promise.error) std::rethrow_exception(promise.error);
+        return promise.take();
+    }
+    void reset() {
+        if (handle_) handle_.destroy();
+        handle_ = {};
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Awaitable over a callback-style server call. The server always completes the call
+// later on the request's executor, never from inside start.
+template <typename T>
+class AsyncCall {
+   public:
+    using Start = std::function<void(std::function<void(T)>)>;
+    explicit AsyncCall(Start start) : start_(std::move(start)) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> caller) {
+        start_([this, caller](T result) {
+            result_.emplace(std::move(result));
+            caller.resume();
+        });
+    }
+    T await_resume() { return std::move(*result_); }
+
+   private:
+    Start start_;
+    std::optional<T> result_;
+};
+
+class IAsyncSocket {
+   public:
+    // An empty string means the peer closed the connection or the read failed.
+    virtual void startRead(std::size_t max_bytes, std::function<void(std::string)> done) = 0;
+    virtual void startWrite(std::string data, std::function<void(bool)> done) = 0;
+    virtual void close() = 0;
+    virtual ~IAsyncSocket() = default;
+
+    AsyncCall<std::string> read(std::size_t max_bytes = 16384) {
+        return AsyncCall<std::string>([this, max_bytes](auto done) { startRead(max_bytes, std::move(done)); });
+    }
+    AsyncCall<bool> write(std::string data) {
+        return AsyncCall<bool>([this, data = std::move(data)](auto done) { startWrite(std::move(data), std::move(done)); });
+    }
+};
+
+// Non-blocking primitives for async handlers, e.g.
+//   co_await io.sleep(100);
+//   std::optional<std::string> page = co_await io.readFile("public/index.html");
+//   std::unique_ptr<IAsyncSocket> upstream = co_await io.connect("localhost", "9000");
+// The coroutine resumes on the executor of the request's connection.
+class IAsyncIO {
+   public:
+    virtual void startSleep(long ms, std::function<void(bool)> done) = 0;
+    virtual void startReadFile(const std::string& path, std::function<void(std::optional<std::string>)> done) = 0;
+    virtual void startConnect(const std::string& host, const std::string& port, std::function<void(std::unique_ptr<IAsyncSocket>)> done) = 0;
+    virtual ~IAsyncIO() = default;
+
+    // Resumes with false if the wait was cut short.
+    AsyncCall<bool> sleep(long ms) {
+        return AsyncCall<bool>([this, ms](auto done) { startSleep(ms, std::move(done)); });
+    }
+    // Resumes with std::nullopt if the file cannot be read.
+    AsyncCall<std::optional<std::string>> readFile(std::string path) {
+        return AsyncCall<std::optional<std::string>>([this, path = std::move(path)](auto done) { startReadFile(path, std::move(done)); });
+    }
+    // Resumes with nullptr if the host cannot be resolved or reached.
+    AsyncCall<std::unique_ptr<IAsyncSocket>> connect(std::string host, std::string port) {
+        return AsyncCall<std::unique_ptr<IAsyncSocket>>([this, host = std::move(host), port = std::move(port)](auto done) {
+            startConnect(host, port, std::move(done));
+        });
+    }
+};
+
+class IAsyncPlugin {
+   public:
+    virtual Async<Response> handleAsync(Request&, IAsyncIO&) = 0;
+    virtual ~IAsyncPlugin() = default;
+};
+#endif
+
+// Where a request runs: Light on the IO thread, Heavy on the worker pool, Auto lets the
+// server decide from the route's recent handler latency (see ADAPTIVE_HEAVY).
+enum class Execution { Auto, Light, Heavy };
+
 class IPlugin {
    public:
     virtual Response handle(Request&) = 0;
     virtual bool isHeavy(){return false;};
     virtual void onLoad(){};
     virtual ~IPlugin() = default;
+    // Routes served by this plugin, e.g. "GET /api/users/:id" or "/api/*" (any method).
+    // Empty means "/<plugin name>" and everything below it.
+    virtual std::vector<std::string> routes(){return {};};
+    // Per-request override of where handle() runs. Only asked when isHeavy() is false.
+    virtual Execution execution(Request&){return Execution::Auto;};
+    // Plugins that also derive from IAsyncPlugin return this; the server then runs
+    // handleAsync() as a coroutine instead of calling handle().
+    virtual IAsyncPlugin* asAsync(){return nullptr;};
 
    protected:
     ILogger* _LOGGER_ = nullptr;
     IWebSocketPool* _WEBSOCKETS_ = nullptr;
 };
 
+#ifdef CROUTER_ASYNC
+// Convenience base for plugins that only implement handleAsync().
+class AsyncPlugin : public IPlugin, public IAsyncPlugin {
+   public:
+    Response handle(Request&) override { return Response(501, "Not Implemented"); }
+    IAsyncPlugin* asAsync() override { return this; }
+};
+#endif
+
 #endif)#";
 
 const char* request_hpp = R"#(#ifndef REQUEST_HPP
 #define REQUEST_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
+// Defined by the server; plugins only carry the pointers around.
+class FileBody;
+struct SerializedResponse;
+
+// Shared between the server and the handler of one request. The server sets `reason`
+// once the request's deadline passes or its client goes away; by then it has already
+// answered (504) or dropped the connection, so the handler's result is discarded.
+struct RequestCancellation {
+    enum Reason : std::uint8_t { None = 0, Timeout, Disconnected };
+    std::atomic<std::uint8_t> reason{None};
+    // steady_clock time in nanoseconds, 0 = no deadline.
+    std::int64_t deadline_ns = 0;
+
+    static std::int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+// Strong entity tags for conditional requests: a 64-bit FNV-1a hash of the exact bytes
+// sent, so the tag changes with the content and differs between encodings of it.
+struct ContentHash {
+    std::uint64_t value = 0xcbf29ce484222325ull;
+
+    void update(std::string_view data) {
+        for (unsigned char c : data) {
+            value ^= c;
+            value *= 0x100000001b3ull;
+        }
+    }
+
+    // Quoted, e.g. "9f2c54e0a1b3d877".
+    std::string etag() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string tag(18, '"');
+        for (int i = 0; i < 16; i++) tag[1 + i] = digits[(value >> (60 - 4 * i)) & 0xf];
+        return tag;
+    }
+
+    static std::string etag(std::string_view content) {
+        ContentHash hash;
+        hash.update(content);
+        return hash.etag();
+    }
+};
+
+// HTTP dates (IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT") for Last-Modified and
+// If-Modified-Since. Formatted and parsed by hand, independent of the C locale.
+struct HttpDate {
+    static std::string format(std::time_t time) {
+        static const char* days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+        static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        std::tm tm{};
+        gmtime_r(&time, &tm);
+        char out[32];
+        std::snprintf(out, sizeof(out), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+                      months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        return out;
+    }
+
+    // Other (obsolete) date formats are rejected.
+    static bool parse(std::string_view date, std::time_t& out) {
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if (date.size() != 29 || date[3] != ',' || date.substr(25) != " GMT") return false;
+        auto number = [&](std::size_t pos, std::size_t len, int& value) {
+            auto [end, ec] = std::from_chars(date.data() + pos, date.data() + pos + len, value);
+            return ec == std::errc() && end == date.data() + pos + len;
+        };
+        int day, year, hour, minute, second;
+        if (!number(5, 2, day) || !number(12, 4, year) || !number(17, 2, hour) || !number(20, 2, minute) || !number(23, 2, second)) return false;
+        const char* month_pos = std::strstr(months, std::string(date.substr(8, 3)).c_str());
+        if (!month_pos || (month_pos - months) % 3 != 0) return false;
+        int month = static_cast<int>(month_pos - months) / 3 + 1;
+        // Days since 1970-01-01 in the proleptic Gregorian calendar.
+        int y = year - (month <= 2);
+        int era = (y >= 0 ? y : y - 399) / 400;
+        int yoe = y - era * 400;
+        int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        long long days = static_cast<long long>(era) * 146097 + doe - 719468;
+        out = static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+        return true;
+    }
+};
+
 class Request {
    public:
     std::string method;
@@ -89,6 +456,102 @@ class Request {
     std::unordered_map<std::string, std::string> headers;
     std::string body;
 
+    // Route parameters captured by the server's router (offsets into `uri`).
+    struct PathParam {
+        std::string_view name;
+        std::uint32_t offset = 0;
+        std::uint32_t length = 0;
+    };
+    static constexpr std::size_t max_path_params = 8;
+    std::array<PathParam, max_path_params> path_params{};
+    std::size_t path_param_count = 0;
+
+    // Value of the ":name" route parameter ("*" for a wildcard's rest), empty if absent.
+    std::string_view param(std::string_view name) const {
+        for (std::size_t i = 0; i < path_param_count; i++) {
+            if (path_params[i].name == name) return std::string_view(uri).substr(path_params[i].offset, path_params[i].length);
+        }
+        return {};
+    }
+    std::string_view path() const {
+        return std::string_view(uri).substr(0, uri.find('?'));
+    }
+    std::string_view query() const {
+        std::size_t q = uri.find('?');
+        return q == std::string::npos ? std::string_view() : std::string_view(uri).substr(q + 1);
+    }
+
+    // Set by the server for requests with a deadline and for handlers running off the
+    // connection's thread. Long-running handlers can poll cancelled() and return early.
+    std::shared_ptr<RequestCancellation> cancellation;
+
+    bool cancelled() const {
+        if (!cancellation) return false;
+        if (cancellation->reason.load(std::memory_order_relaxed) != RequestCancellation::None) return true;
+        return cancellation->deadline_ns != 0 && RequestCancellation::now_ns() >= cancellation->deadline_ns;
+    }
+    // Milliseconds until the deadline, -1 without one.
+    long remainingMs() const {
+        if (!cancellation || cancellation->deadline_ns == 0) return -1;
+        std::int64_t left = cancellation->deadline_ns - RequestCancellation::now_ns();
+        return left > 0 ? static_cast<long>(left / 1000000) : 0;
+    }
+
+    // Case-insensitive header lookup, nullptr when the header is absent.
+    const std::string* header(std::string_view name) const {
+        auto it = headers.find(std::string(name));
+        if (it != headers.end()) return &it->second;
+        for (const auto& [key, value] : headers) {
+            if (key.size() == name.size() && std::equal(key.begin(), key.end(), name.begin(), [](char a, char b) {
+                    return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+                })) {
+                return &value;
+            }
+        }
+        return nullptr;
+    }
+
+    // Conditional GET: true when the client's cached copy is still current, so a 304
+    // can be sent instead of the body. If-None-Match is checked against `etag` and,
+    // only when absent, If-Modified-Since against `last_modified` (an HTTP date).
+    bool notModified(std::string_view etag, std::string_view last_modified = {}) const {
+        if (method != "GET" && method != "HEAD") return false;
+        if (const std::string* if_none_match = header("If-None-Match")) {
+            return !etag.empty() && etagListed(*if_none_match, etag);
+        }
+        const std::string* if_modified_since = header("If-Modified-Since");
+        std::time_t since, modified;
+        if (!if_modified_since || last_modified.empty()) return false;
+        return HttpDate::parse(*if_modified_since, since) && HttpDate::parse(last_modified, modified) && modified <= since;
+    }
+
+    // Weak comparison, as If-None-Match asks for. A tag the compression stage derived
+    // from `etag` ("tag-gzip") stands for the same content and matches too.
+    static bool etagListed(std::string_view list, std::string_view etag) {
+        auto opaque = [](std::string_view tag) {
+            if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+            return tag;
+        };
+        etag = opaque(etag);
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t end = list.find(',', pos);
+            if (end == std::string_view::npos) end = list.size();
+            std::string_view tag = list.substr(pos, end - pos);
+            pos = end + 1;
+            tag.remove_prefix(std::min(tag.find_first_not_of(" \t"), tag.size()));
+            tag = tag.substr(0, tag.find_last_not_of(" \t") + 1);
+            if (tag == "*") return true;
+            tag = opaque(tag);
+            if (tag == etag) return true;
+            if (etag.size() >= 2 && tag.size() > etag.size() && tag.substr(0, etag.size() - 1) == etag.substr(0, etag.size() - 1)) {
+                std::string_view suffix = tag.substr(etag.size() - 1);
+                if (suffix == "-gzip\"" || suffix == "-br\"" || suffix == "-deflate\"") return true;
+            }
+        }
+        return false;
+    }
+
     static Request parse(const std::string& raw_request) {
         Request req;
         std::istringstream stream(raw_request);
@@ -187,10 +650,34 @@ class Response {
         setHeader("Keep-Alive", value);
     }
 
+    const std::string* getHeader(const std::string& name) const {
+        auto it = headers_.find(name);
+        return it == headers_.end() ? nullptr : &it->second;
+    }
+    void removeHeader(const std::string& name) {
+        headers_.erase(name);
+    }
+
     void setBody(const std::string& body) {
         body_ = body;
+        shared_body_.reset();
         headers_["Content-Length"] = std::to_string(body.size());
     }
+    void setBody(std::string&& body) {
+        headers_["Content-Length"] = std::to_string(body.size());
+        body_ = std::move(body);
+        shared_body_.reset();
+    }
+    // Shares an immutable buffer with the response instead of copying it.
+    void setBody(std::shared_ptr<const std::string> body) {
+        headers_["Content-Length"] = std::to_string(body->size());
+        body_.clear();
+        shared_body_ = std::move(body);
+    }
+
+    const std::string& body() const {
+        return shared_body_ ? *shared_body_ : body_;
+    }
 
     std::string toString() const {
         std::ostringstream stream;
@@ -203,14 +690,47 @@ class Response {
 
         stream << "\r\n";
 
-        stream << body_;
+        stream << (shared_body_ ? *shared_body_ : body_);
 
         return stream.str();
     }
 
+    // Sets a strong ETag for the body set so far (see ContentHash).
+    void setETagFromBody() {
+        setETag(ContentHash::etag(body()));
+    }
+
+    // Turns a 200 into a header-only 304 when `req` already holds this representation,
+    // judged by the ETag and Last-Modified set on the response. Returns whether it did.
+    //   res.setBody(render());
+    //   res.setETagFromBody();
+    //   res.revalidate(req);
+    bool revalidate(const Request& req) {
+        if (statusCode_ != 200 || serialized_) return false;
+        const std::string* etag = getHeader("ETag");
+        const std::string* last_modified = getHeader("Last-Modified");
+        if (!req.notModified(etag ? *etag : std::string_view(), last_modified ? *last_modified : std::string_view())) return false;
+        setNotModified();
+        return true;
+    }
+
+    // 304 Not Modified: the validators and caching headers stay, the body and the headers
+    // describing it go.
+    void setNotModified() {
+        setStatus(304);
+        for (const char* name : {"Content-Type", "Content-Length", "Content-Encoding"}) headers_.erase(name);
+        body_.clear();
+        shared_body_.reset();
+        file_body_.reset();
+        serialized_.reset();
+    }
+
     void clear() {
         headers_.clear();
         body_.clear();
+        shared_body_.reset();
+        file_body_.reset();
+        serialized_.reset();
     }
 
    private:
@@ -230,8 +750,16 @@ class Response {
                 return "Unauthorized";
             case 404:
                 return "Not Found";
+            case 413:
+                return "Payload Too Large";
             case 500:
                 return "Internal Server Error";
+            case 501:
+                return "Not Implemented";
+            case 503:
+                return "Service Unavailable";
+            case 504:
+                return "Gateway Timeout";
             default:
                 return "Unknown";
         }
@@ -241,6 +769,9 @@ class Response {
     std::string statusMessage_;
     std::unordered_map<std::string, std::string> headers_;
     std::string body_;
+    std::shared_ptr<FileBody> file_body_;
+    std::shared_ptr<const std::string> shared_body_;
+    std::shared_ptr<const SerializedResponse> serialized_;
 };
 #endif)#";
 
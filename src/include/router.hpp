@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "request.hpp"
+
+// Compact radix tree mapping "METHOD /path" patterns to values. Static path bytes are
+// stored on compressed edges, ":name" matches one non-empty segment and "*" matches
+// the (possibly empty) rest of the path. Matching walks the tree in place and records
+// parameters as offsets into the request uri, so a lookup never allocates.
+// Static edges win over parameters, parameters over "*", among the routes that take
+// the request's method: a more specific path without it falls through to the others.
+template <typename T>
+class RadixRouter {
+   public:
+    struct Match {
+        const T* value = nullptr;
+        // The path exists but has no handler for the method; `allow` lists those it has.
+        bool method_not_allowed = false;
+        std::string allow;
+    };
+
+    // `method` is "GET", "POST", ... or empty for any method.
+    void insert(std::string_view method, std::string_view pattern, T value) {
+        if (pattern.empty() || pattern[0] != '/') throw std::runtime_error("Route must start with '/': " + std::string(pattern));
+        Node* node = insert(&root_, pattern);
+        for (auto& [m, v] : node->handlers) {
+            if (m == method) throw std::runtime_error("Duplicate route: " + std::string(method) + " " + std::string(pattern));
+        }
+        node->handlers.emplace_back(std::string(method), std::move(value));
+    }
+
+    Match match(std::string_view method, std::string_view path, Request& req) const {
+        Match result;
+        req.path_param_count = 0;
+        if (const Node* node = match(&root_, path, 0, method, req)) {
+            result.value = handler(node, method);
+            return result;
+        }
+        // No route takes the method; a 405 if any route has the path, listing all of theirs.
+        req.path_param_count = 0;
+        std::vector<std::string_view> methods;
+        allowed(&root_, path, 0, methods);
+        for (std::string_view m : methods) {
+            if (!result.allow.empty()) result.allow += ", ";
+            result.allow += m;
+        }
+        result.method_not_allowed = !methods.empty();
+        return result;
+    }
+
+   private:
+    struct Node {
+        std::string label;
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;
+        std::string param_name;
+        std::unique_ptr<Node> wildcard;
+        std::vector<std::pair<std::string, T>> handlers;
+    };
+
+    static bool is_special(std::string_view pattern, std::size_t i) {
+        return (pattern[i] == ':' || pattern[i] == '*') && (i == 0 || pattern[i - 1] == '/');
+    }
+
+    Node* insert(Node* node, std::string_view pattern) {
+        if (pattern.empty()) return node;
+        if (pattern[0] == '*') {
+            if (pattern.size() != 1) throw std::runtime_error("'*' must end a route");
+            if (!node->wildcard) node->wildcard = std::make_unique<Node>();
+            return node->wildcard.get();
+        }
+        if (pattern[0] == ':') {
+            std::size_t end = std::min(pattern.find('/'), pattern.size());
+            std::string_view name = pattern.substr(1, end - 1);
+            if (name.empty()) throw std::runtime_error("Unnamed route parameter");
+            if (!node->param) {
+                node->param = std::make_unique<Node>();
+                node->param_name = std::string(name);
+            } else if (node->param_name != name) {
+                throw std::runtime_error("Conflicting route parameters :" + node->param_name + " and :" + std::string(name));
+            }
+            return insert(node->param.get(), pattern.substr(end));
+        }
+        std::size_t end = 1;
+        while (end < pattern.size() && !is_special(pattern, end)) end++;
+        return insert_static(node, pattern.substr(0, end), pattern.substr(end));
+    }
+
+    Node* insert_static(Node* node, std::string_view label, std::string_view rest) {
+        for (auto& child : node->children) {
+            if (child->label[0] != label[0]) continue;
+            std::size_t common = 0;
+            while (common < label.size() && common < child->label.size() && label[common] == child->label[common]) common++;
+            if (common < child->label.size()) {
+                // Split the edge at the shared prefix.
+                auto split = std::make_unique<Node>();
+                split->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                split->children.push_back(std::move(child));
+                child = std::move(split);
+            }
+            if (common == label.size()) return insert(child.get(), rest);
+            return insert_static(child.get(), label.substr(common), rest);
+        }
+        node->children.push_back(std::make_unique<Node>());
+        node->children.back()->label = std::string(label);
+        return insert(node->children.back().get(), rest);
+    }
+
+    // The node's handler for `method`, else its any-method one.
+    static const T* handler(const Node* node, std::string_view method) {
+        const T* any = nullptr;
+        for (const auto& [m, v] : node->handlers) {
+            if (m == method) return &v;
+            if (m.empty()) any = &v;
+        }
+        return any;
+    }
+
+    static const Node* match(const Node* node, std::string_view path, std::size_t pos, std::string_view method, Request& req) {
+        if (pos == path.size() && handler(node, method)) return node;
+        if (pos < path.size()) {
+            for (const auto& child : node->children) {
+                if (child->label[0] == path[pos] && path.compare(pos, child->label.size(), child->label) == 0) {
+                    if (const Node* found = match(child.get(), path, pos + child->label.size(), method, req)) return found;
+                    break;
+                }
+            }
+            if (node->param && req.path_param_count < Request::max_path_params) {
+                std::size_t end = std::min(path.find('/', pos), path.size());
+                if (end > pos) {
+                    req.path_params[req.path_param_count++] = {node->param_name, static_cast<std::uint32_t>(pos), static_cast<std::uint32_t>(end - pos)};
+                    if (const Node* found = match(node->param.get(), path, end, method, req)) return found;
+                    req.path_param_count--;
+                }
+            }
+        }
+        if (node->wildcard && handler(node->wildcard.get(), method) && req.path_param_count < Request::max_path_params) {
+            req.path_params[req.path_param_count++] = {"*", static_cast<std::uint32_t>(pos), static_cast<std::uint32_t>(path.size() - pos)};
+            return node->wildcard.get();
+        }
+        return nullptr;
+    }
+
+    // Collects the methods of every route matching `path`, each once. Only walked for
+    // a 405, so it may allocate.
+    static void allowed(const Node* node, std::string_view path, std::size_t pos, std::vector<std::string_view>& methods) {
+        auto add = [&methods](const Node* n) {
+            for (const auto& [m, v] : n->handlers) {
+                if (std::find(methods.begin(), methods.end(), m) == methods.end()) methods.push_back(m);
+            }
+        };
+        if (pos == path.size()) add(node);
+        if (pos < path.size()) {
+            for (const auto& child : node->children) {
+                if (child->label[0] == path[pos] && path.compare(pos, child->label.size(), child->label) == 0) {
+                    allowed(child.get(), path, pos + child->label.size(), methods);
+                    break;
+                }
+            }
+            if (node->param) {
+                std::size_t end = std::min(path.find('/', pos), path.size());
+                if (end > pos) allowed(node->param.get(), path, end, methods);
+            }
+        }
+        if (node->wildcard) add(node->wildcard.get());
+    }
+
+    Node root_;
+};
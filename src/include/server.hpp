@@ -1,7 +1,6 @@
 #pragma once
 
 #include <boost/asio.hpp>
-#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
@@ -10,41 +9,82 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <poll.h>
 #include <queue>
+#include <sys/socket.h>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 #include <string>
 
+#include "access_log.hpp"
+#include "adaptive.hpp"
+#include "admission.hpp"
+#include "async_io.hpp"
+#include "config.hpp"
+#include "deadline.hpp"
+#include "handler.hpp"
+#include "http2.hpp"
+#include "metrics.hpp"
 #include "plugin.hpp"
 #include "request.hpp"
+#include "tls.hpp"
+#include "worker_pool.hpp"
 
 namespace serv {
 
-struct Handler {
-    std::function<Response(Request&)> func;
-    bool isHeavy;
-};
-using HandlerBuilder = std::function<Handler(Request&)>;
-
 class Session : public std::enable_shared_from_this<Session> {
    public:
-    Session(boost::asio::ip::tcp::socket socket, boost::asio::io_context& io_context, boost::asio::thread_pool& worker_pool, HandlerBuilder handler_builder)
-        : socket_(std::move(socket)),
+    // A session pinned to a single-threaded io_context (sharded mode) runs on the
+    // context's executor directly, otherwise its handlers are serialized by a strand.
+    // With a TLS context the session handshakes before reading its first request.
+    Session(boost::asio::ip::tcp::socket socket, boost::asio::io_context& io_context, WorkerPool& worker_pool, HandlerBuilder handler_builder, bool pinned = false,
+            boost::asio::ssl::context* tls = nullptr)
+        : socket_(tls ? Transport(std::move(socket), *tls) : Transport(std::move(socket))),
           io_context_(io_context),
           worker_pool_(worker_pool),
           handler_builder_(handler_builder),
-          strand_(io_context) {}
+          strand_(pinned ? boost::asio::any_io_executor(io_context.get_executor())
+                         : boost::asio::any_io_executor(boost::asio::make_strand(io_context))),
+          deadline_timer_(strand_),
+          peer_timer_(strand_),
+          write_timer_(strand_) {
+        _ADMISSION_.sessionOpened();
+        _METRICS_.sessionOpened();
+    }
+
+    ~Session() {
+        _ADMISSION_.sessionClosed();
+        _METRICS_.sessionClosed();
+    }
 
     void start() {
-        auto end_point = socket_.socket().remote_endpoint();
-        _LOGGER_.log("New session started from: " + end_point.address().to_string() + ":" + std::to_string(end_point.port()));
-        do_read_headers();
+        boost::system::error_code ec;
+        remote_ = socket_.socket().remote_endpoint(ec);
+        if (_LOGGER_.enabled(LogLevel::Debug)) {
+            _LOGGER_.debug("New session started from: " + remote_.address().to_string() + ":" + std::to_string(remote_.port()));
+        }
+        if (socket_.tls()) {
+            do_handshake();
+        } else {
+            do_read_headers();
+        }
     }
 
    private:
     std::mutex mtx;
     void do_close() {
+        // TLS says goodbye with close_notify first; that also keeps the session in the
+        // cache, which drops sessions of connections that were merely cut.
+        if (socket_.tls() && !tls_shutdown_ && socket_.socket().is_open()) {
+            tls_shutdown_ = true;
+            boost::system::error_code ignored;
+            socket_.socket().cancel(ignored);
+            socket_.expires_after(std::chrono::seconds(1));
+            socket_.async_shutdown(boost::asio::bind_executor(strand_,
+                [self = shared_from_this()](boost::system::error_code) { self->do_close(); }));
+            return;
+        }
         boost::system::error_code ec;
         socket_.socket().cancel(ec);
         socket_.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
@@ -52,84 +92,64 @@ class Session : public std::enable_shared_from_this<Session> {
         if (ec) {
             _LOGGER_.error("Error closing socket: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
         }
-        _LOGGER_.log("Session closed.");
+        _LOGGER_.debug("Session closed.");
     }
  
+    void do_handshake() {
+        socket_.expires_after(std::chrono::seconds(30));
+        socket_.async_handshake(boost::asio::bind_executor(strand_,
+            [self = shared_from_this()](boost::system::error_code ec) {
+                if (ec) {
+                    if (_LOGGER_.enabled(LogLevel::Debug))
+                        _LOGGER_.debug("TLS handshake failed: " + ec.message());
+                    self->do_close();
+                    return;
+                }
+                if (_LOGGER_.enabled(LogLevel::Debug)) {
+                    _LOGGER_.debug(std::string("TLS handshake done (") + (self->socket_.resumed() ? "resumed" : "full") +
+                                   (self->socket_.ktls() ? ", kTLS" : "") + ")");
+                }
+                self->do_read_headers();
+            }));
+    }
+
     void do_read_headers() {
         if (!socket_.socket().is_open()) {
             _LOGGER_.warning("Attempted to read from a closed socket. Aborting read operation.");
             return;
         }
         auto self = shared_from_this();
-        socket_.expires_after(std::chrono::seconds(30));
+        // A connection sitting between requests gets the keep-alive idle timeout,
+        // a half-received request gets the regular one.
+        if (request_buffer_.size() == 0 && requests_served_ > 0) {
+            socket_.expires_after(std::chrono::seconds(CONF.keep_alive_timeout));
+        } else {
+            socket_.expires_after(std::chrono::seconds(30));
+        }
 
-        boost::asio::async_read_until(socket_.socket(), request_buffer_, "\r\n\r\n",
+        socket_.async_read_some(request_buffer_.prepare(read_chunk_size),
             boost::asio::bind_executor(strand_,
                 [self](boost::system::error_code ec, std::size_t length) {
                     if (ec == boost::asio::error::operation_aborted) {
-                        _LOGGER_.warning("Read headers timed out or was aborted for session.");
+                        _LOGGER_.debug("Read headers timed out or was aborted for session.");
                         self->do_close();
                         return;
                     }
                     if (!ec) {
-                        std::string headers_str(
-                            boost::asio::buffers_begin(self->request_buffer_.data()),
-                            boost::asio::buffers_begin(self->request_buffer_.data()) + length);
-
-                        std::size_t content_length = 0;
-                        {
-                            std::istringstream header_stream(headers_str);
-                            std::string line;
-                            while (std::getline(header_stream, line) && line != "\r") {
-                                if (line.find("Content-Length:") != std::string::npos) {
-                                    try {
-                                        content_length = static_cast<std::size_t>(std::stoul(
-                                            line.substr(line.find(":") + 1)));
-                                    } catch (...) {
-                                        content_length = 0;
-                                    }
-                                }
-                            }
-                        }
-
-                        std::size_t already_in_buffer = self->request_buffer_.size() - length;
-
-                        if (content_length > already_in_buffer) {
-                            boost::asio::async_read(self->socket_.socket(),
-                                self->request_buffer_,
-                                boost::asio::transfer_exactly(content_length - already_in_buffer),
-                                boost::asio::bind_executor(self->strand_,
-                                    [self](boost::system::error_code ec, std::size_t) {
-                                        if (!ec) {
-                                            std::string full_request_content(
-                                                boost::asio::buffers_begin(self->request_buffer_.data()),
-                                                boost::asio::buffers_end(self->request_buffer_.data()));
-                                            self->request_buffer_.consume(self->request_buffer_.size());
-
-                                            self->process_full_request(full_request_content);
-                                        } else {
-                                            _LOGGER_.error("Error reading request body: " + ec.message());
-                                            self->do_close();
-                                        }
-                                    }));
-                        } else {
-                            std::string full_request_content(
-                                boost::asio::buffers_begin(self->request_buffer_.data()),
-                                boost::asio::buffers_end(self->request_buffer_.data()));
-                            self->request_buffer_.consume(self->request_buffer_.size());
-
-                            self->process_full_request(full_request_content);
-                        }
+                        _METRICS_.bytesIn(length);
+                        self->request_buffer_.commit(length);
+                        self->process_next();
                     } else {
-                        if (ec == boost::asio::error::timed_out) {
-                            _LOGGER_.log("Read operation timed out or was aborted for session.");
+                        if (ec == boost::beast::error::timeout) {
+                            _LOGGER_.debug("Read operation timed out for session.");
                         } else if (
                             ec == boost::asio::error::eof ||
                             ec == boost::asio::error::operation_aborted ||
                             ec.value() == 10053 ||
                             ec.value() == 10054
                         ){
-                            _LOGGER_.log("Client disconnected during header read: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
+                            if (_LOGGER_.enabled(LogLevel::Debug))
+                                _LOGGER_.debug("Client disconnected during header read: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
                         } else {
                             _LOGGER_.error("Error during read headers: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
                         }
@@ -138,41 +158,167 @@ class Session : public std::enable_shared_from_this<Session> {
                 }));
     }
 
-    void process_full_request(const std::string &full_request_content) {
-        _LOGGER_.log("Request received:\n" + (full_request_content.length() > 512 && false
-            ? (full_request_content.substr(0, 512) + " (. . .)")
-            : full_request_content));
+    // Takes the next complete request out of the read buffer, if any. Leftover bytes
+    // stay buffered, so pipelined requests are handled one after another and their
+    // responses are collected in order until the buffer runs dry, then flushed at once.
+    void process_next() {
+        std::string_view data(static_cast<const char*>(request_buffer_.data().data()), request_buffer_.size());
+        // A connection opening with the HTTP/2 preface speaks h2c from the first byte.
+        if (requests_served_ == 0 && CONF.http2 && !socket_.tls() && !data.empty() &&
+            Http2Session::preface.substr(0, std::min(data.size(), Http2Session::preface.size())) ==
+                data.substr(0, std::min(data.size(), Http2Session::preface.size()))) {
+            if (data.size() < Http2Session::preface.size()) {
+                do_read_headers();
+            } else {
+                start_http2(std::nullopt, {});
+            }
+            return;
+        }
+        RequestParser::Status status = data.empty() ? RequestParser::Status::Incomplete : parser_.feed(data);
+        switch (status) {
+            case RequestParser::Status::Incomplete:
+                if (pending_responses_.empty()) {
+                    do_read_headers();
+                } else {
+                    do_write();
+                }
+                return;
+            case RequestParser::Status::Bad:
+                _LOGGER_.warning("Malformed request received, closing session.");
+                on_error(begin_entry(nullptr, {}), parser_.errorStatus());
+                return;
+            case RequestParser::Status::Complete: {
+                Request req = parser_.build(data);
+                request_buffer_.consume(parser_.messageSize());
+                parser_.reset();
+                process_request(std::move(req));
+                return;
+            }
+        }
+    }
+
+    bool wants_keep_alive(const Request& req) const {
+        if (requests_served_ >= static_cast<std::size_t>(CONF.max_keep_alive_requests)) return false;
+        const std::string* connection = req.header("Connection");
+        if (req.http_version == "HTTP/1.0") {
+            return connection && RequestParser::iequals(*connection, "keep-alive");
+        }
+        return !(connection && RequestParser::iequals(*connection, "close"));
+    }
+
+    // "Upgrade: h2c" with HTTP2-Settings, on a connection with nothing else in flight.
+    bool wants_http2(const Request& req) const {
+        if (!CONF.http2 || socket_.tls() || req.http_version != "HTTP/1.1" || !pending_responses_.empty()) return false;
+        const std::string* upgrade = req.header("Upgrade");
+        return upgrade && upgrade->find("h2c") != std::string::npos && req.header("HTTP2-Settings");
+    }
+
+    // Answers 101 and hands the connection to an Http2Session, where the request becomes stream 1.
+    void upgrade_to_http2(Request req) {
+        auto settings = Http2Session::decodeSettingsHeader(*req.header("HTTP2-Settings"));
+        if (!settings) {
+            on_error(begin_entry(req, {}));
+            return;
+        }
+        socket_.expires_after(std::chrono::seconds(30));
+        socket_.async_write(boost::asio::buffer(switching_protocols),
+            boost::asio::bind_executor(strand_,
+                [self = shared_from_this(), req = std::move(req), settings = std::move(*settings)](boost::system::error_code ec, std::size_t n) mutable {
+                    _METRICS_.bytesOut(n);
+                    if (ec) {
+                        self->do_close();
+                        return;
+                    }
+                    self->start_http2(std::move(req), settings);
+                }));
+    }
+
+    void start_http2(std::optional<Request> upgraded, std::string_view settings) {
+        std::string initial(static_cast<const char*>(request_buffer_.data().data()), request_buffer_.size());
+        request_buffer_.consume(request_buffer_.size());
+        socket_.expires_never();
+        auto session = std::make_shared<Http2Session>(socket_.plain().release_socket(), strand_, worker_pool_, handler_builder_, remote_);
+        session->start(initial, std::move(upgraded), settings);
+    }
 
-        Request req = Request::parse(full_request_content);
-        Handler handler = handler_builder_(req);
+    void process_request(Request req) {
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("Request received: " + req.method + " " + req.uri + " " + req.http_version);
+
+        requests_served_++;
+        if (wants_http2(req)) {
+            upgrade_to_http2(std::move(req));
+            return;
+        }
+        bool keep_alive = wants_keep_alive(req);
+        http10_ = req.http_version == "HTTP/1.0";
+        Handler handler = is_metrics_request(req) ? metrics_handler() : handler_builder_(req);
         auto func = handler.func;
+        Compression::Encoding encoding = _COMPRESSION_.negotiate(req);
+        RequestEntry entry = begin_entry(req, handler.route);
+        entry.route_id = handler.route_id;
+        entry.adaptive = handler.adaptive;
+
+        // Shed load before any handler work; the metrics endpoint stays reachable.
+        if (handler.route_id != Metrics::untracked) {
+            if (!_ADMISSION_.admit(handler.isHeavy, handler.route_id, worker_pool_.queueDepth())) {
+                Response res(503, "Service Unavailable");
+                res.setSerialized(_ADMISSION_.rejection());
+                on_response(res, false, entry);
+                return;
+            }
+            entry.admitted = true;
+            entry.heavy = handler.isHeavy;
+        }
+
+        // Handlers that leave the connection's thread are watched for their deadline and
+        // for the client going away; light handlers can only see the deadline themselves.
+        // Upgrade requests may hand the socket to a websocket, so they are left alone.
+        bool detached = handler.isHeavy;
+#ifdef CROUTER_ASYNC
+        detached = detached || handler.async;
+#endif
+        std::int64_t timeout_ns = handler.route_id == Metrics::untracked ? 0 : _DEADLINES_.timeoutNs(handler.route_id);
+        if ((detached || timeout_ns > 0) && !req.header("Upgrade")) {
+            req.cancellation = std::make_shared<RequestCancellation>();
+            if (timeout_ns > 0) req.cancellation->deadline_ns = RequestCancellation::now_ns() + timeout_ns;
+        }
+
+#ifdef CROUTER_ASYNC
+        if (handler.async) {
+            run_async(handler.async, std::move(req), keep_alive, encoding, entry);
+            return;
+        }
+#endif
 
         if (handler.isHeavy) {
-            boost::asio::post(worker_pool_, [self = shared_from_this(), req = std::move(req), func]() mutable {
+            if (req.cancellation) begin_watch(req.cancellation, entry, nullptr);
+            worker_pool_.post([self = shared_from_this(), req = std::move(req), func, keep_alive, encoding, entry]() mutable {
+                // Cancelled while queued: the session has already answered or closed.
+                if (req.cancelled()) {
+                    release(entry);
+                    return;
+                }
                 try {
                     Response res_obj;
                     {
                         std::lock_guard<std::mutex> lock(self->mtx);
                         _WEBSOCKETS_.request_sockets[&req] = self;
+                        auto handler_start = std::chrono::steady_clock::now();
                         res_obj = func(req);
+                        handler_done(entry, handler_start);
                         if (_WEBSOCKETS_.request_sockets.find(&req) == _WEBSOCKETS_.request_sockets.end()) return;
                         _WEBSOCKETS_.request_sockets.erase(&req);
                     }
-                    std::string response_str = res_obj.toString();
-                    boost::asio::post(self->strand_, [self, response_str]() {
-                        self->do_write(response_str);
+                    _COMPRESSION_.apply(res_obj, encoding);
+                    boost::asio::post(self->strand_, [self, token = req.cancellation, res_obj = std::move(res_obj), keep_alive, entry]() mutable {
+                        if (self->end_watch(token)) self->on_response(res_obj, keep_alive, entry);
                     });
                 } catch (const std::exception &ex) {
                     _LOGGER_.error("Error processing request: " + std::string(ex.what()));
-                    std::string error_response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
-                    boost::asio::post(self->strand_, [self, error_response]() {
-                        boost::asio::async_write(self->socket_, boost::asio::buffer(error_response),
-                            [self](boost::system::error_code write_ec, std::size_t) {
-                                if (write_ec) {
-                                    _LOGGER_.error("Error sending response: " + write_ec.message() + " (Error code: " + std::to_string(write_ec.value()) + ")");
-                                }
-                                self->do_close();
-                            });
+                    release(entry);
+                    boost::asio::post(self->strand_, [self, token = req.cancellation, entry]() {
+                        if (self->end_watch(token)) self->on_error(entry);
                     });
                 }
             });
@@ -182,72 +328,454 @@ class Session : public std::enable_shared_from_this<Session> {
                 {
                     std::lock_guard<std::mutex> lock(mtx);
                     _WEBSOCKETS_.request_sockets[&req] = shared_from_this();
+                    auto handler_start = std::chrono::steady_clock::now();
                     res_obj = func(req);
+                    handler_done(entry, handler_start);
                     if (_WEBSOCKETS_.request_sockets.find(&req) == _WEBSOCKETS_.request_sockets.end()) return;
                     _WEBSOCKETS_.request_sockets.erase(&req);
                 }
-                std::string response_str = res_obj.toString();
-                boost::asio::post(strand_, [self = shared_from_this(), response_str]() {
-                    self->do_write(response_str);
-                });
+                if (compress_response(res_obj, encoding, worker_pool_, strand_,
+                        [self = shared_from_this(), keep_alive, entry](Response& res) mutable { self->on_response(res, keep_alive, entry); })) {
+                    return;
+                }
+                on_response(res_obj, keep_alive, entry);
             } catch (const std::exception &ex) {
                 _LOGGER_.error("Error processing request: " + std::string(ex.what()));
-                std::string error_response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
-                boost::asio::post([self = shared_from_this(), error_response]() {
-                    boost::asio::async_write(self->socket_, boost::asio::buffer(error_response),
-                        [self](boost::system::error_code write_ec, std::size_t) {
-                            if (write_ec) {
-                                _LOGGER_.error("Error sending response: " + write_ec.message() + " (Error code: " + std::to_string(write_ec.value()) + ")");
-                            }
-                            self->do_close();
-                        });
-                });
+                release(entry);
+                on_error(entry);
             }
         }
     }
 
+#ifdef CROUTER_ASYNC
+    // Async plugins run as coroutines on the session's executor, so a request waiting on
+    // a timer, a file or an upstream socket holds no thread. The call owns the request
+    // and the coroutine until the response is queued like any other.
+    void run_async(const std::function<Async<Response>(Request&, IAsyncIO&)>& handler, Request req, bool keep_alive, Compression::Encoding encoding, RequestEntry entry) {
+        struct Call {
+            Call(Request r, SessionAsyncIO i) : req(std::move(r)), io(std::move(i)) {}
+            Request req;
+            SessionAsyncIO io;
+            Async<Response> task;
+            RequestEntry entry;
+            std::chrono::steady_clock::time_point started;
+        };
+        auto call = std::make_shared<Call>(std::move(req), SessionAsyncIO(strand_, worker_pool_));
+        call->entry = entry;
+        call->started = std::chrono::steady_clock::now();
+        try {
+            call->task = handler(call->req, call->io);
+        } catch (const std::exception& ex) {
+            _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+            release(call->entry);
+            on_error(call->entry);
+            return;
+        }
+        if (call->req.cancellation) {
+            begin_watch(call->req.cancellation, entry, [weak = std::weak_ptr<Call>(call)]() {
+                if (auto c = weak.lock()) c->io.cancel();
+            });
+        }
+        // The coroutine may finish inside start(), so the response is always queued from
+        // a fresh handler rather than from within the coroutine's final suspend.
+        call->task.start([self = shared_from_this(), call, keep_alive, encoding]() {
+            boost::asio::post(self->strand_, [self, call, keep_alive, encoding]() {
+                bool wanted = self->end_watch(call->req.cancellation);
+                Response res_obj;
+                try {
+                    res_obj = call->task.result();
+                } catch (const std::exception& ex) {
+                    _LOGGER_.error("Error processing request: " + std::string(ex.what()));
+                    call->task = {};
+                    release(call->entry);
+                    if (wanted) self->on_error(call->entry);
+                    return;
+                }
+                // Destroying the frame also drops this callback and its reference to call.
+                call->task = {};
+                handler_done(call->entry, call->started);
+                if (!wanted) return;
+                if (compress_response(res_obj, encoding, self->worker_pool_, self->strand_,
+                        [self, keep_alive, entry = call->entry](Response& res) mutable { self->on_response(res, keep_alive, entry); })) {
+                    return;
+                }
+                self->on_response(res_obj, keep_alive, call->entry);
+            });
+        });
+    }
+#endif
+
+    // The request whose handler runs off the connection's thread. Only one is in flight
+    // per session, since the next request is not parsed before its response is queued.
+    struct Watch {
+        std::shared_ptr<RequestCancellation> token;
+        // Copy for the 504; the admission slot stays with the handler until it returns.
+        RequestEntry entry;
+        std::function<void()> on_cancel;
+    };
+
+    void begin_watch(std::shared_ptr<RequestCancellation> token, const RequestEntry& entry, std::function<void()> on_cancel) {
+        auto self = shared_from_this();
+        watch_.token = token;
+        watch_.entry = entry;
+        watch_.entry.admitted = false;
+        watch_.on_cancel = std::move(on_cancel);
+        if (token->deadline_ns != 0) {
+            deadline_timer_.expires_after(std::chrono::nanoseconds(token->deadline_ns - RequestCancellation::now_ns()));
+            deadline_timer_.async_wait(boost::asio::bind_executor(strand_,
+                [self, token](boost::system::error_code ec) {
+                    if (ec || self->watch_.token != token) return;
+                    self->cancel_watched(RequestCancellation::Timeout);
+                }));
+        }
+        watch_peer(token);
+    }
+
+    // The connection is idle while the handler runs, so readability with nothing to
+    // read means the peer closed or reset it. Bytes of a pipelined request or a TLS
+    // close_notify stay unread for the parser; the socket is then polled for the peer's
+    // FIN instead, since waiting for readability again would return at once.
+    void watch_peer(const std::shared_ptr<RequestCancellation>& token) {
+        auto self = shared_from_this();
+        socket_.socket().async_wait(boost::asio::ip::tcp::socket::wait_read, boost::asio::bind_executor(strand_,
+            [self, token](boost::system::error_code ec) {
+                if (ec || self->watch_.token != token) return;
+                int fd = self->socket_.socket().native_handle();
+                char byte;
+                ssize_t n = ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    self->watch_peer(token);
+                } else if (n > 0) {
+                    self->poll_peer(token);
+                } else {
+                    self->cancel_watched(RequestCancellation::Disconnected);
+                }
+            }));
+    }
+
+    void poll_peer(const std::shared_ptr<RequestCancellation>& token) {
+        pollfd pfd{socket_.socket().native_handle(), POLLRDHUP, 0};
+        if (::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            cancel_watched(RequestCancellation::Disconnected);
+            return;
+        }
+        auto self = shared_from_this();
+        peer_timer_.expires_after(peer_poll_interval);
+        peer_timer_.async_wait(boost::asio::bind_executor(strand_,
+            [self, token](boost::system::error_code ec) {
+                if (ec || self->watch_.token != token) return;
+                self->poll_peer(token);
+            }));
+    }
+
+    // Called with the handler's result; false if the request was cancelled meanwhile,
+    // in which case the result is dropped.
+    bool end_watch(const std::shared_ptr<RequestCancellation>& token) {
+        if (!token) return true;
+        if (watch_.token != token) return false;
+        stop_watch();
+        return true;
+    }
+
+    void stop_watch() {
+        watch_ = Watch{};
+        deadline_timer_.cancel();
+        peer_timer_.cancel();
+        boost::system::error_code ignored;
+        socket_.socket().cancel(ignored);
+    }
+
+    void cancel_watched(RequestCancellation::Reason reason) {
+        Watch watch = std::move(watch_);
+        stop_watch();
+        watch.token->reason.store(reason, std::memory_order_relaxed);
+        if (watch.on_cancel) watch.on_cancel();
+        if (reason == RequestCancellation::Disconnected) {
+            _METRICS_.cancelled(Metrics::CancelDisconnect);
+            _LOGGER_.debug("Client disconnected while its request was being handled.");
+            do_close();
+            return;
+        }
+        _METRICS_.cancelled(Metrics::CancelTimeout);
+        if (_LOGGER_.enabled(LogLevel::Debug))
+            _LOGGER_.debug("Handler deadline passed for route " + _METRICS_.routeName(watch.entry.route_id) + ", answering 504.");
+        // The handler may still hold the session, so the connection is not reused.
+        Response res(504, "Gateway Timeout");
+        res.setBody("Gateway Timeout");
+        on_response(res, false, watch.entry);
+    }
+
+    RequestEntry begin_entry(const Request* req, std::string_view route) const {
+        return make_entry(remote_, req, route);
+    }
+    RequestEntry begin_entry(const Request& req, std::string_view route) const {
+        return begin_entry(&req, route);
+    }
 
-    void do_write(const std::string& response) {
+    // Reports every response written so far to the access log and metrics.
+    void finish_entries() {
+        for (; logged_pos_ < write_pos_ && logged_pos_ < pending_entries_.size(); logged_pos_++) {
+            finish_entry(pending_entries_[logged_pos_]);
+        }
+    }
+
+    void on_response(Response& res, bool keep_alive, RequestEntry& entry) {
+        // HTTP/1.1 connections are persistent by default, so only a close
+        // (or an HTTP/1.0 keep-alive) needs announcing.
+        if (!keep_alive) {
+            res.setConnection("close");
+            close_after_write_ = true;
+        } else if (http10_ && res.getHeader("Connection") == nullptr) {
+            res.setConnection("keep-alive");
+        }
+        if (tracking()) {
+            entry.record.status = static_cast<std::uint16_t>(res.getStatus());
+            entry.record.bytes = body_bytes(res);
+            pending_entries_.push_back(entry);
+        }
+        pending_responses_.push_back(std::move(res));
+        if (close_after_write_) {
+            do_write();
+        } else {
+            process_next();
+        }
+    }
+
+    void on_error(RequestEntry entry, int status = 400) {
+        Response res;
+        res.setStatus(status);
+        res.setBody("");
+        res.setConnection("close");
+        if (tracking()) {
+            entry.record.status = static_cast<std::uint16_t>(status);
+            pending_entries_.push_back(entry);
+        }
+        pending_responses_.push_back(std::move(res));
+        close_after_write_ = true;
+        do_write();
+    }
+
+    // Sends the collected responses with a single gathered write: each response
+    // contributes its header block (serialized into a buffer reused across writes)
+    // and its body, which is referenced in place rather than copied. A file-backed
+    // body ends the batch after its headers; the file is streamed, then the rest follows.
+    void do_write() {
         if (!socket_.socket().is_open()) {
             _LOGGER_.warning("Attempted to write to a closed socket. Aborting write operation.");
             return;
         }
         auto self = shared_from_this();
         socket_.expires_after(std::chrono::seconds(30));
-        auto response_ptr = std::make_shared<std::string>(std::move(response));
 
-        boost::asio::async_write(socket_.socket(), boost::asio::buffer(*response_ptr),
+        write_buffers_.clear();
+        if (header_buffers_.size() < pending_responses_.size()) {
+            header_buffers_.resize(pending_responses_.size());
+        }
+        std::size_t end = write_pos_;
+        std::shared_ptr<FileBody> file;
+        while (end < pending_responses_.size() && !file) {
+            const Response& res = pending_responses_[end];
+            std::string& header = header_buffers_[end];
+            header.clear();
+            if (const auto& raw = res.serialized()) {
+                // Pre-serialized message: sent as is, with the Connection header
+                // spliced in before the blank line when one was set.
+                const std::string* connection = res.getHeader("Connection");
+                if (connection) {
+                    header.append("Connection: ").append(*connection).append("\r\n");
+                    write_buffers_.push_back(boost::asio::buffer(raw->message.data(), raw->head_end));
+                    write_buffers_.push_back(boost::asio::buffer(header));
+                    write_buffers_.push_back(boost::asio::buffer(raw->message.data() + raw->head_end, raw->message.size() - raw->head_end));
+                } else {
+                    write_buffers_.push_back(boost::asio::buffer(raw->message));
+                }
+            } else {
+                res.serializeHeaders(header);
+                write_buffers_.push_back(boost::asio::buffer(header));
+                if (!res.body().empty()) {
+                    write_buffers_.push_back(boost::asio::buffer(res.body()));
+                }
+            }
+            file = res.fileBody();
+            end++;
+        }
+        write_pos_ = end;
+
+        socket_.async_write(write_buffers_,
             boost::asio::bind_executor(strand_,
-                [self, response_ptr](boost::system::error_code ec, std::size_t bytes_transferred) {
+                [self, file](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    _METRICS_.bytesOut(bytes_transferred);
                     if (ec == boost::asio::error::operation_aborted) {
                         _LOGGER_.log("Write operation timed out or was aborted for session (Error code: " + std::to_string(ec.value()) + ")");
                         self->do_close();
                         return;
                     }
-                    if (!ec) {
-                        self->do_read_headers();
+                    if (ec) {
+                        _LOGGER_.error("Error during write: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
+                        self->do_close();
+                    } else if (file && file->size() > 0) {
+                        if (self->socket_.canSendfile()) {
+                            self->stream_file(file, 0);
+                        } else {
+                            self->copy_file(file, 0);
+                        }
                     } else {
+                        self->on_write_done();
+                    }
+                }));
+    }
+
+    void on_write_done() {
+        if (!pending_entries_.empty()) finish_entries();
+        if (write_pos_ < pending_responses_.size()) {
+            do_write();
+            return;
+        }
+        pending_responses_.clear();
+        pending_entries_.clear();
+        write_pos_ = 0;
+        logged_pos_ = 0;
+        if (close_after_write_) {
+            do_close();
+        } else {
+            process_next();
+        }
+    }
+
+#ifdef __linux__
+    // One sendfile call per turn, then wait for the socket to become writable again,
+    // so a slow reader throttles the transfer and large files never sit in memory.
+    // Each wait has the same 30s limit as a write; a reader that stalls past it is dropped.
+    // Over TLS this needs kernel TLS, which encrypts what sendfile hands it.
+    void stream_file(std::shared_ptr<FileBody> file, std::uint64_t offset) {
+        auto& sock = socket_.socket();
+        boost::system::error_code ec;
+        sock.native_non_blocking(true, ec);
+        while (!ec) {
+            std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(file->size() - offset, file_chunk_size));
+            ssize_t sent = socket_.sendfile(file->fd(), offset, count);
+            if (sent > 0) {
+                _METRICS_.bytesOut(static_cast<std::uint64_t>(sent));
+                offset += static_cast<std::uint64_t>(sent);
+                if (offset >= file->size()) {
+                    on_write_done();
+                    return;
+                }
+                break;
+            }
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            ec = sent == 0 ? boost::asio::error::make_error_code(boost::asio::error::eof)
+                           : boost::system::error_code(errno, boost::system::system_category());
+        }
+        if (ec) {
+            _LOGGER_.error("Error during sendfile: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
+            do_close();
+            return;
+        }
+        auto self = shared_from_this();
+        write_timer_.expires_after(std::chrono::seconds(30));
+        write_timer_.async_wait(boost::asio::bind_executor(strand_,
+            [self](boost::system::error_code ec) {
+                // Re-armed or reset by a wait that completed meanwhile.
+                if (ec || self->write_timer_.expiry() > std::chrono::steady_clock::now()) return;
+                _LOGGER_.log("Client stopped reading a file body, closing session.");
+                boost::system::error_code ignored;
+                self->socket_.socket().cancel(ignored);
+            }));
+        sock.async_wait(boost::asio::ip::tcp::socket::wait_write,
+            boost::asio::bind_executor(strand_,
+                [self, file, offset](boost::system::error_code ec) {
+                    self->write_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+                    if (ec) {
+                        self->do_close();
+                        return;
+                    }
+                    self->stream_file(file, offset);
+                }));
+    }
+#else
+    void stream_file(std::shared_ptr<FileBody> file, std::uint64_t offset) {
+        copy_file(std::move(file), offset);
+    }
+#endif
+
+    // File bodies without sendfile: read into a buffer and written like any other body.
+    void copy_file(std::shared_ptr<FileBody> file, std::uint64_t offset) {
+        file_chunk_.resize(static_cast<std::size_t>(std::min<std::uint64_t>(file->size() - offset, file_chunk_size)));
+        std::size_t n = file->read(offset, file_chunk_.data(), file_chunk_.size());
+        if (n == 0) {
+            _LOGGER_.error("Error reading file body, closing session.");
+            do_close();
+            return;
+        }
+        // The write timeout is per chunk, so a large file is not cut off by the 30s of do_write.
+        socket_.expires_after(std::chrono::seconds(30));
+        socket_.async_write(boost::asio::buffer(file_chunk_.data(), n),
+            boost::asio::bind_executor(strand_,
+                [self = shared_from_this(), file, offset](boost::system::error_code ec, std::size_t n) {
+                    _METRICS_.bytesOut(n);
+                    if (ec) {
                         _LOGGER_.error("Error during write: " + ec.message() + " (Error code: " + std::to_string(ec.value()) + ")");
                         self->do_close();
+                        return;
+                    }
+                    if (offset + n >= file->size()) {
+                        self->on_write_done();
+                    } else {
+                        self->copy_file(file, offset + n);
                     }
                 }));
     }
-    boost::beast::tcp_stream socket_;
+
+    Transport socket_;
     boost::asio::io_context& io_context_;
-    boost::asio::thread_pool& worker_pool_;
+    WorkerPool& worker_pool_;
     HandlerBuilder handler_builder_;
-    boost::asio::io_context::strand strand_;
+    boost::asio::any_io_executor strand_;
+    boost::asio::steady_timer deadline_timer_;
+    boost::asio::steady_timer peer_timer_;
+    boost::asio::steady_timer write_timer_;
+    Watch watch_;
     boost::asio::streambuf request_buffer_;
+    RequestParser parser_;
+    std::size_t requests_served_ = 0;
+    std::vector<Response> pending_responses_;
+    std::size_t write_pos_ = 0;
+    // Parallel to pending_responses_ while the access log or metrics are enabled.
+    std::vector<RequestEntry> pending_entries_;
+    std::size_t logged_pos_ = 0;
+    boost::asio::ip::tcp::endpoint remote_;
+    std::vector<std::string> header_buffers_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    bool close_after_write_ = false;
+    bool http10_ = false;
+    bool tls_shutdown_ = false;
+    static constexpr std::size_t read_chunk_size = 8192;
+    static constexpr std::size_t file_chunk_size = 1 << 20;
+    static constexpr std::chrono::milliseconds peer_poll_interval{250};
+    static constexpr std::string_view switching_protocols = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    std::vector<char> file_chunk_;
     friend WebSocketPool;
 };
 class Server {
    public:
-    Server(boost::asio::io_context& io_context, unsigned short port, boost::asio::thread_pool& worker_pool, HandlerBuilder handler_builder)
+#ifdef SO_REUSEPORT
+    static constexpr bool reuse_port_supported = true;
+#else
+    static constexpr bool reuse_port_supported = false;
+#endif
+
+    // With a TLS context every accepted connection is handshaked before its first request.
+    Server(boost::asio::io_context& io_context, unsigned short port, WorkerPool& worker_pool, HandlerBuilder handler_builder, bool reuse_port = false,
+           std::shared_ptr<boost::asio::ssl::context> tls = nullptr)
         : io_context_(io_context),
-          acceptor_(io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+          acceptor_(make_acceptor(io_context, port, reuse_port)),
           worker_pool_(worker_pool),
           handler_builder_(handler_builder),
-          port_(port) {
+          port_(port),
+          pinned_(reuse_port),
+          tls_(std::move(tls)) {
         do_accept();
     }
 
@@ -256,11 +784,39 @@ class Server {
     }
 
    private:
+    static boost::asio::ip::tcp::acceptor make_acceptor(boost::asio::io_context& io_context, unsigned short port, bool reuse_port) {
+        boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+        boost::asio::ip::tcp::acceptor acceptor(io_context);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        if (reuse_port) {
+            acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+        }
+#endif
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        return acceptor;
+    }
+
     void do_accept() {
+        // At the session limit in pause mode, leave new connections in the kernel backlog.
+        if (_ADMISSION_.pauseAccept() && _ADMISSION_.sessionsFull()) {
+            accept_timer_.expires_after(std::chrono::milliseconds(10));
+            accept_timer_.async_wait([this](boost::system::error_code ec) {
+                if (!ec) do_accept();
+            });
+            return;
+        }
         acceptor_.async_accept(
             [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
                 if (!ec) {
-                    std::make_shared<Session>(std::move(socket), io_context_, worker_pool_, handler_builder_)->start();
+                    _METRICS_.accepted();
+                    if (_ADMISSION_.sessionsFull()) {
+                        reject(std::move(socket));
+                    } else {
+                        std::make_shared<Session>(std::move(socket), io_context_, worker_pool_, handler_builder_, pinned_, tls_.get())->start();
+                    }
                 } else {
                     _LOGGER_.error("Accept error: " + ec.message());
                 }
@@ -268,11 +824,27 @@ class Server {
             });
     }
 
+    // Answers a connection over the session limit with the pre-serialized 503 and closes it.
+    static void reject(boost::asio::ip::tcp::socket socket) {
+        _ADMISSION_.reject(Metrics::RejectSessions);
+        auto sock = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+        auto message = _ADMISSION_.rejection(true);
+        boost::asio::async_write(*sock, boost::asio::buffer(message->message),
+            [sock, message](boost::system::error_code, std::size_t) {
+                boost::system::error_code ignored;
+                sock->shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+                sock->close(ignored);
+            });
+    }
+
     boost::asio::io_context& io_context_;
     boost::asio::ip::tcp::acceptor acceptor_;
-    boost::asio::thread_pool& worker_pool_;
+    boost::asio::steady_timer accept_timer_{io_context_};
+    WorkerPool& worker_pool_;
     HandlerBuilder handler_builder_;
     unsigned short port_;
+    bool pinned_;
+    std::shared_ptr<boost::asio::ssl::context> tls_;
 };
 
 }  // namespace serv
@@ -283,9 +855,13 @@ IWebSocket* WebSocketPool::make_from_request(Request& req) {
 
     auto session = it->second;
     request_sockets.erase(it);
+    if (session->socket_.tls()) {
+        _LOGGER_.warning("WebSocket upgrades are not available on TLS connections.");
+        return nullptr;
+    }
 
 
-    auto ws_stream = std::make_shared<boost::beast::websocket::stream<boost::beast::tcp_stream>>(std::move(session->socket_));
+    auto ws_stream = std::make_shared<boost::beast::websocket::stream<boost::beast::tcp_stream>>(std::move(session->socket_.plain()));
 
     auto ws_session = std::make_shared<WebSocketSession>(
         ws_stream,
@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "clock_map.hpp"
+#include "lru_map.hpp"
+
+// Concurrent cache split into independently locked shards by key hash, so threads
+// hitting different keys rarely touch the same lock. Each shard is either an exact
+// lru_map or a clock_map, whose hits only take a shared lock. The byte budget is
+// divided evenly between the shards, so no value larger than one shard's share is kept.
+template <typename K, typename V>
+class sharded_cache {
+   public:
+    enum class Policy { LRU, CLOCK };
+
+    sharded_cache(std::function<long(const V&)> one_element_size, long max_bytes, std::size_t shard_count, Policy policy)
+        : policy_(policy), one_element_size_(one_element_size) {
+        if (shard_count == 0) shard_count = 1;
+        long shard_bytes = max_bytes / static_cast<long>(shard_count);
+        shard_bytes_ = shard_bytes;
+        for (std::size_t i = 0; i < shard_count; i++) {
+            if (policy_ == Policy::CLOCK)
+                clock_shards_.push_back(std::make_unique<clock_map<K, V>>(one_element_size, shard_bytes));
+            else
+                lru_shards_.push_back(std::make_unique<lru_map<K, V>>(one_element_size, shard_bytes));
+        }
+    }
+
+    std::optional<V> find(const K& key) {
+        std::size_t i = shard_of(key);
+        return policy_ == Policy::CLOCK ? clock_shards_[i]->find(key) : lru_shards_[i]->find(key);
+    }
+    // Largest value put() keeps.
+    long max_value_bytes() const {
+        return shard_bytes_;
+    }
+    // False, with nothing stored, for a value over max_value_bytes().
+    bool put(const K& key, const V& val) {
+        if (one_element_size_(val) > shard_bytes_) return false;
+        std::size_t i = shard_of(key);
+        if (policy_ == Policy::CLOCK)
+            clock_shards_[i]->put(key, val);
+        else
+            lru_shards_[i]->put(key, val);
+        return true;
+    }
+    void remove(const K& key) {
+        std::size_t i = shard_of(key);
+        if (policy_ == Policy::CLOCK)
+            clock_shards_[i]->remove(key);
+        else
+            lru_shards_[i]->remove(key);
+    }
+    int size() {
+        int total = 0;
+        for (auto& shard : clock_shards_) total += shard->size();
+        for (auto& shard : lru_shards_) total += shard->size();
+        return total;
+    }
+    long byte_size() {
+        long total = 0;
+        for (auto& shard : clock_shards_) total += shard->byte_size();
+        for (auto& shard : lru_shards_) total += shard->byte_size();
+        return total;
+    }
+    sharded_cache(const sharded_cache&) = delete;
+    sharded_cache& operator=(const sharded_cache&) = delete;
+
+   private:
+    std::size_t shard_of(const K& key) const {
+        std::size_t count = policy_ == Policy::CLOCK ? clock_shards_.size() : lru_shards_.size();
+        // Mix the hash so shard selection doesn't reuse the low bits the shard's own table uses.
+        std::uint64_t h = static_cast<std::uint64_t>(std::hash<K>()(key)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<std::size_t>((h >> 32) % count);
+    }
+
+    Policy policy_;
+    std::function<long(const V&)> one_element_size_;
+    long shard_bytes_ = 0;
+    std::vector<std::unique_ptr<lru_map<K, V>>> lru_shards_;
+    std::vector<std::unique_ptr<clock_map<K, V>>> clock_shards_;
+};
@@ -0,0 +1,156 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Capacity is rounded up to a power of two. push() fails instead of blocking when full.
+template <typename T>
+class spsc_ring {
+   public:
+    explicit spsc_ring(std::size_t capacity) : mask_(round_up(capacity) - 1), slots_(mask_ + 1) {}
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    bool push(T&& value) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ > mask_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ > mask_) return false;
+        }
+        slots_[head & mask_] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& out) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) return false;
+        }
+        out = std::move(slots_[tail & mask_]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+   private:
+    static std::size_t round_up(std::size_t n) {
+        std::size_t c = 2;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+    // Producer and consumer indices live on separate cache lines, each next to
+    // the side's private copy of the other index.
+    alignas(64) std::atomic<std::size_t> head_{0};
+    std::size_t tail_cache_ = 0;
+    alignas(64) std::atomic<std::size_t> tail_{0};
+    std::size_t head_cache_ = 0;
+    alignas(64) const std::size_t mask_;
+    std::vector<T> slots_;
+};
+
+// Gives every producer thread its own spsc_ring, so any number of threads can push
+// without locking while a single consumer thread drains them all. A push into a
+// full ring is dropped and counted.
+template <typename T>
+class per_thread_rings {
+   public:
+    struct Ring : spsc_ring<T> {
+        Ring(std::size_t capacity, unsigned id) : spsc_ring<T>(capacity), id(id) {}
+        const unsigned id;
+        std::atomic<std::uint64_t> dropped{0};
+        std::atomic<bool> retired{false};
+    };
+
+    explicit per_thread_rings(std::size_t capacity) : capacity_(capacity) {}
+
+    // Applies to threads that push for the first time afterwards.
+    void set_capacity(std::size_t capacity) {
+        capacity_.store(capacity < 2 ? 2 : capacity, std::memory_order_relaxed);
+    }
+
+    // The calling thread's ring, created and registered on first use.
+    Ring& local() {
+        thread_local Owner owner;
+        for (auto& [rings, ring] : owner.rings) {
+            if (rings == this) return *ring;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto ring = std::make_shared<Ring>(capacity_.load(std::memory_order_relaxed), next_id_++);
+        rings_.push_back(ring);
+        owner.rings.emplace_back(this, ring);
+        return *ring;
+    }
+
+    bool push(T&& value) {
+        Ring& ring = local();
+        if (ring.push(std::move(value))) return true;
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Consumer side. Pops at most one ring's capacity from each ring per call, so one
+    // busy producer cannot starve the others, calling on_item(ring, item) for every item
+    // and on_dropped(ring, count) when the ring dropped pushes since the last call.
+    // Rings of exited threads are released once empty. Returns the number of items.
+    template <typename OnItem, typename OnDropped>
+    std::size_t drain(OnItem&& on_item, OnDropped&& on_dropped) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            snapshot_ = rings_;
+        }
+        std::size_t total = 0;
+        bool any_retired = false;
+        for (auto& ring : snapshot_) {
+            for (std::size_t n = 0; n < ring->capacity() && ring->pop(item_); n++, total++) {
+                on_item(*ring, item_);
+            }
+            std::uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) on_dropped(*ring, dropped);
+            any_retired |= ring->retired.load(std::memory_order_acquire);
+        }
+        if (total == 0 && any_retired) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const auto& ring) {
+                return ring->retired.load(std::memory_order_acquire) && ring->empty();
+            }), rings_.end());
+        }
+        snapshot_.clear();
+        return total;
+    }
+
+   private:
+    // Marks the thread's rings as retired when the thread exits.
+    struct Owner {
+        std::vector<std::pair<const per_thread_rings*, std::shared_ptr<Ring>>> rings;
+        ~Owner() {
+            for (auto& entry : rings) entry.second->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    std::atomic<std::size_t> capacity_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    unsigned next_id_ = 0;
+    // Consumer-only scratch.
+    std::vector<std::shared_ptr<Ring>> snapshot_;
+    T item_;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+// OpenSSL declares a global type named CONF, which is taken by the server config, so
+// its headers see that name as something else. Nothing here uses OpenSSL's config API.
+#define CONF openssl_CONF
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/ssl.hpp>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#undef CONF
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "config.hpp"
+
+namespace serv {
+
+// TLS termination on the server's own acceptor. One context is shared by every acceptor,
+// so the session cache and the ticket keys cover all IO threads and shards.
+namespace tls {
+
+// Writes a self-signed certificate for localhost, so TLS=true works out of the box for
+// local testing. Never used when the configured files exist.
+inline bool writeSelfSigned(const std::string& cert_path, const std::string& key_path) {
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(EVP_EC_gen("P-256"), EVP_PKEY_free);
+    std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), X509_free);
+    if (!key || !cert) return false;
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), static_cast<long>(std::time(nullptr)));
+    X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert.get()), 365L * 24 * 60 * 60);
+    X509_set_pubkey(cert.get(), key.get());
+    X509_NAME* name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert.get(), cert.get(), nullptr, nullptr, 0);
+    if (X509_EXTENSION* san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1")) {
+        X509_add_ext(cert.get(), san, -1);
+        X509_EXTENSION_free(san);
+    }
+    if (!X509_sign(cert.get(), key.get(), EVP_sha256())) return false;
+
+    std::error_code ec;
+    for (const auto& path : {cert_path, key_path}) {
+        auto dir = std::filesystem::path(path).parent_path();
+        if (!dir.empty()) std::filesystem::create_directories(dir, ec);
+    }
+    std::unique_ptr<FILE, decltype(&std::fclose)> cert_file(std::fopen(cert_path.c_str(), "wb"), std::fclose);
+    // The key is readable by the owner only, whatever the umask.
+    int key_fd = ::open(key_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (key_fd >= 0) ::fchmod(key_fd, 0600);
+    std::unique_ptr<FILE, decltype(&std::fclose)> key_file(key_fd >= 0 ? ::fdopen(key_fd, "wb") : nullptr, std::fclose);
+    if (key_fd >= 0 && !key_file) ::close(key_fd);
+    if (!cert_file || !key_file) return false;
+    return PEM_write_X509(cert_file.get(), cert.get()) &&
+           PEM_write_PrivateKey(key_file.get(), key.get(), nullptr, nullptr, 0, nullptr, nullptr);
+}
+
+// ALPN: HTTP/1.1 only; h2 is offered in cleartext (h2c) alone.
+inline int selectAlpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*) {
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char* selected = nullptr;
+    if (SSL_select_next_proto(&selected, outlen, http11, sizeof(http11) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Builds the server context from TLS_CERT / TLS_KEY; nullptr (and an error logged) if
+// they cannot be loaded.
+inline std::shared_ptr<boost::asio::ssl::context> makeContext(const Config& config) {
+    namespace ssl = boost::asio::ssl;
+    if (!std::filesystem::exists(config.tls_cert) && !std::filesystem::exists(config.tls_key)) {
+        _LOGGER_.warning("No certificate at " + config.tls_cert + ", generating a self-signed one for localhost.");
+        if (!writeSelfSigned(config.tls_cert, config.tls_key)) {
+            _LOGGER_.error("Failed to write a self-signed certificate.");
+            return nullptr;
+        }
+    }
+    auto context = std::make_shared<ssl::context>(ssl::context::tls_server);
+    boost::system::error_code ec;
+    context->set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3 |
+                         ssl::context::no_tlsv1 | ssl::context::no_tlsv1_1 | ssl::context::single_dh_use, ec);
+    context->use_certificate_chain_file(config.tls_cert, ec);
+    if (!ec) context->use_private_key_file(config.tls_key, ssl::context::pem, ec);
+    if (ec) {
+        _LOGGER_.error("Failed to load TLS certificate or key: " + ec.message());
+        return nullptr;
+    }
+
+    SSL_CTX* ctx = context->native_handle();
+    // Resumption: a server-side session cache for clients that resume by id, and
+    // stateless tickets (keys generated per process) for the rest.
+    static const unsigned char session_context[] = "crouter";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    if (config.tls_session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, config.tls_session_cache);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    if (!config.tls_session_tickets) SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    // Kernel TLS: after the handshake OpenSSL hands the send side's record layer to the
+    // kernel when it supports the cipher, which lets file bodies go out with sendfile.
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, nullptr);
+    return context;
+}
+
+}  // namespace tls
+
+// The byte stream a Session reads and writes: plain TCP, or TLS over it. The TLS side
+// stays in user space for reads; writes go through OpenSSL, which passes them to kernel
+// TLS when that was enabled for the connection.
+class Transport {
+   public:
+    using TlsStream = boost::beast::ssl_stream<boost::beast::tcp_stream>;
+
+    explicit Transport(boost::asio::ip::tcp::socket socket) : tcp_(std::move(socket)) {}
+
+    Transport(boost::asio::ip::tcp::socket socket, boost::asio::ssl::context& context)
+        : tcp_(socket.get_executor()),
+          tls_(std::make_unique<TlsStream>(boost::beast::tcp_stream(std::move(socket)), context)) {}
+
+    bool tls() const {
+        return tls_ != nullptr;
+    }
+
+    boost::beast::tcp_stream& tcp() {
+        return tls_ ? boost::beast::get_lowest_layer(*tls_) : tcp_;
+    }
+
+    boost::asio::ip::tcp::socket& socket() {
+        return tcp().socket();
+    }
+
+    template <class Duration>
+    void expires_after(Duration duration) {
+        tcp().expires_after(duration);
+    }
+
+    void expires_never() {
+        tcp().expires_never();
+    }
+
+    template <class Handler>
+    void async_handshake(Handler&& handler) {
+        tls_->async_handshake(boost::asio::ssl::stream_base::server, std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void async_shutdown(Handler&& handler) {
+        tls_->async_shutdown(std::forward<Handler>(handler));
+    }
+
+    template <class Buffers, class Handler>
+    void async_read_some(const Buffers& buffers, Handler&& handler) {
+        if (tls_) {
+            tls_->async_read_some(buffers, std::forward<Handler>(handler));
+        } else {
+            tcp_.async_read_some(buffers, std::forward<Handler>(handler));
+        }
+    }
+
+    template <class Buffers, class Handler>
+    void async_write(const Buffers& buffers, Handler&& handler) {
+        if (tls_) {
+            boost::asio::async_write(*tls_, buffers, std::forward<Handler>(handler));
+        } else {
+            boost::asio::async_write(tcp_, buffers, std::forward<Handler>(handler));
+        }
+    }
+
+    // True once OpenSSL has moved the send side to kernel TLS.
+    bool ktls() const {
+#ifdef SSL_OP_ENABLE_KTLS
+        return tls_ && BIO_get_ktls_send(SSL_get_wbio(tls_->native_handle()));
+#else
+        return false;
+#endif
+    }
+
+    bool resumed() const {
+        return tls_ && SSL_session_reused(tls_->native_handle());
+    }
+
+    // File bodies can be handed to the kernel: plain TCP, or TLS with kernel TLS on.
+    bool canSendfile() const {
+#ifdef __linux__
+        return !tls_ || ktls();
+#else
+        return false;
+#endif
+    }
+
+#ifdef __linux__
+    // One sendfile call on the non-blocking socket. Returns bytes sent, or -1 with errno
+    // set (EAGAIN when the socket is full).
+    ssize_t sendfile(int fd, std::uint64_t offset, std::size_t count) {
+        if (!tls_) {
+            off_t off = static_cast<off_t>(offset);
+            return ::sendfile(socket().native_handle(), fd, &off, count);
+        }
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL* ssl = tls_->native_handle();
+        ossl_ssize_t sent = SSL_sendfile(ssl, fd, static_cast<off_t>(offset), count, 0);
+        if (sent < 0 && SSL_get_error(ssl, static_cast<int>(sent)) == SSL_ERROR_WANT_WRITE) errno = EAGAIN;
+        return static_cast<ssize_t>(sent);
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+#endif
+
+    // The plain stream, for handing the connection to a websocket or HTTP/2 session.
+    boost::beast::tcp_stream& plain() {
+        return tcp_;
+    }
+
+   private:
+    boost::beast::tcp_stream tcp_;
+    std::unique_ptr<TlsStream> tls_;
+};
+
+}  // namespace serv
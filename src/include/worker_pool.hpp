@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Runs heavy handlers and websocket callbacks off the IO threads.
+// Shared mode keeps one FIFO queue for all workers. Stealing mode gives every worker
+// its own deque: tasks posted from outside are spread round-robin, a worker runs its
+// own tasks oldest first and, once out of work, steals the newest task of another
+// worker, so a queue stuck behind one long task is drained by the idle workers.
+// Queue depth and the time tasks wait before starting are reported to _METRICS_.
+class WorkerPool {
+   public:
+    enum class Mode { Shared, Stealing };
+
+    static Mode parseMode(const std::string& name) {
+        return name == "steal" || name == "stealing" ? Mode::Stealing : Mode::Shared;
+    }
+
+    using ErrorHandler = std::function<void(const std::string&)>;
+
+    // threads == 0 means one worker per core. on_error receives exceptions escaping a task.
+    WorkerPool(std::size_t threads, Mode mode, ErrorHandler on_error = nullptr) : mode_(mode), on_error_(std::move(on_error)) {
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        queues_.reserve(mode_ == Mode::Stealing ? threads : 1);
+        for (std::size_t i = 0; i < (mode_ == Mode::Stealing ? threads : 1); i++) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        for (std::size_t i = 0; i < threads; i++) {
+            workers_.emplace_back([this, i] { run(i); });
+        }
+    }
+    ~WorkerPool() {
+        stop();
+        join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void post(std::function<void()> func) {
+        if (stopping_.load(std::memory_order_relaxed)) return;
+        Task task{std::move(func), std::chrono::steady_clock::now()};
+        Queue& queue = pick_queue();
+        _METRICS_.workerQueued();
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        pending_.fetch_add(1);
+        if (sleepers_.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    // Workers finish their current task and exit; queued tasks are discarded.
+    void stop() {
+        stopping_.store(true);
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        wake_.notify_all();
+    }
+    void join() {
+        for (auto& worker : workers_) {
+            if (worker.joinable() && worker.get_id() != std::this_thread::get_id()) worker.join();
+        }
+    }
+
+    std::size_t size() const { return workers_.size(); }
+    std::size_t queueDepth() const {
+        std::int64_t pending = pending_.load(std::memory_order_relaxed);
+        return pending > 0 ? static_cast<std::size_t>(pending) : 0;
+    }
+
+   private:
+    struct Task {
+        std::function<void()> func;
+        std::chrono::steady_clock::time_point queued_at;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    Queue& pick_queue() {
+        if (queues_.size() == 1) return *queues_[0];
+        // A worker posting follow-up work keeps it local.
+        if (current_worker_ != nullptr && current_worker_->pool == this) return *queues_[current_worker_->index];
+        return *queues_[next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size()];
+    }
+
+    bool take(std::size_t index, Task& out) {
+        Queue& own = *queues_[mode_ == Mode::Stealing ? index : 0];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                out = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < queues_.size(); i++) {
+            Queue& victim = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                out = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(std::size_t index) {
+        WorkerId id{this, index};
+        current_worker_ = &id;
+        Task task;
+        while (!stopping_.load()) {
+            if (pending_.load() > 0 && take(index, task)) {
+                pending_.fetch_sub(1);
+                _METRICS_.workerStarted(static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - task.queued_at).count()));
+                try {
+                    task.func();
+                } catch (const std::exception& e) {
+                    if (on_error_) on_error_(e.what());
+                } catch (...) {
+                    if (on_error_) on_error_("unknown exception");
+                }
+                task.func = nullptr;
+                continue;
+            }
+            // Registering as a sleeper before re-checking pending_ pairs with post(),
+            // which bumps pending_ before looking for sleepers, so no wakeup is lost.
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleepers_.fetch_add(1);
+            wake_.wait(lock, [this] { return pending_.load() > 0 || stopping_.load(); });
+            sleepers_.fetch_sub(1);
+        }
+        current_worker_ = nullptr;
+    }
+
+    struct WorkerId {
+        const WorkerPool* pool;
+        std::size_t index;
+    };
+    inline static thread_local WorkerId* current_worker_ = nullptr;
+
+    const Mode mode_;
+    ErrorHandler on_error_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> next_queue_{0};
+    std::atomic<std::int64_t> pending_{0};
+    std::atomic<int> sleepers_{0};
+    std::atomic<bool> stopping_{false};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+};
@@ -21,99 +21,164 @@ int main() {
 
     Config& config = CONF;
 
-    _PLUGINS_::loadPlugins("./app/handlers");
+    // Set up before anything else starts, so a broken TLS setup never ends up serving
+    // the port in cleartext.
+    std::shared_ptr<boost::asio::ssl::context> tls_context = nullptr;
+    if (config.tls) {
+        tls_context = serv::tls::makeContext(config);
+        if (!tls_context) {
+            logger.error("TLS is enabled but could not be set up, exiting.");
+            logger.stop();
+            return 1;
+        }
+    }
 
-    std::unique_ptr<LibWraper> def_lib = nullptr;
-    std::shared_ptr<IPlugin> p_instance = nullptr;
+    _METRICS_.setEnabled(config.metrics);
+    if (config.access_log) {
+        _ACCESS_LOG_.start(config.access_log_dir, config.access_log_max_mb * 1024 * 1024,
+                           config.access_log_rotate_minutes * 60, 8192);
+    }
 
-    std::function<Response(Request&)> defaultHandler = nullptr;
-    bool defaultHeavy = false;
-    if (config.default_request_handler) {
-        _default_req_handler::load();
-        defaultHandler = _default_req_handler::func;
-    } else {
-        auto it = _PLUGINS_::loadedPlugins.find(config.custom_default_handler);
-        if(it != _PLUGINS_::loadedPlugins.end()){
-            def_lib = std::move(it->second.lib);
-            p_instance = it->second.instance;
-            defaultHandler = [&p_instance](Request& req) -> Response {
-                return p_instance->handle(req);
-            };
-            defaultHeavy = p_instance->isHeavy();
-            _PLUGINS_::loadedPlugins.erase(it);
-            logger.log("Custom handler " + config.custom_default_handler + "loaded successfully.");
-        } else {
+    _PLUGINS_::loadPlugins("./app/handlers");
+
+    // What answers requests no route matches. Replaced as a whole on reload, so a request
+    // keeps the handler (and the custom handler's plugin) it started with.
+    struct DefaultHandler {
+        std::function<Response(Request&)> func = nullptr;
+        bool heavy = false;
+        // Set for a custom default handler.
+        std::shared_ptr<IPlugin> plugin = nullptr;
+    };
+    // Takes the custom handler out of loadedPlugins, so call it before buildRouter().
+    auto loadDefaultHandler = [&config, &logger]() -> std::shared_ptr<const DefaultHandler> {
+        auto handler = std::make_shared<DefaultHandler>();
+        if (!config.default_request_handler) {
+            auto it = _PLUGINS_::loadedPlugins.find(config.custom_default_handler);
+            if(it != _PLUGINS_::loadedPlugins.end()){
+                handler->plugin = _PLUGINS_::pin(it->second);
+                handler->func = [pl = handler->plugin](Request& req) -> Response {
+                    return pl->handle(req);
+                };
+                handler->heavy = handler->plugin->isHeavy();
+                _PLUGINS_::loadedPlugins.erase(it);
+                logger.log("Custom handler " + config.custom_default_handler + "loaded successfully.");
+                return handler;
+            }
             logger.error("Failed to find the custom handler " + config.custom_default_handler);
-            _default_req_handler::load();
-            defaultHandler = _default_req_handler::func;
         }
-    }
+        _default_req_handler::load();
+        handler->func = _default_req_handler::func;
+        return handler;
+    };
+    std::shared_ptr<const DefaultHandler> defaultHandler = loadDefaultHandler();
+    _PLUGINS_::buildRouter();
 
 
     boost::asio::io_context io_commands;
     CommandExecutor exe(io_commands);
     
     try {
-        boost::asio::io_context io_context;
-        boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard(io_context.get_executor());
+        // Shared mode: one io_context driven by every IO thread behind a single acceptor.
+        // Sharded mode: one io_context, one thread and one SO_REUSEPORT acceptor per core,
+        // so the kernel spreads connections and a session never leaves its loop.
+        int io_thread_count = std::thread::hardware_concurrency();
+        if (io_thread_count < 1) io_thread_count = 1;
+        bool sharded = config.io_sharding && serv::Server::reuse_port_supported;
+        if (config.io_sharding && !sharded) {
+            logger.warning("IO_SHARDING requires SO_REUSEPORT, which this platform lacks. Falling back to a shared io_context.");
+        }
+
+        std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts;
+        for (int i = 0; i < (sharded ? io_thread_count : 1); i++) {
+            io_contexts.push_back(std::make_unique<boost::asio::io_context>(sharded ? 1 : io_thread_count));
+        }
+        std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_guards;
+        for (auto& io_context : io_contexts) {
+            work_guards.push_back(boost::asio::make_work_guard(*io_context));
+        }
+        auto stop_io = [&io_contexts]() {
+            for (auto& io_context : io_contexts) io_context->stop();
+        };
 
-        Command exit_cmd("exit", [&io_context, &io_commands](Command::Arguments) {
+        Command exit_cmd("exit", [&stop_io, &io_commands](Command::Arguments) {
             io_commands.stop();
-            io_context.stop();
+            stop_io();
         });
         exe.register_(exit_cmd);
     
 
-        boost::asio::thread_pool worker_pool(4);
-
-        serv::Server server(io_context, config.port, worker_pool, [&defaultHandler, &defaultHeavy](Request& r) -> serv::Handler {
-            serv::Handler h = {defaultHandler, defaultHeavy};
-
-            std::string main_route = r.uri.size() > 1 ? r.uri.substr(1, r.uri.find("/", 1)-1) : "";
-            
-            auto pl = _PLUGINS_::getPlugin(main_route);
-            if(pl){
-                h.func = [&pl](Request& request) -> Response { return pl->handle(request); };
+        WorkerPool worker_pool(config.worker_threads, WorkerPool::parseMode(config.worker_pool),
+            [&logger](const std::string& what) { logger.error("Uncaught exception in worker: " + what); });
+        logger.log("Worker pool: " + std::to_string(worker_pool.size()) + " threads (" + config.worker_pool + ")");
+
+        // A plugin's isHeavy() always wins; otherwise its execution() override, and for
+        // Execution::Auto the route's measured latency, picks the thread.
+        auto place = [](serv::Handler& h, IPlugin* pl, Request& r) {
+            if (h.isHeavy) return;
+            Execution execution = pl ? pl->execution(r) : Execution::Auto;
+            if (execution == Execution::Heavy) {
+                h.isHeavy = true;
+            } else if (execution == Execution::Auto && _ADAPTIVE_.enabled()) {
+                h.adaptive = true;
+                h.isHeavy = _ADAPTIVE_.heavy(h.route_id);
+            }
+        };
+
+        serv::HandlerBuilder handler_builder = [&defaultHandler, &place](Request& r) -> serv::Handler {
+            std::shared_ptr<const DefaultHandler> fallback = std::atomic_load(&defaultHandler);
+            serv::Handler h = {fallback->func, fallback->heavy};
+
+            // The handler holds the router until the request is done: path parameters
+            // point at its names, and its routes hold the plugins.
+            auto router = _PLUGINS_::currentRouter();
+            auto match = router->match(r.method, r.path(), r);
+            if (match.value) {
+                auto pl = match.value->plugin;
+                h.func = [pl, router](Request& request) -> Response { return pl->handle(request); };
                 h.isHeavy = pl->isHeavy();
+                h.route = match.value->route;
+                h.route_id = match.value->metrics_id;
+#ifdef CROUTER_ASYNC
+                if (IAsyncPlugin* async = pl->asAsync()) {
+                    h.async = [pl, router, async](Request& request, IAsyncIO& io) { return async->handleAsync(request, io); };
+                    h.isHeavy = false;
+                    return h;
+                }
+#endif
+                place(h, pl.get(), r);
+            } else if (match.method_not_allowed) {
+                h.func = [allow = std::move(match.allow)](Request&) -> Response {
+                    Response res;
+                    res.setStatus(405, "Method Not Allowed");
+                    res.setHeader("Allow", allow);
+                    res.setBody("Method Not Allowed");
+                    return res;
+                };
+                h.isHeavy = false;
+            } else {
+                place(h, fallback->heavy ? nullptr : fallback->plugin.get(), r);
             }
 
             return h;
-        });
+        };
+        std::vector<std::unique_ptr<serv::Server>> servers;
+        for (auto& io_context : io_contexts) {
+            servers.push_back(std::make_unique<serv::Server>(*io_context, config.port, worker_pool, handler_builder, sharded, tls_context));
+        }
         exe.register_(Command("reload", [&](Command::Arguments args) {
             logger.log("Reloading ./.env . . .");
             loadConfig("./.env");
             logger.log("Reloaded ./.env");
-            
-            def_lib = nullptr;
-            defaultHandler = nullptr;
-            defaultHeavy = false;
 
+            // The current plugins keep serving while the new ones compile; requests
+            // switch over when the new router is published.
             logger.log("Reloading ./app/handlers/ . . .");
-            _PLUGINS_::clear();
             _PLUGINS_::loadPlugins("./app/handlers");
             logger.log("Reloaded ./app/handlers/");
             
             logger.log("Reloading default handler . . .");
-            if (config.default_request_handler) {
-                _default_req_handler::load();
-                defaultHandler = _default_req_handler::func;
-            } else {
-                auto it = _PLUGINS_::loadedPlugins.find(config.custom_default_handler);
-                if(it != _PLUGINS_::loadedPlugins.end()){
-                    def_lib = std::move(it->second.lib);
-                    p_instance = it->second.instance;
-                    defaultHandler = [&p_instance](Request& req) -> Response {
-                        return p_instance->handle(req);
-                    };
-                    defaultHeavy = p_instance->isHeavy();
-                    _PLUGINS_::loadedPlugins.erase(it);
-                    logger.log("Custom handler " + config.custom_default_handler + "loaded successfully.");
-                } else {
-                    logger.error("Failed to find the custom handler " + config.custom_default_handler);
-                    _default_req_handler::load();
-                    defaultHandler = _default_req_handler::func;
-                }
-            }
+            std::atomic_store(&defaultHandler, loadDefaultHandler());
+            _PLUGINS_::buildRouter();
             logger.log("Reloaded default handler\n");
 
             logger.log("!!!");
@@ -122,13 +187,14 @@ int main() {
 
         }));
 
-        logger.log("Server listening on port " + std::to_string(server.getPort()));
+        logger.log("Server listening on port " + std::to_string(servers.front()->getPort()) + (tls_context ? " (TLS)" : "") +
+                   (sharded ? " with " + std::to_string(servers.size()) + " SO_REUSEPORT shards" : ""));
 
-        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        boost::asio::signal_set signals(*io_contexts.front(), SIGINT, SIGTERM);
         signals.async_wait([&](const boost::system::error_code& error, int signal_number) {
             if (!error) {
                 logger.log("Signal received (" + std::to_string(signal_number) + "), shutting down io_context...");
-                io_context.stop();
+                stop_io();
                 worker_pool.stop();
                 worker_pool.join();
             } else {
@@ -137,10 +203,12 @@ int main() {
         });
 
         std::vector<std::thread> io_threads;
-        int io_thread_count = std::thread::hardware_concurrency();
         logger.log("Starting " + std::to_string(io_thread_count) + " io_context threads...");
         for (int i = 0; i < io_thread_count; i++) {
-            io_threads.emplace_back([&]() {
+            // In sharded mode the main thread drives shard 0.
+            if (sharded && i == 0) continue;
+            boost::asio::io_context& io_context = *io_contexts[sharded ? i : 0];
+            io_threads.emplace_back([&logger, &io_context]() {
                 std::ostringstream oss;
                 oss << std::this_thread::get_id();
                 std::string thread_id_str = oss.str();
@@ -151,7 +219,7 @@ int main() {
         }
 
         logger.log("\033[32mMain thread participating in io_context.run()...");
-        io_context.run();
+        io_contexts.front()->run();
 
         logger.log("io_context has stopped. Waiting for all IO threads to finish...");
         for (std::thread& t : io_threads) {
@@ -159,6 +227,7 @@ int main() {
                 t.join();
             }
         }
+        _ACCESS_LOG_.stop();
         logger.log("All threads joined. Server gracefully shut down.");
 
     } catch (std::exception& e) {
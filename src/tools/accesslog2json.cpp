@@ -0,0 +1,116 @@
+// Converts binary access logs written by CRouter (ACCESS_LOG=true) to JSON lines.
+//
+//   g++ -std=c++17 -O2 -I src/include src/tools/accesslog2json.cpp -o accesslog2json
+//   ./accesslog2json logs/access-*.bin > access.jsonl
+//
+// Reads standard input when no file is given.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "access_record.hpp"
+
+namespace {
+
+void appendEscaped(std::string& out, const char* data, std::size_t size) {
+    for (std::size_t i = 0; i < size; i++) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+}
+
+void appendAddress(std::string& out, const std::uint8_t (&address)[16]) {
+    static const std::uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    char buf[48];
+    if (std::memcmp(address, v4_prefix, sizeof(v4_prefix)) == 0) {
+        std::snprintf(buf, sizeof(buf), "%u.%u.%u.%u", address[12], address[13], address[14], address[15]);
+        out += buf;
+        return;
+    }
+    for (int i = 0; i < 16; i += 2) {
+        std::snprintf(buf, sizeof(buf), i == 0 ? "%x" : ":%x", (address[i] << 8) | address[i + 1]);
+        out += buf;
+    }
+}
+
+void appendTime(std::string& out, std::uint64_t time_us) {
+    std::time_t seconds = static_cast<std::time_t>(time_us / 1000000);
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    char buf[40];
+    std::size_t n = std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(buf + n, sizeof(buf) - n, ".%06uZ", static_cast<unsigned>(time_us % 1000000));
+    out += buf;
+}
+
+bool convert(std::FILE* in, const char* name) {
+    AccessLogHeader header;
+    AccessLogHeader expected;
+    if (std::fread(&header, sizeof(header), 1, in) != 1 ||
+        std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) {
+        std::fprintf(stderr, "%s: not a CRouter access log\n", name);
+        return false;
+    }
+    if (header.version != expected.version || header.record_size != sizeof(AccessRecord)) {
+        std::fprintf(stderr, "%s: unsupported access log version %u (record size %u)\n", name, header.version, header.record_size);
+        return false;
+    }
+
+    AccessRecord record;
+    std::string line;
+    while (std::fread(&record, sizeof(record), 1, in) == 1) {
+        line.clear();
+        line += "{\"time\":\"";
+        appendTime(line, record.time_us);
+        line += "\",\"remote\":\"";
+        appendAddress(line, record.address);
+        line += "\",\"port\":" + std::to_string(record.port);
+        line += ",\"method\":\"";
+        appendEscaped(line, record.method, strnlen(record.method, sizeof(record.method)));
+        line += "\",\"route\":\"";
+        appendEscaped(line, record.route, std::min<std::size_t>(record.route_length, sizeof(record.route)));
+        line += "\",\"status\":" + std::to_string(record.status);
+        line += ",\"bytes\":" + std::to_string(record.bytes);
+        line += ",\"handler_ns\":" + std::to_string(record.handler_ns);
+        line += ",\"total_ns\":" + std::to_string(record.total_ns);
+        line += "}\n";
+        std::fwrite(line.data(), 1, line.size(), stdout);
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) return convert(stdin, "<stdin>") ? 0 : 1;
+
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        std::FILE* in = std::fopen(argv[i], "rb");
+        if (!in) {
+            std::fprintf(stderr, "%s: cannot open\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (!convert(in, argv[i])) status = 1;
+        std::fclose(in);
+    }
+    return status;
+}
@@ -0,0 +1,91 @@
+// Times lru_map operations at growing entry counts. Each operation is amortized O(1),
+// so the cost per operation should stay flat from a thousand entries to a million.
+//
+//   g++ -std=c++17 -O2 -I src/include src/tools/lru_bench.cpp -o lru_bench
+//   ./lru_bench [max_entries]
+//
+// For each size N the map is filled with N entries, then timed on N hits, N misses and
+// N inserts into the full map (each evicting the least recently used entry). Random
+// access into a large map gets slower on any structure once it outgrows the CPU caches,
+// so the same hits are also timed on a bare std::unordered_map of the same keys: the
+// last column, lru_map's hit and evict cost over that lookup, is what must not grow
+// (with the old list-scanning map it grew with N).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lru_map.hpp"
+
+namespace {
+
+constexpr long entry_bytes = 64;
+
+using Clock = std::chrono::steady_clock;
+
+std::string key(std::size_t i) {
+    return "/assets/file-" + std::to_string(i) + ".js";
+}
+
+// Nanoseconds per call of `op(i)` for i in [0, n), keys built beforehand.
+template <class Op>
+double time_per_op(std::size_t n, Op op) {
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < n; i++) op(i);
+    auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return elapsed / static_cast<double>(n);
+}
+
+// A simple LCG, so runs are repeatable and the access order is not sequential.
+std::vector<std::size_t> shuffled(std::size_t n, std::uint64_t seed) {
+    std::vector<std::size_t> order(n);
+    for (std::size_t i = 0; i < n; i++) order[i] = i;
+    for (std::size_t i = n; i > 1; i--) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        std::swap(order[i - 1], order[(seed >> 33) % i]);
+    }
+    return order;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::size_t max_entries = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    if (max_entries < 1000) max_entries = 1000;
+
+    std::printf("%10s %12s %12s %12s %12s %10s\n", "entries", "hit ns/op", "miss ns/op", "evict ns/op", "hash ns/op", "vs hash");
+    for (std::size_t n = 1000; n <= max_entries; n *= 10) {
+        lru_map<std::string, std::string> map([](const std::string& v) -> long { return static_cast<long>(v.size()); },
+                                              static_cast<long>(n) * entry_bytes);
+        std::string value(entry_bytes, 'x');
+        std::vector<std::string> keys(2 * n);
+        for (std::size_t i = 0; i < keys.size(); i++) keys[i] = key(i);
+        for (std::size_t i = 0; i < n; i++) map.put(keys[i], value);
+
+        std::vector<std::size_t> order = shuffled(n, n);
+        std::size_t found = 0;
+        double hit = time_per_op(n, [&](std::size_t i) { found += map.find(keys[order[i]]).has_value(); });
+        double miss = time_per_op(n, [&](std::size_t i) { found += map.find(keys[n + order[i]]).has_value(); });
+        double evict = time_per_op(n, [&](std::size_t i) { map.put(keys[n + i], value); });
+        if (found != n || map.size() != static_cast<int>(n) || map.byte_size() != static_cast<long>(n) * entry_bytes) {
+            std::fprintf(stderr, "lru_map lost track of its entries at %zu\n", n);
+            return 1;
+        }
+
+        std::unordered_map<std::string, std::string> plain;
+        for (std::size_t i = 0; i < n; i++) plain.emplace(keys[i], value);
+        double hash = time_per_op(n, [&](std::size_t i) {
+            auto it = plain.find(keys[order[i]]);
+            std::string copy = it->second;  // lru_map::find returns a copy as well
+            found += copy.size() == entry_bytes;
+        });
+
+        std::printf("%10zu %12.1f %12.1f %12.1f %12.1f %9.2fx\n", n, hit, miss, evict, hash, std::max(hit, evict) / hash);
+    }
+    return 0;
+}